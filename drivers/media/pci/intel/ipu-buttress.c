@@ -351,7 +351,9 @@ static irqreturn_t ipu_buttress_call_isr(struct ipu_bus_device *adev)
 	if (ret == IRQ_WAKE_THREAD && !adev->adrv->isr_threaded)
 		ret = IRQ_NONE;
 
-	adev->adrv->wake_isr_thread = (ret == IRQ_WAKE_THREAD);
+	/* Sticky until the threaded handler has run */
+	if (ret == IRQ_WAKE_THREAD)
+		adev->adrv->wake_isr_thread = true;
 
 	return ret;
 }
@@ -471,9 +473,11 @@ irqreturn_t ipu_buttress_isr_threaded(int irq, void *isp_ptr)
 	dev_dbg(&isp->pdev->dev, "isr: Buttress threaded interrupt handler\n");
 
 	for (i = 0; i < ARRAY_SIZE(ipu_adev_irq_mask); i++) {
-		if (adev[i] && adev[i]->adrv &&
-		    adev[i]->adrv->wake_isr_thread &&
-		    adev[i]->adrv->isr_threaded(adev[i]) == IRQ_HANDLED)
+		if (!adev[i] || !adev[i]->adrv ||
+		    !adev[i]->adrv->wake_isr_thread)
+			continue;
+		adev[i]->adrv->wake_isr_thread = false;
+		if (adev[i]->adrv->isr_threaded(adev[i]) == IRQ_HANDLED)
 			ret = IRQ_HANDLED;
 	}
 
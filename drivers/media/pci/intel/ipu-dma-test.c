@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2024 Intel Corporation
+
+/*
+ * KUnit tests for the IPU DMA buffer allocator, included from ipu-dma.c
+ * so that the static helpers can be reached. Buffers come from the real
+ * page allocator; only the bus device around them is faked. The reserve
+ * pool is shared with the device, run these with no IPU user active.
+ */
+
+#include <kunit/test.h>
+#include <linux/string.h>
+
+struct dma_test {
+	struct ipu_bus_device adev;
+	struct ipu_mmu mmu;
+	struct ipu_dma_mapping dmap;
+	unsigned int dma_pool_mb;
+	bool pool;
+};
+
+static int dma_test_init(struct kunit *test)
+{
+	struct dma_test *t;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+
+	t->adev.dev.init_name = "ipu-dma-test";
+	t->adev.mmu = &t->mmu;
+	t->mmu.dmap = &t->dmap;
+	t->dma_pool_mb = dma_pool_mb;
+
+	test->priv = t;
+
+	return 0;
+}
+
+static void dma_test_exit(struct kunit *test)
+{
+	struct dma_test *t = test->priv;
+
+	if (!t)
+		return;
+
+	if (t->pool)
+		ipu_dma_pool_exit();
+	dma_pool_mb = t->dma_pool_mb;
+}
+
+/*
+ * Check the run layout of pages[] and that the buffer is zeroed,
+ * returns the number of runs and how many of them came from the pool
+ */
+static unsigned int dma_test_check_runs(struct kunit *test,
+					struct page **pages,
+					unsigned int count,
+					unsigned int *pool_runs)
+{
+	unsigned int i, j, order, runs = 0;
+
+	*pool_runs = 0;
+	for (i = 0; i < count; i += 1 << order, runs++) {
+		order = __dma_page_order(pages[i]);
+		KUNIT_EXPECT_LE(test, order, (unsigned int)IPU_DMA_MAX_ORDER);
+		KUNIT_ASSERT_LE(test, i + (1U << order), count);
+		if (page_private(pages[i]) == IPU_DMA_POOL_MAGIC)
+			(*pool_runs)++;
+
+		for (j = 0; j < 1U << order; j++) {
+			KUNIT_EXPECT_PTR_EQ(test, pages[i + j], pages[i] + j);
+			KUNIT_EXPECT_PTR_EQ(test,
+					    memchr_inv(page_address(pages[i + j]),
+						       0, PAGE_SIZE),
+					    NULL);
+		}
+	}
+
+	return runs;
+}
+
+static void dma_test_alloc(struct kunit *test, unsigned int count,
+			   unsigned int *pool_runs)
+{
+	struct dma_test *t = test->priv;
+	struct page **pages;
+	unsigned int runs;
+
+	pages = __dma_alloc_buffer(&t->adev.dev, count << PAGE_SHIFT,
+				   GFP_KERNEL, 0);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, pages);
+
+	runs = dma_test_check_runs(test, pages, count, pool_runs);
+	/* One run per set bit unless an order had to fall back */
+	KUNIT_EXPECT_GE(test, runs, (unsigned int)hweight32(count));
+	kunit_info(test, "%u pages in %u runs\n", count, runs);
+
+	__dma_free_buffer(&t->adev.dev, pages, count << PAGE_SHIFT, 0);
+}
+
+static void dma_test_runs(struct kunit *test)
+{
+	static const unsigned int counts[] = { 1, 3, 17, 513 };
+	unsigned int i, pool_runs;
+
+	for (i = 0; i < ARRAY_SIZE(counts); i++) {
+		dma_test_alloc(test, counts[i], &pool_runs);
+		KUNIT_EXPECT_EQ(test, pool_runs, 0U);
+	}
+}
+
+/* Sizes beyond the largest order are built from runs the buddy can give */
+static void dma_test_max_order(struct kunit *test)
+{
+	unsigned int pool_runs;
+
+	dma_test_alloc(test, (2U << IPU_DMA_MAX_ORDER) + 1, &pool_runs);
+}
+
+/*
+ * With one chunk in the pool, a buffer of three takes the chunk and
+ * falls back to the page allocator for the rest; freeing returns the
+ * chunk to the pool.
+ */
+static void dma_test_pool(struct kunit *test)
+{
+	struct dma_test *t = test->priv;
+	unsigned int pool_runs;
+
+	KUNIT_ASSERT_EQ(test, ipu_dma_pool.nr_total, 0U);
+
+	dma_pool_mb = (PAGE_SIZE << IPU_DMA_POOL_ORDER) >> 20;
+	t->pool = true;
+	KUNIT_ASSERT_EQ(test, ipu_dma_pool_init(&t->adev.dev), 0);
+	KUNIT_ASSERT_EQ(test, ipu_dma_pool.nr_free, 1U);
+
+	dma_test_alloc(test, 3U << IPU_DMA_POOL_ORDER, &pool_runs);
+	KUNIT_EXPECT_EQ(test, pool_runs, 1U);
+	KUNIT_EXPECT_EQ(test, ipu_dma_pool.nr_free, 1U);
+
+	/* Below the chunk size the pool is left alone */
+	dma_test_alloc(test, (1U << IPU_DMA_POOL_ORDER) - 1, &pool_runs);
+	KUNIT_EXPECT_EQ(test, pool_runs, 0U);
+	KUNIT_EXPECT_EQ(test, ipu_dma_pool.nr_free, 1U);
+}
+
+static struct kunit_case dma_test_cases[] = {
+	KUNIT_CASE(dma_test_runs),
+	KUNIT_CASE(dma_test_max_order),
+	KUNIT_CASE(dma_test_pool),
+	{}
+};
+
+static struct kunit_suite dma_test_suite = {
+	.name = "ipu-dma",
+	.init = dma_test_init,
+	.exit = dma_test_exit,
+	.test_cases = dma_test_cases,
+};
+
+kunit_test_suite(dma_test_suite);
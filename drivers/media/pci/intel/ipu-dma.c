@@ -4,12 +4,15 @@
 #include <asm/cacheflush.h>
 
 #include <linux/slab.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/dma-mapping.h>
 #include <linux/gfp.h>
 #include <linux/highmem.h>
 #include <linux/iova.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/scatterlist.h>
 #include <linux/version.h>
 #include <linux/vmalloc.h>
@@ -27,6 +30,15 @@ struct vm_info {
 	dma_addr_t ipu_iova;
 	void *vaddr;
 	unsigned long size;
+	/* PCI address of each physically contiguous run of pages */
+	dma_addr_t *pci_dma_addr;
+	/* Teardown state, released by the MMU after the TLB invalidate */
+	struct ipu_mmu_deferred release;
+	struct device *dev;
+	struct iova *iova;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+	unsigned long attrs;
+#endif
 };
 
 static struct vm_info *get_vm_info(struct ipu_mmu *mmu, dma_addr_t iova)
@@ -43,27 +55,157 @@ static struct vm_info *get_vm_info(struct ipu_mmu *mmu, dma_addr_t iova)
 }
 
 /* Begin of things adapted from arch/arm/mm/dma-mapping.c */
-static void __dma_clear_buffer(struct page *page, size_t size,
+static void __dma_clear_buffer(struct device *dev, struct page *page,
+			       size_t size,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
 			       struct dma_attrs *attrs)
 #else
 			       unsigned long attrs)
 #endif
 {
+	struct ipu_mmu *mmu = to_ipu_bus_device(dev)->mmu;
+	void *ptr = page_address(page);
+	bool skip_sync;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+	skip_sync = dma_get_attr(DMA_ATTR_SKIP_CPU_SYNC, attrs);
+#else
+	skip_sync = attrs & DMA_ATTR_SKIP_CPU_SYNC;
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	/*
+	 * Device-only buffers are zeroed with non-temporal stores so that
+	 * no dirty lines are left behind and no flush is needed.
+	 */
+	if (skip_sync) {
+		size_t off;
+
+		for (off = 0; off < size; off += PAGE_SIZE)
+			memcpy_flushcache(ptr + off, page_address(ZERO_PAGE(0)),
+					  PAGE_SIZE);
+		return;
+	}
+#endif
+
 	/*
 	 * Ensure that the allocated pages are zeroed, and that any data
 	 * lurking in the kernel direct-mapped region is invalidated.
 	 */
-	void *ptr = page_address(page);
-
 	memset(ptr, 0, size);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
-	if (!dma_get_attr(DMA_ATTR_SKIP_CPU_SYNC, attrs))
+	if (!skip_sync) {
 		clflush_cache_range(ptr, size);
+		atomic64_add(size, &mmu->dmap->clflush_alloc_bytes);
+	}
+}
+
+/*
+ * Optional reserve of high-order chunks taken at probe, used before
+ * the page allocator for runs of at least IPU_DMA_POOL_ORDER so that
+ * large buffers allocate in bounded time on a fragmented system.
+ */
+#define IPU_DMA_POOL_ORDER	9
+#define IPU_DMA_POOL_MAGIC	0x1b0d0a11UL
+
+static unsigned int dma_pool_mb;
+module_param(dma_pool_mb, uint, 0444);
+MODULE_PARM_DESC(dma_pool_mb,
+		 "MiB of 2M chunks reserved at probe for IPU DMA buffers");
+
+static struct {
+	spinlock_t lock;	/* Protects free */
+	struct list_head free;
+	unsigned int nr_free;
+	unsigned int nr_total;
+} ipu_dma_pool = {
+	.lock = __SPIN_LOCK_UNLOCKED(ipu_dma_pool.lock),
+	.free = LIST_HEAD_INIT(ipu_dma_pool.free),
+};
+
+static struct page *ipu_dma_pool_get(void)
+{
+	struct page *page = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ipu_dma_pool.lock, flags);
+	if (ipu_dma_pool.nr_free) {
+		page = list_first_entry(&ipu_dma_pool.free, struct page, lru);
+		list_del(&page->lru);
+		ipu_dma_pool.nr_free--;
+	}
+	spin_unlock_irqrestore(&ipu_dma_pool.lock, flags);
+
+	return page;
+}
+
+static void ipu_dma_pool_put(struct page *page)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ipu_dma_pool.lock, flags);
+	list_add(&page->lru, &ipu_dma_pool.free);
+	ipu_dma_pool.nr_free++;
+	spin_unlock_irqrestore(&ipu_dma_pool.lock, flags);
+}
+
+int ipu_dma_pool_init(struct device *dev)
+{
+	unsigned int nr = dma_pool_mb >> (IPU_DMA_POOL_ORDER + PAGE_SHIFT - 20);
+	struct page *page;
+
+	for (; ipu_dma_pool.nr_total < nr; ipu_dma_pool.nr_total++) {
+		page = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_NOWARN,
+				   IPU_DMA_POOL_ORDER);
+		if (!page)
+			break;
+		set_page_private(page, IPU_DMA_POOL_MAGIC);
+		ipu_dma_pool_put(page);
+	}
+
+	if (nr)
+		dev_info(dev, "dma pool: %u of %u chunks reserved\n",
+			 ipu_dma_pool.nr_total, nr);
+
+	return ipu_dma_pool.nr_total < nr ? -ENOMEM : 0;
+}
+
+void ipu_dma_pool_exit(void)
+{
+	struct page *page;
+
+	WARN_ON(ipu_dma_pool.nr_free != ipu_dma_pool.nr_total);
+	while ((page = ipu_dma_pool_get())) {
+		set_page_private(page, 0);
+		__free_pages(page, IPU_DMA_POOL_ORDER);
+	}
+	ipu_dma_pool.nr_total = 0;
+}
+
+/* Highest order the page allocator hands out */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#define IPU_DMA_MAX_ORDER	MAX_PAGE_ORDER
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define IPU_DMA_MAX_ORDER	MAX_ORDER
 #else
-	if ((attrs & DMA_ATTR_SKIP_CPU_SYNC) == 0)
-		clflush_cache_range(ptr, size);
+#define IPU_DMA_MAX_ORDER	(MAX_ORDER - 1)
 #endif
+
+/*
+ * Buffers are built from runs of compound pages which are kept intact:
+ * pages[] lists every 4K page, and the head of each run carries its
+ * order so that mapping and freeing work a run at a time.
+ */
+static unsigned int __dma_page_order(struct page *page)
+{
+	return compound_order(page);
+}
+
+static void __dma_free_run(struct page *page)
+{
+	if (page_private(page) == IPU_DMA_POOL_MAGIC)
+		ipu_dma_pool_put(page);
+	else
+		__free_pages(page, __dma_page_order(page));
 }
 
 static struct page **__dma_alloc_buffer(struct device *dev, size_t size,
@@ -86,31 +228,43 @@ static struct page **__dma_alloc_buffer(struct device *dev, size_t size,
 	gfp |= __GFP_NOWARN;
 
 	while (count) {
-		int j, order = __fls(count);
+		int j, order = min_t(int, __fls(count), IPU_DMA_MAX_ORDER);
+		struct page *page = NULL;
 
-		pages[i] = alloc_pages(gfp, order);
-		while (!pages[i] && order)
-			pages[i] = alloc_pages(gfp, --order);
-		if (!pages[i])
-			goto error;
+		if (order >= IPU_DMA_POOL_ORDER) {
+			page = ipu_dma_pool_get();
+			if (page)
+				order = IPU_DMA_POOL_ORDER;
+		}
 
-		if (order) {
-			split_page(pages[i], order);
-			j = 1 << order;
-			while (--j)
-				pages[i + j] = pages[i] + j;
+		/*
+		 * No compaction, retries or warnings for higher orders,
+		 * failing one just means falling back to the next lower
+		 */
+		while (!page && order) {
+			page = alloc_pages((gfp | __GFP_COMP | __GFP_NORETRY |
+					    __GFP_NOWARN) &
+					   ~__GFP_DIRECT_RECLAIM, order);
+			if (!page)
+				order--;
 		}
+		if (!page)
+			page = alloc_pages(gfp, 0);
+		if (!page)
+			goto error;
+
+		for (j = 0; j < 1 << order; j++)
+			pages[i + j] = page + j;
 
-		__dma_clear_buffer(pages[i], PAGE_SIZE << order, attrs);
+		__dma_clear_buffer(dev, page, PAGE_SIZE << order, attrs);
 		i += 1 << order;
 		count -= 1 << order;
 	}
 
 	return pages;
 error:
-	while (i--)
-		if (pages[i])
-			__free_pages(pages[i], 0);
+	for (count = 0; count < i; count += 1 << __dma_page_order(pages[count]))
+		__dma_free_run(pages[count]);
 	kvfree(pages);
 	return NULL;
 }
@@ -126,11 +280,8 @@ static int __dma_free_buffer(struct device *dev, struct page **pages,
 	int count = size >> PAGE_SHIFT;
 	int i;
 
-	for (i = 0; i < count; i++) {
-		if (pages[i]) {
-			__free_pages(pages[i], 0);
-		}
-	}
+	for (i = 0; i < count; i += 1 << __dma_page_order(pages[i]))
+		__dma_free_run(pages[i]);
 
 	kvfree(pages);
 	return 0;
@@ -158,17 +309,23 @@ static void ipu_dma_sync_single_for_cpu(struct device *dev,
 
 	vaddr = info->vaddr + offset;
 	clflush_cache_range(vaddr, size);
+	atomic64_add(size, &mmu->dmap->clflush_sync_bytes);
 }
 
 static void ipu_dma_sync_sg_for_cpu(struct device *dev,
 				    struct scatterlist *sglist,
 				    int nents, enum dma_data_direction dir)
 {
+	struct ipu_mmu *mmu = to_ipu_bus_device(dev)->mmu;
 	struct scatterlist *sg;
+	u64 bytes = 0;
 	int i;
 
-	for_each_sg(sglist, sg, nents, i)
+	for_each_sg(sglist, sg, nents, i) {
 		clflush_cache_range(page_to_virt(sg_page(sg)), sg->length);
+		bytes += sg->length;
+	}
+	atomic64_add(bytes, &mmu->dmap->clflush_sync_bytes);
 }
 
 static void *ipu_dma_alloc(struct device *dev, size_t size,
@@ -184,6 +341,7 @@ static void *ipu_dma_alloc(struct device *dev, size_t size,
 	struct page **pages;
 	struct iova *iova;
 	struct vm_info *info;
+	unsigned int order, run, nr_runs = 0;
 	int i;
 	int rval;
 	unsigned long count;
@@ -205,28 +363,37 @@ static void *ipu_dma_alloc(struct device *dev, size_t size,
 	if (!pages)
 		goto out_free_iova;
 
+	for (i = 0; i < count; i += 1 << __dma_page_order(pages[i]))
+		nr_runs++;
+	info->pci_dma_addr = kcalloc(nr_runs, sizeof(*info->pci_dma_addr),
+				     GFP_KERNEL);
+	if (!info->pci_dma_addr)
+		goto out_free_buffer;
+
 	dev_dbg(dev, "dma_alloc: iova low pfn %lu, high pfn %lu\n", iova->pfn_lo,
 		iova->pfn_hi);
-	for (i = 0; iova->pfn_lo + i <= iova->pfn_hi; i++) {
+	for (i = 0, run = 0; i < count; i += 1 << order, run++) {
+		order = __dma_page_order(pages[i]);
 		pci_dma_addr = dma_map_page_attrs(&pdev->dev, pages[i], 0,
-						  PAGE_SIZE, DMA_BIDIRECTIONAL,
-						  attrs);
-		dev_dbg(dev, "dma_alloc: mapped pci_dma_addr %pad\n",
-			&pci_dma_addr);
+						  PAGE_SIZE << order,
+						  DMA_BIDIRECTIONAL, attrs);
+		dev_dbg(dev, "dma_alloc: mapped pci_dma_addr %pad order %u\n",
+			&pci_dma_addr, order);
 		if (dma_mapping_error(&pdev->dev, pci_dma_addr)) {
 			dev_err(dev, "pci_dma_mapping for page[%d] failed", i);
 			goto out_unmap;
 		}
+		info->pci_dma_addr[run] = pci_dma_addr;
 
 		rval = ipu_mmu_map(mmu->dmap->mmu_info,
 				   (iova->pfn_lo + i) << PAGE_SHIFT,
-				   pci_dma_addr, PAGE_SIZE);
+				   pci_dma_addr, PAGE_SIZE << order);
 		if (rval) {
 			dev_err(dev, "ipu_mmu_map for pci_dma[%d] %pad failed",
 				i, &pci_dma_addr);
 			dma_unmap_page_attrs(&pdev->dev, pci_dma_addr,
-					     PAGE_SIZE, DMA_BIDIRECTIONAL,
-					     attrs);
+					     PAGE_SIZE << order,
+					     DMA_BIDIRECTIONAL, attrs);
 			goto out_unmap;
 		}
 	}
@@ -245,26 +412,61 @@ static void *ipu_dma_alloc(struct device *dev, size_t size,
 	return info->vaddr;
 
 out_unmap:
-	for (i--; i >= 0; i--) {
+	count = i;
+	for (i = 0; i < count; i += 1 << order) {
+		order = __dma_page_order(pages[i]);
 		ipu_iova = (iova->pfn_lo + i) << PAGE_SHIFT;
 		pci_dma_addr = ipu_mmu_iova_to_phys(mmu->dmap->mmu_info,
 						    ipu_iova);
-		dma_unmap_page_attrs(&pdev->dev, pci_dma_addr, PAGE_SIZE,
-				     DMA_BIDIRECTIONAL, attrs);
+		dma_unmap_page_attrs(&pdev->dev, pci_dma_addr,
+				     PAGE_SIZE << order, DMA_BIDIRECTIONAL,
+				     attrs);
 
-		ipu_mmu_unmap(mmu->dmap->mmu_info, ipu_iova, PAGE_SIZE);
+		ipu_mmu_unmap(mmu->dmap->mmu_info, ipu_iova,
+			      PAGE_SIZE << order);
 	}
 
+out_free_buffer:
 	__dma_free_buffer(dev, pages, size, attrs);
 
 out_free_iova:
 	__free_iova(&mmu->dmap->iovad, iova);
 out_kfree:
+	kfree(info->pci_dma_addr);
 	kfree(info);
 
 	return NULL;
 }
 
+static void ipu_dma_free_release(struct ipu_mmu_deferred *d)
+{
+	struct vm_info *info = container_of(d, struct vm_info, release);
+	struct ipu_mmu *mmu = to_ipu_bus_device(info->dev)->mmu;
+	struct pci_dev *pdev = to_ipu_bus_device(info->dev)->isp->pdev;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+	struct dma_attrs *attrs = NULL;
+#else
+	unsigned long attrs = info->attrs;
+#endif
+	unsigned int order, run;
+	int i;
+
+	for (i = 0, run = 0; i < info->size >> PAGE_SHIFT;
+	     i += 1 << order, run++) {
+		order = __dma_page_order(info->pages[i]);
+		dma_unmap_page_attrs(&pdev->dev, info->pci_dma_addr[run],
+				     PAGE_SIZE << order, DMA_BIDIRECTIONAL,
+				     attrs);
+	}
+
+	__dma_free_buffer(info->dev, info->pages, info->size, attrs);
+
+	__free_iova(&mmu->dmap->iovad, info->iova);
+
+	kfree(info->pci_dma_addr);
+	kfree(info);
+}
+
 static void ipu_dma_free(struct device *dev, size_t size, void *vaddr,
 			 dma_addr_t dma_handle,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
@@ -274,13 +476,9 @@ static void ipu_dma_free(struct device *dev, size_t size, void *vaddr,
 #endif
 {
 	struct ipu_mmu *mmu = to_ipu_bus_device(dev)->mmu;
-	struct pci_dev *pdev = to_ipu_bus_device(dev)->isp->pdev;
-	struct page **pages;
 	struct vm_info *info;
 	struct iova *iova = find_iova(&mmu->dmap->iovad,
 				      dma_handle >> PAGE_SHIFT);
-	dma_addr_t pci_dma_addr, ipu_iova;
-	int i;
 
 	if (WARN_ON(!iova))
 		return;
@@ -297,30 +495,22 @@ static void ipu_dma_free(struct device *dev, size_t size, void *vaddr,
 
 	list_del(&info->list);
 
-	size = PAGE_ALIGN(size);
-
-	pages = info->pages;
-
 	vunmap(vaddr);
 
-	for (i = 0; i < size >> PAGE_SHIFT; i++) {
-		ipu_iova = (iova->pfn_lo + i) << PAGE_SHIFT;
-		pci_dma_addr = ipu_mmu_iova_to_phys(mmu->dmap->mmu_info,
-						    ipu_iova);
-		dma_unmap_page_attrs(&pdev->dev, pci_dma_addr, PAGE_SIZE,
-				     DMA_BIDIRECTIONAL, attrs);
-	}
-
 	ipu_mmu_unmap(mmu->dmap->mmu_info, iova->pfn_lo << PAGE_SHIFT,
 		      iova_size(iova) << PAGE_SHIFT);
 
-	__dma_free_buffer(dev, pages, size, attrs);
-
-	mmu->tlb_invalidate(mmu);
-
-	__free_iova(&mmu->dmap->iovad, iova);
-
-	kfree(info);
+	/*
+	 * The pages, their PCI mappings and the IOVA stay allocated until
+	 * the IPU TLB has been invalidated, see ipu_mmu_unmap_defer().
+	 */
+	info->dev = dev;
+	info->iova = iova;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+	info->attrs = attrs;
+#endif
+	info->release.release = ipu_dma_free_release;
+	ipu_mmu_unmap_defer(mmu, &info->release);
 }
 
 static int ipu_dma_mmap(struct device *dev, struct vm_area_struct *vma,
@@ -360,6 +550,169 @@ static int ipu_dma_mmap(struct device *dev, struct vm_area_struct *vma,
 	return 0;
 }
 
+/*
+ * Per-CPU IOVA magazines for the map_sg/unmap_sg path. Userptr and
+ * dmabuf buffers are remapped every frame with a handful of distinct
+ * sizes, so recently freed ranges are kept per size class and handed
+ * out again without going through the iova_domain rbtree. Ranges are
+ * passed around as start pfn and size so that neither direction needs
+ * a find_iova() lookup.
+ */
+static void ipu_iova_cache_drain(struct ipu_dma_mapping *dmap)
+{
+	struct ipu_iova_cpu_cache *cc;
+	struct ipu_iova_magazine *mag;
+	unsigned int cpu, i;
+	unsigned long flags;
+
+	for_each_possible_cpu(cpu) {
+		cc = per_cpu_ptr(dmap->iova_cache, cpu);
+		spin_lock_irqsave(&cc->lock, flags);
+		for (i = 0; i < IPU_IOVA_MAG_CLASSES; i++) {
+			mag = &cc->mag[i];
+			while (mag->nr)
+				free_iova(&dmap->iovad, mag->pfns[--mag->nr]);
+		}
+		spin_unlock_irqrestore(&cc->lock, flags);
+	}
+}
+
+/* Returns the start pfn of the range, 0 on failure */
+static unsigned long ipu_iova_alloc(struct ipu_dma_mapping *dmap,
+				    unsigned long npages,
+				    unsigned long limit_pfn)
+{
+	struct ipu_iova_cpu_cache *cc;
+	unsigned long pfn = 0;
+	struct iova *iova;
+	unsigned long flags;
+	unsigned int i;
+
+	if (!dmap->iova_cache)
+		goto out_alloc;
+
+	cc = raw_cpu_ptr(dmap->iova_cache);
+	spin_lock_irqsave(&cc->lock, flags);
+	for (i = 0; i < IPU_IOVA_MAG_CLASSES; i++) {
+		struct ipu_iova_magazine *mag = &cc->mag[i];
+
+		if (mag->npages == npages && mag->nr) {
+			pfn = mag->pfns[--mag->nr];
+			break;
+		}
+	}
+	if (pfn)
+		cc->hits++;
+	else
+		cc->misses++;
+	spin_unlock_irqrestore(&cc->lock, flags);
+
+	if (pfn) {
+		if (pfn + npages - 1 <= limit_pfn)
+			return pfn;
+		free_iova(&dmap->iovad, pfn);
+	}
+
+out_alloc:
+	iova = alloc_iova(&dmap->iovad, npages, limit_pfn, 0);
+	if (!iova && dmap->iova_cache) {
+		/* The space may all be parked in magazines, give it back */
+		ipu_iova_cache_drain(dmap);
+		iova = alloc_iova(&dmap->iovad, npages, limit_pfn, 0);
+	}
+
+	return iova ? iova->pfn_lo : 0;
+}
+
+static void ipu_iova_free(struct ipu_dma_mapping *dmap, unsigned long pfn,
+			  unsigned long npages)
+{
+	unsigned long evict[IPU_IOVA_MAG_SIZE];
+	struct ipu_iova_magazine *mag = NULL;
+	struct ipu_iova_cpu_cache *cc;
+	unsigned int i, nr_evict = 0;
+	unsigned long flags;
+
+	if (!dmap->iova_cache) {
+		free_iova(&dmap->iovad, pfn);
+		return;
+	}
+
+	cc = raw_cpu_ptr(dmap->iova_cache);
+	spin_lock_irqsave(&cc->lock, flags);
+	for (i = 0; i < IPU_IOVA_MAG_CLASSES; i++) {
+		if (cc->mag[i].npages == npages) {
+			mag = &cc->mag[i];
+			break;
+		}
+		if (!mag && !cc->mag[i].nr)
+			mag = &cc->mag[i];
+	}
+	/* No magazine for this size: evict one class round robin */
+	if (!mag) {
+		mag = &cc->mag[cc->victim++ % IPU_IOVA_MAG_CLASSES];
+		nr_evict = mag->nr;
+		memcpy(evict, mag->pfns, nr_evict * sizeof(evict[0]));
+		mag->nr = 0;
+	}
+	if (mag->npages != npages) {
+		mag->npages = npages;
+		mag->nr = 0;
+	}
+	if (mag->nr < IPU_IOVA_MAG_SIZE) {
+		mag->pfns[mag->nr++] = pfn;
+		pfn = 0;
+	}
+	spin_unlock_irqrestore(&cc->lock, flags);
+
+	for (i = 0; i < nr_evict; i++)
+		free_iova(&dmap->iovad, evict[i]);
+	if (pfn)
+		free_iova(&dmap->iovad, pfn);
+}
+
+int ipu_dma_iova_cache_init(struct ipu_dma_mapping *dmap)
+{
+	unsigned int cpu;
+
+	dmap->iova_cache = alloc_percpu(struct ipu_iova_cpu_cache);
+	if (!dmap->iova_cache)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(dmap->iova_cache, cpu)->lock);
+
+	return 0;
+}
+
+void ipu_dma_iova_cache_destroy(struct ipu_dma_mapping *dmap)
+{
+	if (!dmap->iova_cache)
+		return;
+
+	ipu_iova_cache_drain(dmap);
+
+	free_percpu(dmap->iova_cache);
+	dmap->iova_cache = NULL;
+}
+
+/* IOVA range of an unmapped scatterlist, freed after the TLB invalidate */
+struct ipu_dma_sg_release {
+	struct ipu_mmu_deferred release;
+	struct ipu_dma_mapping *dmap;
+	unsigned long pfn;
+	unsigned long npages;
+};
+
+static void ipu_dma_sg_release(struct ipu_mmu_deferred *d)
+{
+	struct ipu_dma_sg_release *r =
+		container_of(d, struct ipu_dma_sg_release, release);
+
+	ipu_iova_free(r->dmap, r->pfn, r->npages);
+	kfree(r);
+}
+
 static void ipu_dma_unmap_sg(struct device *dev,
 			     struct scatterlist *sglist,
 			     int nents, enum dma_data_direction dir,
@@ -369,19 +722,18 @@ static void ipu_dma_unmap_sg(struct device *dev,
 			     unsigned long attrs)
 #endif
 {
-	int i, npages, count;
+	int i, count;
 	struct scatterlist *sg;
 	dma_addr_t pci_dma_addr;
 	struct ipu_mmu *mmu = to_ipu_bus_device(dev)->mmu;
 	struct pci_dev *pdev = to_ipu_bus_device(dev)->isp->pdev;
-	struct iova *iova = find_iova(&mmu->dmap->iovad,
-				      sg_dma_address(sglist) >> PAGE_SHIFT);
+	struct ipu_dma_sg_release *r;
+	unsigned long pfn, npages;
 
 	if (!nents)
 		return;
 
-	if (WARN_ON(!iova))
-		return;
+	pfn = sg_dma_address(sglist) >> PAGE_SHIFT;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
 	if (!dma_get_attr(DMA_ATTR_SKIP_CPU_SYNC, attrs))
@@ -390,20 +742,25 @@ static void ipu_dma_unmap_sg(struct device *dev,
 #endif
 		ipu_dma_sync_sg_for_cpu(dev, sglist, nents, DMA_BIDIRECTIONAL);
 
-	/* get the nents as orig_nents given by caller */
+	/*
+	 * get the nents as orig_nents given by caller, the mapped entries
+	 * cover the IOVA range back to back as laid out by map_sg
+	 */
 	count = 0;
-	npages = iova_size(iova);
+	npages = 0;
 	for_each_sg(sglist, sg, nents, i) {
 		if (sg_dma_len(sg) == 0 ||
-		    sg_dma_address(sg) == DMA_MAPPING_ERROR)
+		    sg_dma_address(sg) == DMA_MAPPING_ERROR ||
+		    sg_dma_address(sg) != (pfn + npages) << PAGE_SHIFT)
 			break;
 
-		npages -= PAGE_ALIGN(sg_dma_len(sg)) >> PAGE_SHIFT;
+		npages += PAGE_ALIGN(sg_dma_len(sg)) >> PAGE_SHIFT;
 		count++;
-		if (npages <= 0)
-			break;
 	}
 
+	if (WARN_ON(!npages))
+		return;
+
 	/* before ipu mmu unmap, return the pci dma address back to sg
 	 * assume the nents is less than orig_nents as the least granule
 	 * is 1 SZ_4K page
@@ -419,15 +776,30 @@ static void ipu_dma_unmap_sg(struct device *dev,
 	}
 
 	dev_dbg(dev, "ipu_mmu_unmap low pfn %lu high pfn %lu\n",
-		iova->pfn_lo, iova->pfn_hi);
-	ipu_mmu_unmap(mmu->dmap->mmu_info, iova->pfn_lo << PAGE_SHIFT,
-		      iova_size(iova) << PAGE_SHIFT);
-
-	mmu->tlb_invalidate(mmu);
+		pfn, pfn + npages - 1);
+	ipu_mmu_unmap(mmu->dmap->mmu_info, pfn << PAGE_SHIFT,
+		      npages << PAGE_SHIFT);
 
 	dma_unmap_sg_attrs(&pdev->dev, sglist, nents, dir, attrs);
 
-	__free_iova(&mmu->dmap->iovad, iova);
+	/*
+	 * Only the IOVA has to wait for the TLB invalidate, so that it is
+	 * not handed out again while stale entries still translate it.
+	 * The pages belong to the caller, which has stopped the device
+	 * from using them before unmapping.
+	 */
+	r = kmalloc(sizeof(*r), GFP_ATOMIC | __GFP_NOWARN);
+	if (!r) {
+		mmu->tlb_invalidate(mmu);
+		ipu_iova_free(mmu->dmap, pfn, npages);
+		return;
+	}
+
+	r->dmap = mmu->dmap;
+	r->pfn = pfn;
+	r->npages = npages;
+	r->release.release = ipu_dma_sg_release;
+	ipu_mmu_unmap_defer(mmu, &r->release);
 }
 
 static int ipu_dma_map_sg(struct device *dev, struct scatterlist *sglist,
@@ -441,8 +813,7 @@ static int ipu_dma_map_sg(struct device *dev, struct scatterlist *sglist,
 	struct ipu_mmu *mmu = to_ipu_bus_device(dev)->mmu;
 	struct pci_dev *pdev = to_ipu_bus_device(dev)->isp->pdev;
 	struct scatterlist *sg;
-	struct iova *iova;
-	size_t npages = 0;
+	unsigned long pfn, npages = 0;
 	unsigned long iova_addr;
 	int i, count;
 
@@ -458,31 +829,24 @@ static int ipu_dma_map_sg(struct device *dev, struct scatterlist *sglist,
 	for_each_sg(sglist, sg, count, i)
 		npages += PAGE_ALIGN(sg_dma_len(sg)) >> PAGE_SHIFT;
 
-	iova = alloc_iova(&mmu->dmap->iovad, npages,
-			  dma_get_mask(dev) >> PAGE_SHIFT, 0);
-	if (!iova)
+	pfn = ipu_iova_alloc(mmu->dmap, npages,
+			     dma_get_mask(dev) >> PAGE_SHIFT);
+	if (!pfn)
 		return 0;
 
-	dev_dbg(dev, "dmamap: iova low pfn %lu, high pfn %lu\n", iova->pfn_lo,
-		iova->pfn_hi);
+	dev_dbg(dev, "dmamap: iova low pfn %lu, high pfn %lu\n", pfn,
+		pfn + npages - 1);
 
-	iova_addr = iova->pfn_lo;
-	for_each_sg(sglist, sg, count, i) {
-		int rval;
+	if (ipu_mmu_map_sg(mmu->dmap->mmu_info, pfn << PAGE_SHIFT,
+			   sglist, count))
+		goto out_fail;
 
-		dev_dbg(dev, "mapping entry %d: iova 0x%lx phy %pad size %d\n",
+	iova_addr = pfn;
+	for_each_sg(sglist, sg, count, i) {
+		dev_dbg(dev, "mapped entry %d: iova 0x%lx phy %pad size %d\n",
 			i, iova_addr << PAGE_SHIFT,
 			&sg_dma_address(sg), sg_dma_len(sg));
 
-		dev_dbg(dev, "mapping entry %d: sg->length = %d\n", i,
-			sg->length);
-
-		rval = ipu_mmu_map(mmu->dmap->mmu_info, iova_addr << PAGE_SHIFT,
-				   sg_dma_address(sg),
-				   PAGE_ALIGN(sg_dma_len(sg)));
-		if (rval)
-			goto out_fail;
-
 		sg_dma_address(sg) = iova_addr << PAGE_SHIFT;
 
 		iova_addr += PAGE_ALIGN(sg_dma_len(sg)) >> PAGE_SHIFT;
@@ -500,7 +864,8 @@ static int ipu_dma_map_sg(struct device *dev, struct scatterlist *sglist,
 	return count;
 
 out_fail:
-	ipu_dma_unmap_sg(dev, sglist, i, dir, attrs);
+	ipu_iova_free(mmu->dmap, pfn, npages);
+	dma_unmap_sg_attrs(&pdev->dev, sglist, nents, dir, attrs);
 
 	return 0;
 }
@@ -553,3 +918,161 @@ const struct dma_map_ops ipu_dma_ops = {
 	.sync_sg_for_device = ipu_dma_sync_sg_for_cpu,
 	.get_sgtable = ipu_dma_get_sgtable,
 };
+
+#ifdef CONFIG_DEBUG_FS
+#define IPU_DMA_IOVA_DUMP_SIZE	2048
+#define IPU_DMA_IOVA_HOLE_BUCKETS	20
+
+struct ipu_dma_iova_dump {
+	size_t len;
+	char buf[];
+};
+
+static size_t ipu_dma_iova_dump(struct ipu_mmu *mmu, char *buf, size_t size)
+{
+	struct ipu_dma_mapping *dmap = mmu->dmap;
+	struct iova_domain *iovad = &dmap->iovad;
+	unsigned long limit = dmap->mmu_info->aperture_end >> PAGE_SHIFT;
+	unsigned int holes[IPU_DMA_IOVA_HOLE_BUCKETS] = { 0 };
+	unsigned long nr_alloc = 0, alloc_pages = 0;
+	unsigned long nr_cached = 0, cached_pages = 0;
+	unsigned long nr_holes = 0, free_pages = 0, largest = 0;
+	unsigned long prev_end = iovad->start_pfn;
+	u64 hits = 0, misses = 0;
+	struct rb_node *node;
+	unsigned long flags;
+	unsigned int cpu, i;
+	size_t len = 0;
+
+	spin_lock_irqsave(&iovad->iova_rbtree_lock, flags);
+	for (node = rb_first(&iovad->rbroot); ; node = rb_next(node)) {
+		struct iova *iova = node ? rb_entry(node, struct iova, node) :
+			NULL;
+		unsigned long start = iova ? iova->pfn_lo : limit + 1;
+		unsigned long hole;
+
+		if (start > limit)
+			start = limit + 1;
+		hole = start > prev_end ? start - prev_end : 0;
+		if (hole) {
+			nr_holes++;
+			free_pages += hole;
+			largest = max(largest, hole);
+			holes[min_t(unsigned int, ilog2(hole),
+				    IPU_DMA_IOVA_HOLE_BUCKETS - 1)]++;
+		}
+		if (!iova || iova->pfn_lo > limit)
+			break;
+
+		nr_alloc++;
+		alloc_pages += iova_size(iova);
+		prev_end = iova->pfn_hi + 1;
+	}
+	spin_unlock_irqrestore(&iovad->iova_rbtree_lock, flags);
+
+	if (dmap->iova_cache) {
+		for_each_possible_cpu(cpu) {
+			struct ipu_iova_cpu_cache *cc =
+				per_cpu_ptr(dmap->iova_cache, cpu);
+
+			spin_lock_irqsave(&cc->lock, flags);
+			for (i = 0; i < IPU_IOVA_MAG_CLASSES; i++) {
+				nr_cached += cc->mag[i].nr;
+				cached_pages += cc->mag[i].nr *
+					cc->mag[i].npages;
+			}
+			hits += cc->hits;
+			misses += cc->misses;
+			spin_unlock_irqrestore(&cc->lock, flags);
+		}
+	}
+
+	len += scnprintf(buf + len, size - len,
+			 "aperture pfn 0x%lx-0x%lx\n", iovad->start_pfn, limit);
+	len += scnprintf(buf + len, size - len,
+			 "in use: %lu ranges, %lu pages\n",
+			 nr_alloc - nr_cached, alloc_pages - cached_pages);
+	len += scnprintf(buf + len, size - len,
+			 "cached: %lu ranges, %lu pages, hits %llu misses %llu\n",
+			 nr_cached, cached_pages, hits, misses);
+	len += scnprintf(buf + len, size - len,
+			 "free: %lu holes, %lu pages, largest %lu pages\n",
+			 nr_holes, free_pages, largest);
+	for (i = 0; i < IPU_DMA_IOVA_HOLE_BUCKETS; i++)
+		if (holes[i])
+			len += scnprintf(buf + len, size - len,
+					 "  holes %s%lu pages: %u\n",
+					 i == IPU_DMA_IOVA_HOLE_BUCKETS - 1 ?
+					 ">= " : "< ",
+					 i == IPU_DMA_IOVA_HOLE_BUCKETS - 1 ?
+					 1UL << i : 2UL << i, holes[i]);
+
+	return len;
+}
+
+static int ipu_dma_iova_open(struct inode *inode, struct file *file)
+{
+	struct ipu_dma_iova_dump *dump;
+
+	dump = vzalloc(sizeof(*dump) + IPU_DMA_IOVA_DUMP_SIZE);
+	if (!dump)
+		return -ENOMEM;
+
+	dump->len = ipu_dma_iova_dump(inode->i_private, dump->buf,
+				      IPU_DMA_IOVA_DUMP_SIZE);
+	file->private_data = dump;
+
+	return 0;
+}
+
+static ssize_t ipu_dma_iova_read(struct file *file, char __user *buf,
+				 size_t len, loff_t *ppos)
+{
+	struct ipu_dma_iova_dump *dump = file->private_data;
+
+	return simple_read_from_buffer(buf, len, ppos, dump->buf, dump->len);
+}
+
+static int ipu_dma_iova_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations ipu_dma_iova_fops = {
+	.owner = THIS_MODULE,
+	.open = ipu_dma_iova_open,
+	.release = ipu_dma_iova_release,
+	.read = ipu_dma_iova_read,
+	.llseek = no_llseek,
+};
+
+static int ipu_dma_counter_get(void *data, u64 *val)
+{
+	*val = atomic64_read(data);
+	return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(ipu_dma_counter_fops, ipu_dma_counter_get, NULL,
+			"%llu\n");
+
+void ipu_dma_debugfs_init(struct ipu_mmu *mmu, struct dentry *dir)
+{
+	debugfs_create_file("iova", 0400, dir, mmu, &ipu_dma_iova_fops);
+	debugfs_create_file("clflush_alloc_bytes", 0400, dir,
+			    &mmu->dmap->clflush_alloc_bytes,
+			    &ipu_dma_counter_fops);
+	debugfs_create_file("clflush_sync_bytes", 0400, dir,
+			    &mmu->dmap->clflush_sync_bytes,
+			    &ipu_dma_counter_fops);
+}
+#else
+void ipu_dma_debugfs_init(struct ipu_mmu *mmu, struct dentry *dir)
+{
+}
+#endif
+EXPORT_SYMBOL_GPL(ipu_dma_debugfs_init);
+
+#if IS_ENABLED(CONFIG_VIDEO_INTEL_IPU6_DMA_KUNIT_TEST)
+#include "ipu-dma-test.c"
+#endif
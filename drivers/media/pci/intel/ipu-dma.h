@@ -6,14 +6,50 @@
 
 #include <linux/iova.h>
 
+#include <linux/spinlock.h>
+
+struct dentry;
+struct device;
+struct ipu_mmu;
 struct ipu_mmu_info;
 
+#define IPU_IOVA_MAG_SIZE	8
+#define IPU_IOVA_MAG_CLASSES	4
+
+/*
+ * Start pfns of recently freed IOVA ranges of one size. Ranges stay
+ * allocated in the iova_domain rbtree while cached, so they are only
+ * looked up there again when they leave the magazine.
+ */
+struct ipu_iova_magazine {
+	unsigned long npages;
+	unsigned int nr;
+	unsigned long pfns[IPU_IOVA_MAG_SIZE];
+};
+
+struct ipu_iova_cpu_cache {
+	spinlock_t lock;	/* Protects the magazines */
+	unsigned int victim;
+	u64 hits;
+	u64 misses;
+	struct ipu_iova_magazine mag[IPU_IOVA_MAG_CLASSES];
+};
+
 struct ipu_dma_mapping {
 	struct ipu_mmu_info *mmu_info;
 	struct iova_domain iovad;
+	struct ipu_iova_cpu_cache __percpu *iova_cache;
+	atomic64_t clflush_alloc_bytes;
+	atomic64_t clflush_sync_bytes;
 	struct kref ref;
 };
 
 extern const struct dma_map_ops ipu_dma_ops;
 
+int ipu_dma_iova_cache_init(struct ipu_dma_mapping *dmap);
+void ipu_dma_iova_cache_destroy(struct ipu_dma_mapping *dmap);
+void ipu_dma_debugfs_init(struct ipu_mmu *mmu, struct dentry *dir);
+int ipu_dma_pool_init(struct device *dev);
+void ipu_dma_pool_exit(void);
+
 #endif /* IPU_DMA_H */
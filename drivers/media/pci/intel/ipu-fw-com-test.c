@@ -0,0 +1,334 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2024 Intel Corporation
+
+/*
+ * KUnit tests for the FWCOM token queues, included from ipu-fw-com.c so
+ * that the static queue helpers can be reached. The firmware side is
+ * simulated: dmem is plain memory and the "firmware" reads and moves the
+ * queue indexes directly, the way SP does on the other end of a real
+ * queue. The same setup times the token paths for the driver side, and
+ * is exported to the ISYS and PSYS tests, which post real response and
+ * event tokens through it.
+ */
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+#define FW_COM_TEST_QUEUE_SIZE		8
+#define FW_COM_TEST_TOKEN_SIZE		16
+#define FW_COM_TEST_ROUNDS		(4 * (FW_COM_TEST_QUEUE_SIZE + 1))
+#define FW_COM_TEST_BENCH_ITERS		100000
+#define FW_COM_TEST_MAX_QUEUES		8
+
+struct fw_com_test {
+	struct ipu_fw_com_context ctx;
+	struct ipu_fw_sys_queue queues[FW_COM_TEST_MAX_QUEUES];
+	u32 dmem[SYSCOM_QPR_BASE_REG + 2 * FW_COM_TEST_MAX_QUEUES];
+	u8 *buf;
+};
+
+/* A context with nr_in send and nr_out receive queues, memory only */
+static struct fw_com_test *fw_com_test_alloc(struct kunit *test,
+					     unsigned int nr_in,
+					     unsigned int nr_out,
+					     unsigned int token_size)
+{
+	unsigned int buf_size = ipu_sys_queue_buf_size(FW_COM_TEST_QUEUE_SIZE,
+						       token_size);
+	struct ipu_fw_sys_queue_res res;
+	struct fw_com_test *t;
+	unsigned int i;
+
+	if (nr_in + nr_out > FW_COM_TEST_MAX_QUEUES)
+		return NULL;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return NULL;
+	t->buf = kunit_kzalloc(test, (nr_in + nr_out) * buf_size, GFP_KERNEL);
+	if (!t->buf)
+		return NULL;
+
+	/* Lay the queues out exactly as ipu_fw_com_prepare() does */
+	res.reg = SYSCOM_QPR_BASE_REG;
+	res.host_address = (uintptr_t)t->buf;
+	res.vied_address = 0;
+	for (i = 0; i < nr_in + nr_out; i++)
+		ipu_sys_queue_init(&t->queues[i], FW_COM_TEST_QUEUE_SIZE,
+				   token_size, &res);
+
+	t->ctx.dmem_addr = (void __force __iomem *)t->dmem;
+	t->ctx.num_input_queues = nr_in;
+	t->ctx.num_output_queues = nr_out;
+	t->ctx.input_queue = &t->queues[0];
+	t->ctx.output_queue = &t->queues[nr_in];
+
+	return t;
+}
+
+static int fw_com_test_init(struct kunit *test)
+{
+	struct fw_com_test *t;
+
+	t = fw_com_test_alloc(test, 1, 1, FW_COM_TEST_TOKEN_SIZE);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+
+	test->priv = t;
+
+	return 0;
+}
+
+/* Simulated firmware access to the dmem index registers of a queue */
+static u32 *fw_com_test_wr(struct fw_com_test *t, struct ipu_fw_sys_queue *q)
+{
+	return &t->dmem[q->wr_reg + FW_COM_WR_REG / 4];
+}
+
+static u32 *fw_com_test_rd(struct fw_com_test *t, struct ipu_fw_sys_queue *q)
+{
+	return &t->dmem[q->wr_reg + FW_COM_RD_REG / 4];
+}
+
+static void *fw_com_test_slot(struct ipu_fw_sys_queue *q, unsigned int index)
+{
+	return (void *)(uintptr_t)q->host_address + index * q->token_size;
+}
+
+/* Firmware consumes one token of a send queue, returns its payload */
+static u32 fw_com_test_fw_consume(struct kunit *test, struct fw_com_test *t)
+{
+	struct ipu_fw_sys_queue *q = t->ctx.input_queue;
+	u32 *rd = fw_com_test_rd(t, q);
+	u32 seq;
+
+	KUNIT_ASSERT_NE(test, *rd, *fw_com_test_wr(t, q));
+	memcpy(&seq, fw_com_test_slot(q, *rd), sizeof(seq));
+	*rd = inc_index(*rd, q->size);
+
+	return seq;
+}
+
+/* Firmware posts one token on receive queue nr if there is room */
+static bool fw_com_test_fw_post(struct fw_com_test *t, unsigned int nr,
+				const void *token)
+{
+	struct ipu_fw_sys_queue *q = &t->ctx.output_queue[nr];
+	u32 *wr = fw_com_test_wr(t, q);
+
+	if (inc_index(*wr, q->size) == *fw_com_test_rd(t, q))
+		return false;
+
+	memcpy(fw_com_test_slot(q, *wr), token, q->token_size);
+	*wr = inc_index(*wr, q->size);
+
+	return true;
+}
+
+static bool fw_com_test_fw_produce(struct fw_com_test *t, u32 seq)
+{
+	u8 token[FW_COM_TEST_TOKEN_SIZE] = { 0 };
+
+	memcpy(token, &seq, sizeof(seq));
+
+	return fw_com_test_fw_post(t, 0, token);
+}
+
+/*
+ * Firmware end for the ISYS and PSYS tests: a context whose nr_out
+ * receive queues carry token_size tokens, and a way to post to them.
+ */
+struct ipu_fw_com_context *ipu_fw_com_test_alloc(struct kunit *test,
+						 unsigned int nr_out,
+						 unsigned int token_size)
+{
+	struct fw_com_test *t = fw_com_test_alloc(test, 0, nr_out, token_size);
+
+	return t ? &t->ctx : NULL;
+}
+EXPORT_SYMBOL_GPL(ipu_fw_com_test_alloc);
+
+bool ipu_fw_com_test_fw_post(struct ipu_fw_com_context *ctx, unsigned int nr,
+			     const void *token)
+{
+	if (nr >= ctx->num_output_queues)
+		return false;
+
+	return fw_com_test_fw_post(container_of(ctx, struct fw_com_test, ctx),
+				   nr, token);
+}
+EXPORT_SYMBOL_GPL(ipu_fw_com_test_fw_post);
+
+static void fw_com_test_index_math(struct kunit *test)
+{
+	unsigned int size = FW_COM_TEST_QUEUE_SIZE + 1;
+	unsigned int wr, rd;
+
+	for (wr = 0; wr < size; wr++) {
+		KUNIT_EXPECT_EQ(test, inc_index(wr, size),
+				wr == size - 1 ? 0U : wr + 1);
+
+		for (rd = 0; rd < size; rd++) {
+			KUNIT_EXPECT_EQ(test, num_messages(wr, rd, size),
+					(wr + size - rd) % size);
+			KUNIT_EXPECT_EQ(test, num_messages(wr, rd, size) +
+					num_free(wr, rd, size), size);
+		}
+	}
+}
+
+static void fw_com_test_send_wrap(struct kunit *test)
+{
+	struct fw_com_test *t = test->priv;
+	struct ipu_fw_sys_queue *q = t->ctx.input_queue;
+	u32 sent = 0, consumed = 0;
+	unsigned int round, n;
+	void *token;
+
+	for (round = 0; round < FW_COM_TEST_ROUNDS; round++) {
+		/* Fill up: one slot always stays empty */
+		for (n = 0; (token = ipu_send_get_token(&t->ctx, 0)); n++) {
+			KUNIT_EXPECT_PTR_EQ(test, token,
+					    fw_com_test_slot(q,
+						*fw_com_test_wr(t, q)));
+			memcpy(token, &sent, sizeof(sent));
+			sent++;
+			ipu_send_put_token(&t->ctx, 0);
+		}
+		KUNIT_EXPECT_EQ(test, n, q->size - 1);
+		KUNIT_EXPECT_EQ(test,
+				num_messages(*fw_com_test_wr(t, q),
+					     *fw_com_test_rd(t, q), q->size),
+				q->size - 1);
+
+		/*
+		 * Drain a different amount each round so that both
+		 * indexes wrap at every offset of the queue.
+		 */
+		for (n = 0; n <= round % (q->size - 1); n++)
+			KUNIT_EXPECT_EQ(test,
+					fw_com_test_fw_consume(test, t),
+					consumed++);
+	}
+
+	while (*fw_com_test_rd(t, q) != *fw_com_test_wr(t, q))
+		KUNIT_EXPECT_EQ(test, fw_com_test_fw_consume(test, t),
+				consumed++);
+	KUNIT_EXPECT_EQ(test, consumed, sent);
+}
+
+static void fw_com_test_recv_wrap(struct kunit *test)
+{
+	struct fw_com_test *t = test->priv;
+	struct ipu_fw_sys_queue *q = t->ctx.output_queue;
+	u32 produced = 0, received = 0, seq;
+	unsigned int round, n;
+	void *token;
+
+	KUNIT_EXPECT_PTR_EQ(test, ipu_recv_get_token(&t->ctx, 0), NULL);
+
+	for (round = 0; round < FW_COM_TEST_ROUNDS; round++) {
+		for (n = 0; n <= round % q->size; n++)
+			if (fw_com_test_fw_produce(t, produced))
+				produced++;
+		KUNIT_EXPECT_LE(test,
+				num_messages(*fw_com_test_wr(t, q),
+					     *fw_com_test_rd(t, q), q->size),
+				q->size - 1);
+
+		/* Take a little less than was offered, to keep wrapping */
+		for (n = 0; n < round % 3 + 1; n++) {
+			token = ipu_recv_get_token(&t->ctx, 0);
+			if (!token)
+				break;
+			KUNIT_EXPECT_PTR_EQ(test, token,
+					    fw_com_test_slot(q,
+						*fw_com_test_rd(t, q)));
+			memcpy(&seq, token, sizeof(seq));
+			KUNIT_EXPECT_EQ(test, seq, received++);
+			ipu_recv_put_token(&t->ctx, 0);
+		}
+	}
+
+	while ((token = ipu_recv_get_token(&t->ctx, 0))) {
+		memcpy(&seq, token, sizeof(seq));
+		KUNIT_EXPECT_EQ(test, seq, received++);
+		ipu_recv_put_token(&t->ctx, 0);
+	}
+	KUNIT_EXPECT_EQ(test, received, produced);
+}
+
+static void fw_com_test_bad_index(struct kunit *test)
+{
+	struct fw_com_test *t = test->priv;
+
+	/* Indexes out of range in dmem must never yield a token */
+	*fw_com_test_wr(t, t->ctx.input_queue) = t->ctx.input_queue->size;
+	KUNIT_EXPECT_PTR_EQ(test, ipu_send_get_token(&t->ctx, 0), NULL);
+
+	*fw_com_test_wr(t, t->ctx.output_queue) = 1;
+	*fw_com_test_rd(t, t->ctx.output_queue) = t->ctx.output_queue->size;
+	KUNIT_EXPECT_PTR_EQ(test, ipu_recv_get_token(&t->ctx, 0), NULL);
+}
+
+static void fw_com_test_bench_send(struct kunit *test)
+{
+	struct fw_com_test *t = test->priv;
+	struct ipu_fw_sys_queue *q = t->ctx.input_queue;
+	unsigned int i;
+	u64 start, ns;
+
+	start = ktime_get_ns();
+	for (i = 0; i < FW_COM_TEST_BENCH_ITERS; i++) {
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test,
+					     ipu_send_get_token(&t->ctx, 0));
+		ipu_send_put_token(&t->ctx, 0);
+		/* Firmware keeps up: just move its read index along */
+		*fw_com_test_rd(t, q) = *fw_com_test_wr(t, q);
+	}
+	ns = ktime_get_ns() - start;
+
+	kunit_info(test, "send get+put: %llu ns/token over %u tokens\n",
+		   div_u64(ns, FW_COM_TEST_BENCH_ITERS),
+		   FW_COM_TEST_BENCH_ITERS);
+}
+
+static void fw_com_test_bench_recv(struct kunit *test)
+{
+	struct fw_com_test *t = test->priv;
+	struct ipu_fw_sys_queue *q = t->ctx.output_queue;
+	unsigned int i;
+	u64 start, ns;
+
+	start = ktime_get_ns();
+	for (i = 0; i < FW_COM_TEST_BENCH_ITERS; i++) {
+		/* Firmware keeps the queue one token ahead */
+		*fw_com_test_wr(t, q) = inc_index(*fw_com_test_rd(t, q),
+						  q->size);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test,
+					     ipu_recv_get_token(&t->ctx, 0));
+		ipu_recv_put_token(&t->ctx, 0);
+	}
+	ns = ktime_get_ns() - start;
+
+	kunit_info(test, "recv get+put: %llu ns/token over %u tokens\n",
+		   div_u64(ns, FW_COM_TEST_BENCH_ITERS),
+		   FW_COM_TEST_BENCH_ITERS);
+}
+
+static struct kunit_case fw_com_test_cases[] = {
+	KUNIT_CASE(fw_com_test_index_math),
+	KUNIT_CASE(fw_com_test_send_wrap),
+	KUNIT_CASE(fw_com_test_recv_wrap),
+	KUNIT_CASE(fw_com_test_bad_index),
+	KUNIT_CASE(fw_com_test_bench_send),
+	KUNIT_CASE(fw_com_test_bench_recv),
+	{}
+};
+
+static struct kunit_suite fw_com_test_suite = {
+	.name = "ipu-fw-com",
+	.init = fw_com_test_init,
+	.test_cases = fw_com_test_cases,
+};
+
+kunit_test_suite(fw_com_test_suite);
@@ -133,11 +133,6 @@ enum regmem_id {
 	SYSCOM_QPR_BASE_REG = 4
 };
 
-enum message_direction {
-	DIR_RECV = 0,
-	DIR_SEND
-};
-
 #define BUTRESS_FW_BOOT_PARAMS_0 0x4000
 #define BUTTRESS_FW_BOOT_PARAM_REG(base, offset, id) ((base) \
 	+ BUTRESS_FW_BOOT_PARAMS_0 + ((offset) + (id)) * 4)
@@ -152,6 +147,12 @@ enum buttress_syscom_id {
 	SYSCOM_ID_MAX
 };
 
+/*
+ * Queue index arithmetic. These helpers only operate on index values
+ * already read from dmem so that the wraparound rules can be reasoned
+ * about (and exercised) without touching the hardware. A queue of
+ * q->size slots holds at most q->size - 1 tokens; wr == rd means empty.
+ */
 static unsigned int num_messages(unsigned int wr, unsigned int rd,
 				 unsigned int size)
 {
@@ -166,20 +167,9 @@ static unsigned int num_free(unsigned int wr, unsigned int rd,
 	return size - num_messages(wr, rd, size);
 }
 
-static unsigned int curr_index(void __iomem *q_dmem,
-			       enum message_direction dir)
-{
-	return readl(q_dmem +
-			 (dir == DIR_RECV ? FW_COM_RD_REG : FW_COM_WR_REG));
-}
-
-static unsigned int inc_index(void __iomem *q_dmem, struct ipu_fw_sys_queue *q,
-			      enum message_direction dir)
+static unsigned int inc_index(unsigned int index, unsigned int size)
 {
-	unsigned int index;
-
-	index = curr_index(q_dmem, dir) + 1;
-	return index >= q->size ? 0 : index;
+	return ++index >= size ? 0 : index;
 }
 
 static unsigned int ipu_sys_queue_buf_size(unsigned int size,
@@ -437,7 +427,6 @@ void *ipu_send_get_token(struct ipu_fw_com_context *ctx, int q_nbr)
 	void __iomem *q_dmem = ctx->dmem_addr + q->wr_reg * 4;
 	unsigned int wr, rd;
 	unsigned int packets;
-	unsigned int index;
 
 	wr = readl(q_dmem + FW_COM_WR_REG);
 	rd = readl(q_dmem + FW_COM_RD_REG);
@@ -450,9 +439,7 @@ void *ipu_send_get_token(struct ipu_fw_com_context *ctx, int q_nbr)
 	if (!packets)
 		return NULL;
 
-	index = curr_index(q_dmem, DIR_SEND);
-
-	return (void *)(unsigned long)q->host_address + (index * q->token_size);
+	return (void *)(unsigned long)q->host_address + (wr * q->token_size);
 }
 EXPORT_SYMBOL_GPL(ipu_send_get_token);
 
@@ -460,12 +447,10 @@ void ipu_send_put_token(struct ipu_fw_com_context *ctx, int q_nbr)
 {
 	struct ipu_fw_sys_queue *q = &ctx->input_queue[q_nbr];
 	void __iomem *q_dmem = ctx->dmem_addr + q->wr_reg * 4;
-	int index = curr_index(q_dmem, DIR_SEND);
+	unsigned int wr = readl(q_dmem + FW_COM_WR_REG);
 
 	/* Increment index */
-	index = inc_index(q_dmem, q, DIR_SEND);
-
-	writel(index, q_dmem + FW_COM_WR_REG);
+	writel(inc_index(wr, q->size), q_dmem + FW_COM_WR_REG);
 }
 EXPORT_SYMBOL_GPL(ipu_send_put_token);
 
@@ -498,12 +483,16 @@ void ipu_recv_put_token(struct ipu_fw_com_context *ctx, int q_nbr)
 {
 	struct ipu_fw_sys_queue *q = &ctx->output_queue[q_nbr];
 	void __iomem *q_dmem = ctx->dmem_addr + q->wr_reg * 4;
-	unsigned int rd = inc_index(q_dmem, q, DIR_RECV);
+	unsigned int rd = readl(q_dmem + FW_COM_RD_REG);
 
 	/* Release index */
-	writel(rd, q_dmem + FW_COM_RD_REG);
+	writel(inc_index(rd, q->size), q_dmem + FW_COM_RD_REG);
 }
 EXPORT_SYMBOL_GPL(ipu_recv_put_token);
 
+#if IS_ENABLED(CONFIG_VIDEO_INTEL_IPU6_FW_COM_KUNIT_TEST)
+#include "ipu-fw-com-test.c"
+#endif
+
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Intel ipu fw comm library");
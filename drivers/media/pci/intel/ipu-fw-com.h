@@ -45,4 +45,15 @@ void ipu_recv_put_token(struct ipu_fw_com_context *ctx, int q_nbr);
 void *ipu_send_get_token(struct ipu_fw_com_context *ctx, int q_nbr);
 void ipu_send_put_token(struct ipu_fw_com_context *ctx, int q_nbr);
 
+#if IS_ENABLED(CONFIG_VIDEO_INTEL_IPU6_FW_COM_KUNIT_TEST)
+struct kunit;
+
+/* Simulated firmware end of the receive queues, for KUnit tests only */
+struct ipu_fw_com_context *ipu_fw_com_test_alloc(struct kunit *test,
+						 unsigned int nr_out,
+						 unsigned int token_size);
+bool ipu_fw_com_test_fw_post(struct ipu_fw_com_context *ctx, unsigned int nr,
+			     const void *token);
+#endif
+
 #endif
@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2024 Intel Corporation
+
+/*
+ * KUnit tests for the ISYS firmware response decoding, included from
+ * ipu-fw-isys.c. The firmware end of the receive queues is the FWCOM
+ * stand-in, which posts ipu_fw_resp_queue_token responses the way the
+ * ISYS firmware does.
+ */
+
+#include <kunit/test.h>
+#include <linux/sizes.h>
+
+#define FW_ISYS_TEST_RECV_QUEUES	2
+#define FW_ISYS_TEST_ROUNDS		32
+
+struct fw_isys_test {
+	struct ipu_fw_com_context *ctx;
+};
+
+static int fw_isys_test_init(struct kunit *test)
+{
+	struct fw_isys_test *t;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+
+	/* The proxy queue first, then the message queues, as in the fw */
+	t->ctx = ipu_fw_com_test_alloc(test, IPU_BASE_MSG_RECV_QUEUES +
+				       FW_ISYS_TEST_RECV_QUEUES,
+				       sizeof(struct ipu_fw_resp_queue_token));
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->ctx);
+
+	test->priv = t;
+
+	return 0;
+}
+
+/* A pin data ready response for buffer n, every field set */
+static void fw_isys_test_resp(struct ipu_fw_resp_queue_token *token,
+			      unsigned int n)
+{
+	struct ipu_fw_isys_resp_info_abi *resp = &token->resp_info;
+
+	memset(token, 0, sizeof(*token));
+	resp->buf_id = 0x1000 + n;
+	resp->pin.out_buf_id = 0x2000 + n;
+	resp->pin.addr = 0x10000000 + n * SZ_4K;
+	resp->pin.compress = n & 1;
+	resp->error_info.error = n % 3 ? IPU_FW_ISYS_ERROR_NONE :
+			       IPU_FW_ISYS_ERROR_FW_INTERNAL_CONSISTENCY;
+	resp->error_info.error_details = n;
+	resp->timestamp[0] = 0x55aa0000 + n;
+	resp->timestamp[1] = n;
+	resp->stream_handle = n % IPU_ISYS_MAX_STREAMS;
+	resp->type = IPU_FW_ISYS_RESP_TYPE_PIN_DATA_READY;
+	resp->pin_id = n % IPU_ISYS_OUTPUT_PINS;
+}
+
+static void fw_isys_test_expect_resp(struct kunit *test,
+				     struct ipu_fw_isys_resp_info_abi *resp,
+				     unsigned int n)
+{
+	struct ipu_fw_resp_queue_token want;
+
+	fw_isys_test_resp(&want, n);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, resp);
+	KUNIT_EXPECT_EQ(test, resp->buf_id, want.resp_info.buf_id);
+	KUNIT_EXPECT_EQ(test, resp->pin.out_buf_id,
+			want.resp_info.pin.out_buf_id);
+	KUNIT_EXPECT_EQ(test, resp->pin.addr, want.resp_info.pin.addr);
+	KUNIT_EXPECT_EQ(test, resp->pin.compress, want.resp_info.pin.compress);
+	KUNIT_EXPECT_EQ(test, resp->error_info.error,
+			want.resp_info.error_info.error);
+	KUNIT_EXPECT_EQ(test, resp->error_info.error_details,
+			want.resp_info.error_info.error_details);
+	KUNIT_EXPECT_EQ(test, resp->timestamp[0], want.resp_info.timestamp[0]);
+	KUNIT_EXPECT_EQ(test, resp->timestamp[1], want.resp_info.timestamp[1]);
+	KUNIT_EXPECT_EQ(test, resp->stream_handle,
+			want.resp_info.stream_handle);
+	KUNIT_EXPECT_EQ(test, resp->type, want.resp_info.type);
+	KUNIT_EXPECT_EQ(test, resp->pin_id, want.resp_info.pin_id);
+}
+
+/* Responses come out whole and in order while the queue wraps */
+static void fw_isys_test_get_resp(struct kunit *test)
+{
+	struct fw_isys_test *t = test->priv;
+	struct ipu_fw_isys_resp_info_abi data, *resp;
+	struct ipu_fw_resp_queue_token token;
+	unsigned int queue = IPU_BASE_MSG_RECV_QUEUES;
+	unsigned int posted = 0, got = 0, round, n;
+
+	KUNIT_EXPECT_PTR_EQ(test, ipu_fw_isys_get_resp(t->ctx, queue, &data),
+			    NULL);
+
+	for (round = 0; round < FW_ISYS_TEST_ROUNDS; round++) {
+		for (n = 0; n <= round % 4; n++) {
+			fw_isys_test_resp(&token, posted);
+			if (ipu_fw_com_test_fw_post(t->ctx, queue, &token))
+				posted++;
+		}
+
+		for (n = 0; n < round % 3 + 1; n++) {
+			resp = ipu_fw_isys_get_resp(t->ctx, queue, &data);
+			if (!resp)
+				break;
+			fw_isys_test_expect_resp(test, resp, got++);
+			ipu_fw_isys_put_resp(t->ctx, queue);
+		}
+	}
+
+	while ((resp = ipu_fw_isys_get_resp(t->ctx, queue, &data))) {
+		fw_isys_test_expect_resp(test, resp, got++);
+		ipu_fw_isys_put_resp(t->ctx, queue);
+	}
+	KUNIT_EXPECT_EQ(test, got, posted);
+}
+
+/* Each message queue is decoded on its own, the proxy queue not at all */
+static void fw_isys_test_queues(struct kunit *test)
+{
+	struct fw_isys_test *t = test->priv;
+	struct ipu_fw_isys_resp_info_abi data;
+	struct ipu_fw_resp_queue_token token;
+	unsigned int i, queue;
+
+	for (i = 0; i < FW_ISYS_TEST_RECV_QUEUES; i++) {
+		fw_isys_test_resp(&token, i);
+		KUNIT_ASSERT_TRUE(test,
+				  ipu_fw_com_test_fw_post(t->ctx,
+					IPU_BASE_MSG_RECV_QUEUES + i, &token));
+	}
+
+	for (i = FW_ISYS_TEST_RECV_QUEUES; i--; ) {
+		queue = IPU_BASE_MSG_RECV_QUEUES + i;
+		fw_isys_test_expect_resp(test,
+					 ipu_fw_isys_get_resp(t->ctx, queue,
+							      &data), i);
+		ipu_fw_isys_put_resp(t->ctx, queue);
+		KUNIT_EXPECT_PTR_EQ(test,
+				    ipu_fw_isys_get_resp(t->ctx, queue, &data),
+				    NULL);
+	}
+	KUNIT_EXPECT_PTR_EQ(test,
+			    ipu_fw_isys_get_resp(t->ctx,
+						 IPU_BASE_PROXY_RECV_QUEUES,
+						 &data), NULL);
+}
+
+static struct kunit_case fw_isys_test_cases[] = {
+	KUNIT_CASE(fw_isys_test_get_resp),
+	KUNIT_CASE(fw_isys_test_queues),
+	{}
+};
+
+static struct kunit_suite fw_isys_test_suite = {
+	.name = "ipu-fw-isys",
+	.init = fw_isys_test_init,
+	.test_cases = fw_isys_test_cases,
+};
+
+kunit_test_suite(fw_isys_test_suite);
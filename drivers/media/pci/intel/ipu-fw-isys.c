@@ -5,6 +5,7 @@
 
 #include <linux/kernel.h>
 #include <linux/delay.h>
+#include <linux/module.h>
 
 #include "ipu.h"
 #include "ipu-trace.h"
@@ -13,6 +14,12 @@
 #include "ipu-fw-isys.h"
 #include "ipu-fw-com.h"
 #include "ipu-isys.h"
+#include "ipu-isys-trace.h"
+
+static unsigned int fw_recv_queues = 1;
+module_param(fw_recv_queues, uint, 0444);
+MODULE_PARM_DESC(fw_recv_queues,
+		 "Number of firmware response queues drained round-robin");
 
 #define IPU_FW_UNSUPPORTED_DATA_TYPE	0
 static const uint32_t
@@ -183,6 +190,17 @@ ipu_fw_isys_complex_cmd(struct ipu_isys *isys,
 	if (cpu_mapped_buf)
 		clflush_cache_range(cpu_mapped_buf, size);
 
+	if (trace_ipu_isys_frame_buff_set_enabled() &&
+	    (send_type == IPU_FW_ISYS_SEND_TYPE_STREAM_CAPTURE ||
+	     send_type == IPU_FW_ISYS_SEND_TYPE_STREAM_START_AND_CAPTURE) &&
+	    cpu_mapped_buf) {
+		struct ipu_isys_pipeline *ip = isys->pipes[stream_handle];
+
+		trace_ipu_isys_frame_buff_set(stream_handle, cpu_mapped_buf,
+					      ip ? atomic_read(&ip->sequence) :
+					      0, ipu_isys_tsc_now(isys));
+	}
+
 	token = ipu_send_get_token(ctx,
 				   stream_handle + IPU_BASE_MSG_SEND_QUEUES);
 	if (!token)
@@ -293,7 +311,7 @@ static int ipu6_isys_fwcom_cfg_init(struct ipu_isys *isys,
 	struct ipu_fw_syscom_queue_config *input_queue_cfg;
 	struct ipu_fw_syscom_queue_config *output_queue_cfg;
 	struct ipu6_fw_isys_fw_config *isys_fw_cfg;
-	int num_out_message_queues = 1;
+	int num_out_message_queues;
 	int type_proxy = IPU_FW_ISYS_QUEUE_TYPE_PROXY;
 	int type_dev = IPU_FW_ISYS_QUEUE_TYPE_DEV;
 	int type_msg = IPU_FW_ISYS_QUEUE_TYPE_MSG;
@@ -317,6 +335,13 @@ static int ipu6_isys_fwcom_cfg_init(struct ipu_isys *isys,
 
 	num_in_message_queues = clamp_t(unsigned int, num_streams, 1,
 					max_streams);
+	/* No point in more response queues than streams */
+	num_out_message_queues = clamp_t(unsigned int, fw_recv_queues, 1,
+					 min_t(unsigned int,
+					       IPU_N_MAX_MSG_RECV_QUEUES,
+					       num_in_message_queues));
+	isys->num_recv_queues = num_out_message_queues;
+	isys->recv_queue_next = 0;
 	isys_fw_cfg = devm_kzalloc(&isys->adev->dev, sizeof(*isys_fw_cfg),
 				   GFP_KERNEL);
 	if (!isys_fw_cfg)
@@ -598,3 +623,7 @@ void ipu_fw_isys_dump_frame_buff_set(struct device *dev,
 	dev_dbg(dev, "send_resp_capture_done 0x%x\n",
 		buf->send_resp_capture_done);
 }
+
+#if IS_ENABLED(CONFIG_VIDEO_INTEL_IPU6_FW_COM_KUNIT_TEST)
+#include "ipu-fw-isys-test.c"
+#endif
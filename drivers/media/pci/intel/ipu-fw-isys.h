@@ -22,8 +22,11 @@
 #define IPU6SE_NOF_SRAM_BLOCKS_MAX (IPU6SE_STREAM_ID_MAX)
 #define IPU6SE_N_MAX_MSG_SEND_QUEUES (IPU6SE_STREAM_ID_MAX)
 
-/* Single return queue for all streams/commands type */
-#define IPU_N_MAX_MSG_RECV_QUEUES 1
+/*
+ * Return queues for streams/commands. One is shared by everything unless
+ * more are requested through the fw_recv_queues module parameter.
+ */
+#define IPU_N_MAX_MSG_RECV_QUEUES 4
 /* Single device queue for high priority commands (bypass in-order queue) */
 #define IPU_N_MAX_DEV_SEND_QUEUES 1
 /* Single dedicated send queue for proxy interface */
@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2024 Intel Corporation
+
+/*
+ * KUnit tests for the PSYS firmware event decoding, included from
+ * ipu-fw-psys.c. The firmware end of the event queue is the FWCOM
+ * stand-in, which posts ipu_fw_psys_event tokens the way the PSYS
+ * firmware does.
+ */
+
+#include <kunit/test.h>
+
+#define FW_PSYS_TEST_ROUNDS		32
+
+static int fw_psys_test_init(struct kunit *test)
+{
+	struct ipu_psys *psys;
+
+	psys = kunit_kzalloc(test, sizeof(*psys), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, psys);
+
+	psys->fwcom = ipu_fw_com_test_alloc(test, 1,
+					    sizeof(struct ipu_fw_psys_event));
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, psys->fwcom);
+
+	test->priv = psys;
+
+	return 0;
+}
+
+/* The completion of the n:th process group, as the fw reports it */
+static void fw_psys_test_event(struct ipu_fw_psys_event *event,
+			       unsigned int n)
+{
+	memset(event, 0, sizeof(*event));
+	event->status = n % 5 ? IPU_FW_PSYS_EVENT_TYPE_SUCCESS :
+		IPU_FW_PSYS_EVENT_TYPE_PROC_GRP_PROCESS_INIT_ERR;
+	event->command = IPU_FW_PSYS_PROCESS_GROUP_CMD_RUN;
+	event->context_handle = 0x80000000 + n;
+	event->token = 0x1234567800000000ULL + n;
+}
+
+/* Events come out whole and in order while the queue wraps */
+static void fw_psys_test_rcv_event(struct kunit *test)
+{
+	struct ipu_psys *psys = test->priv;
+	struct ipu_fw_psys_event event, want;
+	unsigned int posted = 0, got = 0, round, n;
+
+	KUNIT_EXPECT_EQ(test, ipu_fw_psys_rcv_event(psys, &event), 0);
+
+	for (round = 0; round < FW_PSYS_TEST_ROUNDS; round++) {
+		for (n = 0; n <= round % 4; n++) {
+			fw_psys_test_event(&want, posted);
+			if (ipu_fw_com_test_fw_post(psys->fwcom, 0, &want))
+				posted++;
+		}
+
+		for (n = 0; n < round % 3 + 1 || round == FW_PSYS_TEST_ROUNDS - 1;
+		     n++) {
+			if (!ipu_fw_psys_rcv_event(psys, &event))
+				break;
+			fw_psys_test_event(&want, got++);
+			KUNIT_EXPECT_EQ(test, event.status, want.status);
+			KUNIT_EXPECT_EQ(test, event.command, want.command);
+			KUNIT_EXPECT_EQ(test, event.context_handle,
+					want.context_handle);
+			KUNIT_EXPECT_EQ(test, event.token, want.token);
+		}
+	}
+
+	KUNIT_EXPECT_EQ(test, got, posted);
+	KUNIT_EXPECT_EQ(test, ipu_fw_psys_rcv_event(psys, &event), 0);
+}
+
+static struct kunit_case fw_psys_test_cases[] = {
+	KUNIT_CASE(fw_psys_test_rcv_event),
+	{}
+};
+
+static struct kunit_suite fw_psys_test_suite = {
+	.name = "ipu-fw-psys",
+	.init = fw_psys_test_init,
+	.test_cases = fw_psys_test_cases,
+};
+
+kunit_test_suite(fw_psys_test_suite);
@@ -428,3 +428,7 @@ int ipu_fw_psys_close(struct ipu_psys *psys)
 	}
 	return retval;
 }
+
+#if IS_ENABLED(CONFIG_VIDEO_INTEL_IPU6_FW_COM_KUNIT_TEST)
+#include "ipu-fw-psys-test.c"
+#endif
@@ -98,6 +98,17 @@ static const struct v4l2_ctrl_config compression_ctrl_cfg = {
 	.def = 0,
 };
 
+static const struct v4l2_ctrl_config device_only_ctrl_cfg = {
+	.ops = NULL,
+	.id = V4L2_CID_IPU_ISYS_DEVICE_ONLY,
+	.name = "ISYS BE-SOC device only buffers",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
 static int set_stream(struct v4l2_subdev *sd, int enable)
 {
 	return 0;
@@ -414,6 +425,15 @@ int ipu_isys_csi2_be_soc_init(struct ipu_isys_csi2_be_soc *csi2_be_soc,
 			goto fail;
 		}
 		csi2_be_soc->av[i].compression = 0;
+
+		csi2_be_soc->av[i].device_only_ctrl =
+			v4l2_ctrl_new_custom(&csi2_be_soc->av[i].ctrl_handler,
+					     &device_only_ctrl_cfg, NULL);
+		if (!csi2_be_soc->av[i].device_only_ctrl) {
+			dev_err(&isys->adev->dev,
+				"failed to create BE-SOC device only ctrl\n");
+			goto fail;
+		}
 		csi2_be_soc->av[i].vdev.ctrl_handler =
 			&csi2_be_soc->av[i].ctrl_handler;
 
@@ -59,6 +59,17 @@ static const struct v4l2_ctrl_config compression_ctrl_cfg = {
 	.def = 0,
 };
 
+static const struct v4l2_ctrl_config device_only_ctrl_cfg = {
+	.ops = NULL,
+	.id = V4L2_CID_IPU_ISYS_DEVICE_ONLY,
+	.name = "ISYS CSI-BE device only buffers",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
 static int set_stream(struct v4l2_subdev *sd, int enable)
 {
 	return 0;
@@ -364,6 +375,15 @@ int ipu_isys_csi2_be_init(struct ipu_isys_csi2_be *csi2_be,
 		goto fail;
 	}
 	csi2_be->av.compression = 0;
+
+	csi2_be->av.device_only_ctrl =
+		v4l2_ctrl_new_custom(&csi2_be->av.ctrl_handler,
+				     &device_only_ctrl_cfg, NULL);
+	if (!csi2_be->av.device_only_ctrl) {
+		dev_err(&isys->adev->dev,
+			"failed to create CSI-BE device only ctrl\n");
+		goto fail;
+	}
 	csi2_be->av.vdev.ctrl_handler = &csi2_be->av.ctrl_handler;
 
 	rval = ipu_isys_video_init(&csi2_be->av, &csi2_be->asd.sd.entity,
@@ -15,6 +15,7 @@
 #include "ipu-buttress.h"
 #include "ipu-isys.h"
 #include "ipu-isys-subdev.h"
+#include "ipu-isys-trace.h"
 #include "ipu-isys-video.h"
 #include "ipu-platform-regs.h"
 
@@ -692,6 +693,10 @@ void ipu_isys_csi2_sof_event(struct ipu_isys_csi2 *csi2, unsigned int vc)
 
 	ev.u.frame_sync.frame_sequence = atomic_inc_return(&ip->sequence) - 1;
 	ev.id = vc;
+	if (trace_ipu_isys_sof_enabled())
+		trace_ipu_isys_sof(ip->stream_handle, -1,
+				   ev.u.frame_sync.frame_sequence,
+				   ipu_isys_tsc_now(csi2->isys));
 	spin_unlock_irqrestore(&csi2->isys->lock, flags);
 
 	v4l2_event_queue(vdev, &ev);
@@ -723,6 +728,10 @@ void ipu_isys_csi2_eof_event(struct ipu_isys_csi2 *csi2, unsigned int vc)
 
 	if (ip) {
 		frame_sequence = atomic_read(&ip->sequence);
+		if (trace_ipu_isys_eof_enabled())
+			trace_ipu_isys_eof(ip->stream_handle, -1,
+					   frame_sequence - 1,
+					   ipu_isys_tsc_now(csi2->isys));
 		spin_unlock_irqrestore(&csi2->isys->lock, flags);
 
 		dev_dbg(&csi2->isys->adev->dev,
@@ -3,7 +3,10 @@
 
 #include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/dma-buf.h>
+#include <linux/hashtable.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/delay.h>
 #include <linux/pm_runtime.h>
@@ -15,11 +18,13 @@
 #include "ipu.h"
 #include "ipu-bus.h"
 #include "ipu-cpd.h"
+#include "ipu-mmu.h"
 #include "ipu-platform-isys-csi2-reg.h"
 #include "ipu-buttress.h"
 #include "ipu-isys.h"
 #include "ipu-isys-csi2.h"
 #include "ipu-isys-video.h"
+#include "ipu-isys-trace.h"
 
 extern int vnode_num;
 
@@ -28,6 +33,11 @@ module_param(wall_clock_ts_on, bool, 0660);
 MODULE_PARM_DESC(wall_clock_ts_on, "Timestamp based on REALTIME clock");
 extern bool enable_hw_sof_irq;
 
+static unsigned int dmabuf_cache_size = 16;
+module_param(dmabuf_cache_size, uint, 0664);
+MODULE_PARM_DESC(dmabuf_cache_size,
+		 "Idle DMABUF mappings kept per ISYS device (0 disables)");
+
 static int queue_setup(struct vb2_queue *q,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
 		       const struct v4l2_format *__fmt,
@@ -85,6 +95,14 @@ static int queue_setup(struct vb2_queue *q,
 			av->vdev.name, i, sizes[i]);
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+	/* Picked up by the memops for buffers allocated after this */
+	if (av->device_only_ctrl && v4l2_ctrl_g_ctrl(av->device_only_ctrl))
+		q->dma_attrs |= DMA_ATTR_SKIP_CPU_SYNC;
+	else
+		q->dma_attrs &= ~DMA_ATTR_SKIP_CPU_SYNC;
+#endif
+
 	return 0;
 }
 
@@ -153,6 +171,13 @@ static int buf_prepare(struct vb2_buffer *vb)
 	if (av->isys->adev->isp->flr_done)
 		return -EIO;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	if (vb->vb2_queue->dma_attrs & DMA_ATTR_SKIP_CPU_SYNC) {
+		vb->skip_cache_sync_on_prepare = 1;
+		vb->skip_cache_sync_on_finish = 1;
+	}
+#endif
+
 	rval = aq->buf_prepare(vb);
 	return rval;
 }
@@ -570,6 +595,12 @@ static void buf_queue(struct vb2_buffer *vb)
 		dev_dbg(&av->isys->adev->dev, "iova: plane %u iova 0x%x vaddr:0x%p\n", i,
 			(u32)vb2_dma_contig_plane_dma_addr(vb, i), vb2_plane_vaddr(vb,i));
 
+	if (trace_ipu_isys_buf_queue_enabled())
+		trace_ipu_isys_buf_queue(ip ? ip->stream_handle : -1,
+					 aq->fw_output,
+					 ip ? atomic_read(&ip->sequence) : 0,
+					 ipu_isys_tsc_now(av->isys));
+
 	spin_lock_irqsave(&aq->lock, flags);
 	list_add(&ib->head, &aq->incoming);
 	spin_unlock_irqrestore(&aq->lock, flags);
@@ -1367,6 +1398,8 @@ static void stop_streaming(struct vb2_queue *q)
 		return;
 	}
 
+	ipu_mmu_unmap_gather_begin(av->isys->adev->mmu);
+
 	if (pipe_av != av) {
 		mutex_unlock(&av->mutex);
 		mutex_lock(&pipe_av->mutex);
@@ -1395,6 +1428,7 @@ static void stop_streaming(struct vb2_queue *q)
 	}
 
 	return_buffers(aq, VB2_BUF_STATE_ERROR);
+	ipu_mmu_unmap_gather_end(av->isys->adev->mmu);
 	av->start_streaming = 0;
 	mutex_lock(&av->isys->reset_mutex);
 	av->isys->in_stop_streaming = false;
@@ -1420,7 +1454,8 @@ get_sof_sequence_by_timestamp(struct ipu_isys_pipeline *ip,
 	struct ipu_isys *isys =
 	    container_of(ip, struct ipu_isys_video, ip)->isys;
 	u64 time = (u64)info->timestamp[1] << 32 | info->timestamp[0];
-	unsigned int i;
+	unsigned int latest, sequence, i;
+	struct sequence_info *si;
 
 	/*
 	 * The timestamp is invalid as no TSC in some FPGA platform,
@@ -1429,20 +1464,27 @@ get_sof_sequence_by_timestamp(struct ipu_isys_pipeline *ip,
 	if (time == 0)
 		return atomic_read(&ip->sequence) - 1;
 
-	for (i = 0; i < IPU_ISYS_MAX_PARALLEL_SOF; i++)
-		if (time == ip->seq[i].timestamp) {
-			dev_dbg(&isys->adev->dev,
-				"sof: using seq nr %u for ts 0x%16.16llx\n",
-				ip->seq[i].sequence, time);
-			return ip->seq[i].sequence;
-		}
+	/* Walk back from the latest SOF, the match is usually among the first */
+	latest = atomic_read(&ip->sequence) - 1;
+	for (i = 0; i <= ip->seq_mask; i++) {
+		sequence = latest - i;
+		si = &ip->seq[sequence & ip->seq_mask];
+		if (READ_ONCE(si->timestamp) != time)
+			continue;
+		smp_rmb();
+		if (READ_ONCE(si->sequence) != sequence)
+			continue;
 
-	dev_dbg(&isys->adev->dev, "SOF: looking for 0x%16.16llx\n", time);
-	for (i = 0; i < IPU_ISYS_MAX_PARALLEL_SOF; i++)
 		dev_dbg(&isys->adev->dev,
-			"SOF: sequence %u, timestamp value 0x%16.16llx\n",
-			ip->seq[i].sequence, ip->seq[i].timestamp);
-	dev_dbg(&isys->adev->dev, "SOF sequence number not found\n");
+			"sof: using seq nr %u for ts 0x%16.16llx\n",
+			sequence, time);
+		return sequence;
+	}
+
+	isys->sof_seq_misses++;
+	dev_dbg(&isys->adev->dev,
+		"SOF sequence number not found for 0x%16.16llx, latest %u\n",
+		time, latest);
 
 	return 0;
 }
@@ -1523,6 +1565,8 @@ ipu_isys_buf_calc_sequence_time(struct ipu_isys_buffer *ib,
 void ipu_isys_queue_buf_done(struct ipu_isys_buffer *ib)
 {
 	struct vb2_buffer *vb = ipu_isys_buffer_to_vb2_buffer(ib);
+	struct ipu_isys_queue *aq = vb2_queue_to_ipu_isys_queue(vb->vb2_queue);
+	struct ipu_isys_video *av = ipu_isys_queue_to_video(aq);
 
 	if (atomic_read(&ib->ib_err_flag)) {
 		vb2_buffer_done(vb, VB2_BUF_STATE_ERROR);
@@ -1537,6 +1581,18 @@ void ipu_isys_queue_buf_done(struct ipu_isys_buffer *ib)
 	} else {
 		vb2_buffer_done(vb, VB2_BUF_STATE_DONE);
 	}
+	ipu_isys_lat_done(av->isys);
+
+	if (trace_ipu_isys_buf_done_enabled()) {
+		struct media_pipeline *mp =
+			media_entity_pipeline(&av->vdev.entity);
+
+		trace_ipu_isys_buf_done(mp ?
+					to_ipu_isys_pipeline(mp)->stream_handle :
+					-1, aq->fw_output,
+					to_vb2_v4l2_buffer(vb)->sequence,
+					ipu_isys_tsc_now(av->isys));
+	}
 }
 
 void ipu_isys_queue_buf_ready(struct ipu_isys_pipeline *ip,
@@ -1614,6 +1670,7 @@ void ipu_isys_queue_buf_ready(struct ipu_isys_pipeline *ip,
 
 		list_del(&ib->head);
 		spin_unlock_irqrestore(&aq->lock, flags);
+		ipu_isys_lat_stamp(isys, IPU_ISYS_LAT_MATCHED);
 
 		ipu_isys_buf_calc_sequence_time(ib, info);
 		struct vb2_buffer *vb = ipu_isys_buffer_to_vb2_buffer(ib);
@@ -1622,6 +1679,11 @@ void ipu_isys_queue_buf_ready(struct ipu_isys_pipeline *ip,
 		if (atomic_read(&ib->ib_err_flag))
 			dev_err(&isys->adev->dev, "csi2-%i error: #%d\n",
 					ip->csi2->index, vbuf->sequence);
+		/* Trace the sequence the buffer was actually given */
+		trace_ipu_isys_pin_data_ready(ip->stream_handle, info->pin_id,
+					      vbuf->sequence,
+					      (u64)info->timestamp[1] << 32 |
+					      info->timestamp[0]);
 		/*
 		 * For interlaced buffers, the notification to user space
 		 * is postponed to capture_done event since the field
@@ -1673,6 +1735,310 @@ struct vb2_ops ipu_isys_queue_ops = {
 	.buf_queue = buf_queue,
 };
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+/*
+ * DMABUF import with a mapping cache. vb2 attaches and maps a dmabuf
+ * again whenever user space queues it into a different buffer slot.
+ * Instead of detaching, the attachment is parked mapped on an LRU keyed
+ * by dma_buf and handed back on the next attach of the same dmabuf, so
+ * the IOVA and IPU MMU mapping survive QBUF/DQBUF rotation. Parked
+ * entries hold a dma_buf reference until evicted or flushed.
+ */
+struct ipu_isys_dmabuf {
+	struct hlist_node node;	/* ipu_isys_dmabufs, keyed by address */
+	struct list_head lru;	/* ipu_isys_dmabuf_cache.lru when idle */
+	struct ipu_isys *isys;
+	struct device *dev;
+	struct dma_buf *dbuf;
+	struct dma_buf_attachment *db_attach;
+	struct sg_table *sgt;
+	dma_addr_t dma_addr;
+	unsigned long size;
+	enum dma_data_direction dma_dir;
+	bool skip_sync;		/* Device-only queue, no cache maintenance */
+};
+
+static DEFINE_SPINLOCK(ipu_isys_dmabuf_lock);
+static DEFINE_HASHTABLE(ipu_isys_dmabufs, 6);
+static struct vb2_mem_ops ipu_isys_vb2_memops;
+
+/* Tell our buffers apart from vb2_dma_contig ones, any context */
+static struct ipu_isys_dmabuf *ipu_isys_dmabuf_find(void *buf_priv)
+{
+	struct ipu_isys_dmabuf *b;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ipu_isys_dmabuf_lock, flags);
+	hash_for_each_possible(ipu_isys_dmabufs, b, node,
+			       (unsigned long)buf_priv)
+		if (b == buf_priv)
+			break;
+	spin_unlock_irqrestore(&ipu_isys_dmabuf_lock, flags);
+
+	return b;
+}
+
+static void ipu_isys_dmabuf_destroy(struct ipu_isys_dmabuf *b)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ipu_isys_dmabuf_lock, flags);
+	hash_del(&b->node);
+	spin_unlock_irqrestore(&ipu_isys_dmabuf_lock, flags);
+
+	if (b->sgt)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+		dma_buf_unmap_attachment_unlocked(b->db_attach, b->sgt,
+						  b->dma_dir);
+#else
+		dma_buf_unmap_attachment(b->db_attach, b->sgt, b->dma_dir);
+#endif
+	dma_buf_detach(b->dbuf, b->db_attach);
+	dma_buf_put(b->dbuf);
+	kfree(b);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+static void *ipu_isys_dmabuf_attach(struct device *dev, struct dma_buf *dbuf,
+				    unsigned long size,
+				    enum dma_data_direction dma_dir)
+{
+	bool skip_sync = false;
+#else
+static void *ipu_isys_dmabuf_attach(struct vb2_buffer *vb, struct device *dev,
+				    struct dma_buf *dbuf, unsigned long size)
+{
+	enum dma_data_direction dma_dir = vb->vb2_queue->dma_dir;
+	bool skip_sync = vb->vb2_queue->dma_attrs & DMA_ATTR_SKIP_CPU_SYNC;
+#endif
+	struct ipu_isys *isys = dev_get_drvdata(dev);
+	struct ipu_isys_dmabuf_cache *cache = &isys->dmabuf_cache;
+	struct dma_buf_attachment *db_attach;
+	struct ipu_isys_dmabuf *b;
+	unsigned long flags;
+
+	if (dbuf->size < size)
+		return ERR_PTR(-EFAULT);
+
+	spin_lock_irqsave(&ipu_isys_dmabuf_lock, flags);
+	list_for_each_entry(b, &cache->lru, lru) {
+		if (b->dbuf == dbuf && b->size == size &&
+		    b->dma_dir == dma_dir && b->dev == dev) {
+			list_del_init(&b->lru);
+			cache->nr_idle--;
+			cache->hits++;
+			spin_unlock_irqrestore(&ipu_isys_dmabuf_lock, flags);
+			b->skip_sync = skip_sync;
+			return b;
+		}
+	}
+	cache->misses++;
+	spin_unlock_irqrestore(&ipu_isys_dmabuf_lock, flags);
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return ERR_PTR(-ENOMEM);
+
+	db_attach = dma_buf_attach(dbuf, dev);
+	if (IS_ERR(db_attach)) {
+		kfree(b);
+		return ERR_CAST(db_attach);
+	}
+
+	get_dma_buf(dbuf);
+	INIT_LIST_HEAD(&b->lru);
+	b->isys = isys;
+	b->dev = dev;
+	b->dbuf = dbuf;
+	b->db_attach = db_attach;
+	b->size = size;
+	b->dma_dir = dma_dir;
+	b->skip_sync = skip_sync;
+
+	spin_lock_irqsave(&ipu_isys_dmabuf_lock, flags);
+	hash_add(ipu_isys_dmabufs, &b->node, (unsigned long)b);
+	spin_unlock_irqrestore(&ipu_isys_dmabuf_lock, flags);
+
+	return b;
+}
+
+static void ipu_isys_dmabuf_detach(void *buf_priv)
+{
+	struct ipu_isys_dmabuf *b = buf_priv;
+	struct ipu_isys_dmabuf_cache *cache = &b->isys->dmabuf_cache;
+	struct ipu_isys_dmabuf *victim = NULL;
+	unsigned long flags;
+
+	if (!b->sgt || !dmabuf_cache_size) {
+		ipu_isys_dmabuf_destroy(b);
+		return;
+	}
+
+	spin_lock_irqsave(&ipu_isys_dmabuf_lock, flags);
+	list_add(&b->lru, &cache->lru);
+	if (++cache->nr_idle > dmabuf_cache_size) {
+		victim = list_last_entry(&cache->lru, struct ipu_isys_dmabuf,
+					 lru);
+		list_del_init(&victim->lru);
+		cache->nr_idle--;
+		cache->evictions++;
+	}
+	spin_unlock_irqrestore(&ipu_isys_dmabuf_lock, flags);
+
+	if (victim)
+		ipu_isys_dmabuf_destroy(victim);
+}
+
+static int ipu_isys_dmabuf_map(void *buf_priv)
+{
+	struct ipu_isys_dmabuf *b = buf_priv;
+	struct sg_table *sgt;
+	struct scatterlist *sg;
+	dma_addr_t expected;
+	unsigned long size = 0;
+	unsigned int i;
+
+	/* Reused from the cache: only redo the sync a fresh map would do */
+	if (b->sgt) {
+		if (b->skip_sync)
+			return 0;
+		dma_sync_sg_for_device(b->dev, b->sgt->sgl, b->sgt->orig_nents,
+				       b->dma_dir);
+		return 0;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+	sgt = dma_buf_map_attachment_unlocked(b->db_attach, b->dma_dir);
+#else
+	sgt = dma_buf_map_attachment(b->db_attach, b->dma_dir);
+#endif
+	if (IS_ERR(sgt))
+		return -EINVAL;
+
+	/* The IPU MMU maps the whole list into one IOVA range */
+	expected = sg_dma_address(sgt->sgl);
+	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
+		if (sg_dma_address(sg) != expected)
+			break;
+		expected += sg_dma_len(sg);
+		size += sg_dma_len(sg);
+	}
+	if (size < b->size) {
+		dev_err(b->dev, "dmabuf not contiguous (%lu < %lu)\n",
+			size, b->size);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+		dma_buf_unmap_attachment_unlocked(b->db_attach, sgt,
+						  b->dma_dir);
+#else
+		dma_buf_unmap_attachment(b->db_attach, sgt, b->dma_dir);
+#endif
+		return -EFAULT;
+	}
+
+	b->dma_addr = sg_dma_address(sgt->sgl);
+	b->sgt = sgt;
+
+	return 0;
+}
+
+static void ipu_isys_dmabuf_unmap(void *buf_priv)
+{
+	struct ipu_isys_dmabuf *b = buf_priv;
+
+	/*
+	 * Mapping stays until the entry is evicted, see detach, but the
+	 * CPU must still see what the device wrote, as after a real unmap
+	 */
+	if (!b->sgt || b->skip_sync)
+		return;
+
+	dma_sync_sg_for_cpu(b->dev, b->sgt->sgl, b->sgt->orig_nents,
+			    b->dma_dir);
+}
+
+static void ipu_isys_vb2_prepare(void *buf_priv)
+{
+	if (!ipu_isys_dmabuf_find(buf_priv))
+		vb2_dma_contig_memops.prepare(buf_priv);
+}
+
+static void ipu_isys_vb2_finish(void *buf_priv)
+{
+	if (!ipu_isys_dmabuf_find(buf_priv))
+		vb2_dma_contig_memops.finish(buf_priv);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+static void *ipu_isys_vb2_cookie(void *buf_priv)
+{
+	struct ipu_isys_dmabuf *b = ipu_isys_dmabuf_find(buf_priv);
+
+	return b ? &b->dma_addr : vb2_dma_contig_memops.cookie(buf_priv);
+}
+
+static void *ipu_isys_vb2_vaddr(void *buf_priv)
+{
+	return ipu_isys_dmabuf_find(buf_priv) ? NULL :
+		vb2_dma_contig_memops.vaddr(buf_priv);
+}
+#else
+static void *ipu_isys_vb2_cookie(struct vb2_buffer *vb, void *buf_priv)
+{
+	struct ipu_isys_dmabuf *b = ipu_isys_dmabuf_find(buf_priv);
+
+	return b ? &b->dma_addr : vb2_dma_contig_memops.cookie(vb, buf_priv);
+}
+
+static void *ipu_isys_vb2_vaddr(struct vb2_buffer *vb, void *buf_priv)
+{
+	return ipu_isys_dmabuf_find(buf_priv) ? NULL :
+		vb2_dma_contig_memops.vaddr(vb, buf_priv);
+}
+#endif
+
+void ipu_isys_dmabuf_cache_flush(struct ipu_isys *isys)
+{
+	struct ipu_isys_dmabuf_cache *cache = &isys->dmabuf_cache;
+	struct ipu_isys_dmabuf *b, *b0;
+	unsigned long flags;
+	LIST_HEAD(idle);
+
+	spin_lock_irqsave(&ipu_isys_dmabuf_lock, flags);
+	list_splice_init(&cache->lru, &idle);
+	cache->nr_idle = 0;
+	spin_unlock_irqrestore(&ipu_isys_dmabuf_lock, flags);
+
+	list_for_each_entry_safe(b, b0, &idle, lru)
+		ipu_isys_dmabuf_destroy(b);
+}
+
+static const struct vb2_mem_ops *ipu_isys_get_memops(void)
+{
+	if (!ipu_isys_vb2_memops.cookie) {
+		ipu_isys_vb2_memops = vb2_dma_contig_memops;
+		ipu_isys_vb2_memops.attach_dmabuf = ipu_isys_dmabuf_attach;
+		ipu_isys_vb2_memops.detach_dmabuf = ipu_isys_dmabuf_detach;
+		ipu_isys_vb2_memops.map_dmabuf = ipu_isys_dmabuf_map;
+		ipu_isys_vb2_memops.unmap_dmabuf = ipu_isys_dmabuf_unmap;
+		ipu_isys_vb2_memops.prepare = ipu_isys_vb2_prepare;
+		ipu_isys_vb2_memops.finish = ipu_isys_vb2_finish;
+		ipu_isys_vb2_memops.vaddr = ipu_isys_vb2_vaddr;
+		ipu_isys_vb2_memops.cookie = ipu_isys_vb2_cookie;
+	}
+
+	return &ipu_isys_vb2_memops;
+}
+#else
+void ipu_isys_dmabuf_cache_flush(struct ipu_isys *isys)
+{
+}
+
+static const struct vb2_mem_ops *ipu_isys_get_memops(void)
+{
+	return &vb2_dma_contig_memops;
+}
+#endif
+
 int ipu_isys_queue_init(struct ipu_isys_queue *aq)
 {
 	struct ipu_isys *isys = ipu_isys_queue_to_video(aq)->isys;
@@ -1682,7 +2048,7 @@ int ipu_isys_queue_init(struct ipu_isys_queue *aq)
 		aq->vbq.io_modes = VB2_USERPTR | VB2_MMAP | VB2_DMABUF;
 	aq->vbq.drv_priv = aq;
 	aq->vbq.ops = &ipu_isys_queue_ops;
-	aq->vbq.mem_ops = &vb2_dma_contig_memops;
+	aq->vbq.mem_ops = ipu_isys_get_memops();
 	aq->vbq.timestamp_flags = (wall_clock_ts_on) ?
 	    V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN : V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
 
@@ -15,11 +15,25 @@
 
 #include "ipu-isys-media.h"
 
+struct ipu_isys;
 struct ipu_isys_video;
 struct ipu_isys_pipeline;
 struct ipu_fw_isys_resp_info_abi;
 struct ipu_fw_isys_frame_buff_set_abi;
 
+/*
+ * DMABUF attachments kept mapped after vb2 let go of them, most
+ * recently used first. Protected by the dmabuf cache lock in
+ * ipu-isys-queue.c.
+ */
+struct ipu_isys_dmabuf_cache {
+	struct list_head lru;
+	unsigned int nr_idle;
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+};
+
 enum ipu_isys_buffer_type {
 	IPU_ISYS_VIDEO_BUFFER,
 	IPU_ISYS_SHORT_PACKET_BUFFER,
@@ -159,5 +173,6 @@ ipu_isys_queue_short_packet_ready(struct ipu_isys_pipeline *ip,
 
 int ipu_isys_queue_init(struct ipu_isys_queue *aq);
 void ipu_isys_queue_cleanup(struct ipu_isys_queue *aq);
+void ipu_isys_dmabuf_cache_flush(struct ipu_isys *isys);
 
 #endif /* IPU_ISYS_QUEUE_H */
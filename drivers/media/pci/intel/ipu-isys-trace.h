@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2024 Intel Corporation */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ipu_isys
+
+#if !defined(IPU_ISYS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define IPU_ISYS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "ipu-fw-isys.h"
+
+/*
+ * Frame path events. stream_handle is -1 when the buffer is not yet
+ * part of a started stream; tsc is the IPU TSC value of the event.
+ */
+DECLARE_EVENT_CLASS(ipu_isys_frame_class,
+	TP_PROTO(int stream_handle, int pin, unsigned int sequence, u64 tsc),
+	TP_ARGS(stream_handle, pin, sequence, tsc),
+	TP_STRUCT__entry(
+		__field(int, stream_handle)
+		__field(int, pin)
+		__field(unsigned int, sequence)
+		__field(u64, tsc)
+	),
+	TP_fast_assign(
+		__entry->stream_handle = stream_handle;
+		__entry->pin = pin;
+		__entry->sequence = sequence;
+		__entry->tsc = tsc;
+	),
+	TP_printk("stream=%d pin=%d sequence=%u tsc=0x%llx",
+		  __entry->stream_handle, __entry->pin, __entry->sequence,
+		  __entry->tsc)
+);
+
+DEFINE_EVENT(ipu_isys_frame_class, ipu_isys_buf_queue,
+	TP_PROTO(int stream_handle, int pin, unsigned int sequence, u64 tsc),
+	TP_ARGS(stream_handle, pin, sequence, tsc)
+);
+
+DEFINE_EVENT(ipu_isys_frame_class, ipu_isys_sof,
+	TP_PROTO(int stream_handle, int pin, unsigned int sequence, u64 tsc),
+	TP_ARGS(stream_handle, pin, sequence, tsc)
+);
+
+DEFINE_EVENT(ipu_isys_frame_class, ipu_isys_eof,
+	TP_PROTO(int stream_handle, int pin, unsigned int sequence, u64 tsc),
+	TP_ARGS(stream_handle, pin, sequence, tsc)
+);
+
+DEFINE_EVENT(ipu_isys_frame_class, ipu_isys_pin_data_ready,
+	TP_PROTO(int stream_handle, int pin, unsigned int sequence, u64 tsc),
+	TP_ARGS(stream_handle, pin, sequence, tsc)
+);
+
+DEFINE_EVENT(ipu_isys_frame_class, ipu_isys_buf_done,
+	TP_PROTO(int stream_handle, int pin, unsigned int sequence, u64 tsc),
+	TP_ARGS(stream_handle, pin, sequence, tsc)
+);
+
+/* pins is a bitmask of the output pins with a buffer in the set */
+TRACE_EVENT(ipu_isys_frame_buff_set,
+	TP_PROTO(int stream_handle, struct ipu_fw_isys_frame_buff_set_abi *set,
+		 unsigned int sequence, u64 tsc),
+	TP_ARGS(stream_handle, set, sequence, tsc),
+	TP_STRUCT__entry(
+		__field(int, stream_handle)
+		__field(u32, pins)
+		__field(unsigned int, sequence)
+		__field(u64, tsc)
+	),
+	TP_fast_assign(
+		unsigned int i;
+
+		__entry->stream_handle = stream_handle;
+		__entry->pins = 0;
+		for (i = 0; i < IPU_MAX_OPINS; i++)
+			if (set->output_pins[i].addr)
+				__entry->pins |= BIT(i);
+		__entry->sequence = sequence;
+		__entry->tsc = tsc;
+	),
+	TP_printk("stream=%d pins=0x%x sequence=%u tsc=0x%llx",
+		  __entry->stream_handle, __entry->pins, __entry->sequence,
+		  __entry->tsc)
+);
+
+#endif /* IPU_ISYS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ipu-isys-trace
+#include <trace/define_trace.h>
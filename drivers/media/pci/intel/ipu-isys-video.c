@@ -5,6 +5,7 @@
 #include <linux/firmware.h>
 #include <linux/init_task.h>
 #include <linux/kthread.h>
+#include <linux/log2.h>
 #include <linux/pm_runtime.h>
 #include <linux/module.h>
 #include <linux/version.h>
@@ -43,6 +44,11 @@ module_param_array(video_nr, int, NULL, 0444);
 MODULE_PARM_DESC(video_nr,
 		 "video device numbers (-1=auto, 0=/dev/video0, etc.)");
 
+static unsigned int sof_history = 8;
+module_param(sof_history, uint, 0664);
+MODULE_PARM_DESC(sof_history,
+		 "SOF timestamps kept per stream for sequence matching, rounded up to a power of two (2-64)");
+
 const struct ipu_isys_pixelformat ipu_isys_pfmts_be_soc[] = {
 	{V4L2_PIX_FMT_Y10, 16, 10, 0, MEDIA_BUS_FMT_Y10_1X10,
 	 IPU_FW_ISYS_FRAME_FORMAT_RAW16},
@@ -381,6 +387,8 @@ static int video_release(struct file *file)
 	dev_dbg(&av->isys->adev->dev, "release: %s: enter\n",
 		av->vdev.name);
 	vb2_fop_release(file);
+	/* Do not pin dmabufs of a user that went away */
+	ipu_isys_dmabuf_cache_flush(av->isys);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 6, 0)
 	ipu_pipeline_pm_use(&av->vdev.entity, 0);
@@ -2368,6 +2376,25 @@ static unsigned int get_comp_format(u32 code)
 	    ((udt - IPU_ISYS_MIPI_CSI2_TYPE_USER_DEF(1)) * 4);
 }
 
+/*
+ * One message per frame the firmware can hold (bounded by the deepest
+ * vb2 queue of the pipeline) plus one for the stream configuration.
+ */
+static unsigned int ipu_isys_pipeline_nr_fw_msgs(struct ipu_isys_pipeline *ip)
+{
+	struct ipu_isys_queue *aq;
+	unsigned int n = 0;
+
+	list_for_each_entry(aq, &ip->queues, node)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+		n = max(n, aq->vbq.num_buffers);
+#else
+		n = max(n, vb2_get_num_buffers(&aq->vbq));
+#endif
+
+	return n + 1;
+}
+
 /* Create stream and start it using the CSS FW ABI. */
 static int start_stream_firmware(struct ipu_isys_video *av,
 				 struct ipu_isys_buffer_list *bl)
@@ -2400,6 +2427,9 @@ static int start_stream_firmware(struct ipu_isys_video *av,
 	if (rval)
 		return rval;
 
+	if (ipu_isys_fw_msg_pool_reserve(ip, ipu_isys_pipeline_nr_fw_msgs(ip)))
+		dev_warn(dev, "no fw msgs reserved, using shared list\n");
+
 	msg = ipu_get_fw_msg_buf(ip);
 	if (!msg)
 		return -ENOMEM;
@@ -2729,6 +2759,7 @@ int ipu_isys_video_prepare_streaming(struct ipu_isys_video *av,
 		if (ip->interlaced && isys->short_packet_source ==
 		    IPU_ISYS_SHORT_PACKET_FROM_RECEIVER)
 			short_packet_queue_destroy(ip);
+		ipu_isys_fw_msg_pool_release(ip);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0)
 		media_pipeline_stop(&av->vdev.entity);
 		av->vdev.entity.pipe = NULL;
@@ -2761,7 +2792,8 @@ int ipu_isys_video_prepare_streaming(struct ipu_isys_video *av,
 	ip->csi2_be = NULL;
 	ip->csi2_be_soc = NULL;
 	ip->csi2 = NULL;
-	ip->seq_index = 0;
+	ip->seq_mask = roundup_pow_of_two(clamp_t(unsigned int, sof_history, 2,
+						  IPU_ISYS_MAX_PARALLEL_SOF)) - 1;
 	memset(ip->seq, 0, sizeof(ip->seq));
 
 	WARN_ON(!list_empty(&ip->queues));
@@ -3145,6 +3177,7 @@ int ipu_isys_video_init(struct ipu_isys_video *av,
 	init_completion(&av->ip.stream_start_completion);
 	init_completion(&av->ip.stream_stop_completion);
 	INIT_LIST_HEAD(&av->ip.queues);
+	init_llist_head(&av->ip.fw_msgs);
 	spin_lock_init(&av->ip.short_packet_queue_lock);
 	av->ip.isys = av->isys;
 	av->ip.vc = INVALIA_VC_ID;
@@ -6,6 +6,7 @@
 
 #include <linux/mutex.h>
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/videodev2.h>
 #include <media/media-entity.h>
 #include <media/v4l2-device.h>
@@ -16,7 +17,8 @@
 
 #define IPU_ISYS_OUTPUT_PINS 11
 #define IPU_NUM_CAPTURE_DONE 2
-#define IPU_ISYS_MAX_PARALLEL_SOF 2
+/* Upper bound of the per pipeline SOF history ring, a power of two */
+#define IPU_ISYS_MAX_PARALLEL_SOF 64
 #define CSI2_BE_SOC_SOURCE_PADS_NUM NR_OF_CSI2_BE_SOC_STREAMS
 
 struct ipu_isys;
@@ -68,7 +70,11 @@ struct ipu_isys_pipeline {
 	struct media_pad *external;
 	atomic_t sequence;
 	int last_sequence;
-	unsigned int seq_index;
+	/*
+	 * SOF history, slot is sequence & seq_mask. Written from the ISR
+	 * only, read without locking.
+	 */
+	unsigned int seq_mask;
 	struct sequence_info seq[IPU_ISYS_MAX_PARALLEL_SOF];
 	int source;	/* SSI stream source */
 	int stream_handle;	/* stream handle for CSS API */
@@ -87,6 +93,13 @@ struct ipu_isys_pipeline {
 	int nr_streaming;	/* Number of capture queues streaming */
 	int streaming;	/* Has streaming been really started? */
 	struct list_head queues;
+	/*
+	 * Firmware messages reserved for this pipeline at stream start.
+	 * Taken under the pipeline video mutex, returned lock-free from
+	 * the ISR, see ipu_get_fw_msg_buf().
+	 */
+	struct llist_head fw_msgs;
+	unsigned int nr_fw_msgs;
 	struct completion stream_open_completion;
 	struct completion stream_close_completion;
 	struct completion stream_start_completion;
@@ -126,6 +139,24 @@ struct ipu_isys_pipeline {
 #define to_ipu_isys_pipeline(__pipe)				\
 	container_of((__pipe), struct ipu_isys_pipeline, pipe)
 
+/*
+ * Record SOF timestamp of a sequence. The slot timestamp is cleared
+ * while the slot is rewritten, so that a reader matching on the
+ * timestamp never pairs it with a stale sequence.
+ */
+static inline void ipu_isys_pipeline_sof_record(struct ipu_isys_pipeline *ip,
+						unsigned int sequence,
+						u64 timestamp)
+{
+	struct sequence_info *si = &ip->seq[sequence & ip->seq_mask];
+
+	WRITE_ONCE(si->timestamp, 0);
+	smp_wmb();
+	WRITE_ONCE(si->sequence, sequence);
+	smp_wmb();
+	WRITE_ONCE(si->timestamp, timestamp);
+}
+
 struct ipu_isys_video {
 	/* Serialise access to other fields in the struct. */
 	struct mutex mutex;
@@ -146,6 +177,7 @@ struct ipu_isys_video {
 	bool initialized;
 	struct v4l2_ctrl_handler ctrl_handler;
 	struct v4l2_ctrl *compression_ctrl;
+	struct v4l2_ctrl *device_only_ctrl;
 	unsigned int ts_offsets[VIDEO_MAX_PLANES];
 	unsigned int line_header_length;	/* bits */
 	unsigned int line_footer_length;	/* bits */
@@ -8,11 +8,13 @@
 #include <linux/dma-mapping.h>
 #include <linux/firmware.h>
 #include <linux/kthread.h>
+#include <linux/log2.h>
 #include <linux/module.h>
 #include <linux/pm_runtime.h>
 #include <linux/string.h>
 #include <linux/sched.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 
 #if IS_ENABLED(CONFIG_IPU_BRIDGE) && \
 LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
@@ -44,11 +46,27 @@ LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
 #include "ipu-platform.h"
 #include "ipu-platform-buttress-regs.h"
 
+#define CREATE_TRACE_POINTS
+#include "ipu-isys-trace.h"
+
 int vnode_num = NR_OF_CSI2_BE_SOC_STREAMS;
 module_param(vnode_num, int, 0440);
 MODULE_PARM_DESC(vnode_num, "override vnode_num default value is 16");
 
+static unsigned int irq_coalesce_budget;
+module_param(irq_coalesce_budget, uint, 0444);
+MODULE_PARM_DESC(irq_coalesce_budget,
+		 "Firmware responses per IRQ before polling, 0 disables");
+
+static unsigned int irq_coalesce_timeout_us = 100;
+module_param(irq_coalesce_timeout_us, uint, 0444);
+MODULE_PARM_DESC(irq_coalesce_timeout_us,
+		 "Idle time before polling goes back to interrupts");
+
 #define ISYS_PM_QOS_VALUE	300
+
+DEFINE_STATIC_KEY_FALSE(ipu_isys_lat_enabled);
+
 #if IS_ENABLED(CONFIG_VIDEO_INTEL_IPU_USE_PLATFORMDATA)
 /*
  * The param was passed from module to indicate if port
@@ -1096,6 +1114,8 @@ static void isys_remove(struct ipu_bus_device *adev)
 		debugfs_remove_recursive(isys->debugfsdir);
 #endif
 
+	ipu_isys_dmabuf_cache_flush(isys);
+
 	list_for_each_entry_safe(fwmsg, safe, &isys->framebuflist, head) {
 		dma_free_attrs(&adev->dev, sizeof(struct isys_fw_msgs),
 			       fwmsg, fwmsg->dma_addr,
@@ -1168,6 +1188,62 @@ static void isys_remove(struct ipu_bus_device *adev)
 	}
 }
 
+/* Current IPU TSC value, 0 if it can't be read */
+u64 ipu_isys_tsc_now(struct ipu_isys *isys)
+{
+	u64 tsc;
+
+	if (ipu_buttress_tsc_read(isys->adev->isp, &tsc))
+		return 0;
+
+	return tsc;
+}
+
+static void ipu_isys_lat_add(struct ipu_isys_lat_hist *hist, u64 ns)
+{
+	unsigned int b = ns ? min_t(unsigned int, ilog2(ns) + 1,
+				    IPU_ISYS_LAT_BUCKETS - 1) : 0;
+
+	hist->bucket[b]++;
+	hist->count++;
+	if (ns > hist->max)
+		hist->max = ns;
+}
+
+/*
+ * Account a buffer done for the response currently handled in
+ * isys_isr_one(). Buffers completed without a matching pin ready
+ * response in the same ISR pass (interlaced capture) are not accounted.
+ * The stamps and histograms belong to isys_isr_one(), so this must run
+ * under power_lock like the stamping does; the stamps of the response
+ * are taken as one snapshot and the match is consumed before any
+ * histogram is touched.
+ */
+void __ipu_isys_lat_done(struct ipu_isys *isys)
+{
+	struct ipu_isys_latency *lat = &isys->lat;
+	u64 stamp[IPU_ISYS_LAT_NUM_POINTS];
+	struct ipu_isys_lat_hist *hist;
+	unsigned int i;
+
+	lockdep_assert_held(&isys->power_lock);
+
+	for (i = 0; i < IPU_ISYS_LAT_NUM_POINTS; i++)
+		stamp[i] = READ_ONCE(lat->stamp[i]);
+	if (!stamp[IPU_ISYS_LAT_ISR] || !stamp[IPU_ISYS_LAT_MATCHED])
+		return;
+	WRITE_ONCE(lat->stamp[IPU_ISYS_LAT_MATCHED], 0);
+
+	stamp[IPU_ISYS_LAT_DONE] = ktime_get_ns();
+	WRITE_ONCE(lat->stamp[IPU_ISYS_LAT_DONE], stamp[IPU_ISYS_LAT_DONE]);
+	hist = lat->hist[lat->stream];
+
+	for (i = IPU_ISYS_LAT_DEQUEUED; i < IPU_ISYS_LAT_NUM_POINTS; i++)
+		ipu_isys_lat_add(&hist[i], stamp[i] - stamp[i - 1]);
+	ipu_isys_lat_add(&hist[IPU_ISYS_LAT_ISR],
+			 stamp[IPU_ISYS_LAT_DONE] - stamp[IPU_ISYS_LAT_ISR]);
+}
+
 #ifdef CONFIG_DEBUG_FS
 #if defined(CONFIG_VIDEO_INTEL_IPU_USE_PLATFORMDATA)
 #include <media/ipu-acpi-pdata.h>
@@ -1322,6 +1398,223 @@ DEFINE_SIMPLE_ATTRIBUTE(isys_icache_prefetch_fops,
 			ipu_isys_icache_prefetch_get,
 			ipu_isys_icache_prefetch_set, "%llu\n");
 
+#define IPU_ISYS_LAT_DUMP_SIZE	(128 * 1024)
+
+static const char * const ipu_isys_lat_names[IPU_ISYS_LAT_NUM_POINTS] = {
+	[IPU_ISYS_LAT_ISR] = "isr->done",
+	[IPU_ISYS_LAT_DEQUEUED] = "isr->dequeued",
+	[IPU_ISYS_LAT_MATCHED] = "dequeued->matched",
+	[IPU_ISYS_LAT_DONE] = "matched->done",
+};
+
+static int ipu_isys_lat_enable_get(void *data, u64 *val)
+{
+	*val = static_key_enabled(&ipu_isys_lat_enabled);
+	return 0;
+}
+
+static int ipu_isys_lat_enable_set(void *data, u64 val)
+{
+	struct ipu_isys *isys = data;
+	unsigned long flags;
+
+	if (val != !!val)
+		return -EINVAL;
+
+	if (!val) {
+		static_branch_disable(&ipu_isys_lat_enabled);
+		return 0;
+	}
+
+	spin_lock_irqsave(&isys->power_lock, flags);
+	memset(isys->lat.stamp, 0, sizeof(isys->lat.stamp));
+	spin_unlock_irqrestore(&isys->power_lock, flags);
+	static_branch_enable(&ipu_isys_lat_enabled);
+
+	return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(isys_lat_enable_fops,
+			ipu_isys_lat_enable_get,
+			ipu_isys_lat_enable_set, "%llu\n");
+
+struct ipu_isys_lat_dump {
+	struct ipu_isys *isys;
+	size_t len;
+	char buf[];
+};
+
+static size_t ipu_isys_lat_dump(struct ipu_isys *isys, char *buf,
+				size_t size)
+{
+	struct ipu_isys_lat_hist *hist;
+	unsigned int s, i, b;
+	size_t len = 0;
+
+	for (s = 0; s < IPU_ISYS_MAX_STREAMS; s++) {
+		if (!isys->lat.hist[s][IPU_ISYS_LAT_ISR].count)
+			continue;
+
+		len += scnprintf(buf + len, size - len, "stream %u\n", s);
+		for (i = 0; i < IPU_ISYS_LAT_NUM_POINTS; i++) {
+			hist = &isys->lat.hist[s][i];
+			len += scnprintf(buf + len, size - len,
+					 "  %s: count %llu max %llu ns\n",
+					 ipu_isys_lat_names[i], hist->count,
+					 hist->max);
+			for (b = 0; b < IPU_ISYS_LAT_BUCKETS; b++) {
+				if (!hist->bucket[b])
+					continue;
+				if (b == IPU_ISYS_LAT_BUCKETS - 1)
+					len += scnprintf(buf + len, size - len,
+							 "    >= %llu ns: %u\n",
+							 1ULL << (b - 1),
+							 hist->bucket[b]);
+				else
+					len += scnprintf(buf + len, size - len,
+							 "    < %llu ns: %u\n",
+							 1ULL << b,
+							 hist->bucket[b]);
+			}
+		}
+	}
+
+	return len;
+}
+
+static int ipu_isys_lat_hist_open(struct inode *inode, struct file *file)
+{
+	struct ipu_isys *isys = inode->i_private;
+	struct ipu_isys_lat_dump *dump;
+
+	dump = vzalloc(sizeof(*dump) + IPU_ISYS_LAT_DUMP_SIZE);
+	if (!dump)
+		return -ENOMEM;
+
+	dump->isys = isys;
+	/* Dumped without locking, a concurrent ISR may skew the counts */
+	if (file->f_mode & FMODE_READ)
+		dump->len = ipu_isys_lat_dump(isys, dump->buf,
+					      IPU_ISYS_LAT_DUMP_SIZE);
+	file->private_data = dump;
+
+	return 0;
+}
+
+static ssize_t ipu_isys_lat_hist_read(struct file *file, char __user *buf,
+				      size_t len, loff_t *ppos)
+{
+	struct ipu_isys_lat_dump *dump = file->private_data;
+
+	return simple_read_from_buffer(buf, len, ppos, dump->buf, dump->len);
+}
+
+static ssize_t ipu_isys_lat_hist_write(struct file *file,
+				       const char __user *buf,
+				       size_t len, loff_t *ppos)
+{
+	struct ipu_isys_lat_dump *dump = file->private_data;
+	struct ipu_isys *isys = dump->isys;
+	static const char str[] = "clear";
+	char buffer[sizeof(str)] = { 0 };
+	unsigned long flags;
+	ssize_t ret;
+
+	ret = simple_write_to_buffer(buffer, sizeof(buffer), ppos, buf, len);
+	if (ret < 0)
+		return ret;
+
+	if (ret < sizeof(str) - 1 || strncmp(str, buffer, sizeof(str) - 1))
+		return -EINVAL;
+
+	spin_lock_irqsave(&isys->power_lock, flags);
+	memset(isys->lat.hist, 0, sizeof(isys->lat.hist));
+	spin_unlock_irqrestore(&isys->power_lock, flags);
+
+	return len;
+}
+
+static int ipu_isys_lat_hist_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations isys_lat_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = ipu_isys_lat_hist_open,
+	.release = ipu_isys_lat_hist_release,
+	.read = ipu_isys_lat_hist_read,
+	.write = ipu_isys_lat_hist_write,
+	.llseek = no_llseek,
+};
+
+#define IPU_ISYS_IRQ_STATS_SIZE	256
+
+struct ipu_isys_irq_stats_dump {
+	size_t len;
+	char buf[IPU_ISYS_IRQ_STATS_SIZE];
+};
+
+static int ipu_isys_irq_stats_open(struct inode *inode, struct file *file)
+{
+	struct ipu_isys *isys = inode->i_private;
+	struct ipu_isys_irq_coalesce *c = &isys->coalesce;
+	struct ipu_isys_irq_stats_dump *dump;
+	u64 irqs, responses, polls, now, rate = 0;
+	unsigned long flags;
+
+	dump = kzalloc(sizeof(*dump), GFP_KERNEL);
+	if (!dump)
+		return -ENOMEM;
+
+	now = ktime_get_ns();
+	spin_lock_irqsave(&isys->power_lock, flags);
+	irqs = c->irqs;
+	responses = c->responses;
+	polls = c->polls;
+	/* IRQs per second since the previous read */
+	if (c->rate_ns && now > c->rate_ns)
+		rate = div64_u64((irqs - c->rate_irqs) * NSEC_PER_SEC,
+				 now - c->rate_ns);
+	c->rate_irqs = irqs;
+	c->rate_ns = now;
+	spin_unlock_irqrestore(&isys->power_lock, flags);
+
+	dump->len = scnprintf(dump->buf, sizeof(dump->buf),
+			      "irqs %llu\nresponses %llu\npolls %llu\n"
+			      "irqs_per_sec %llu\nresponses_per_irq %llu.%02llu\n",
+			      irqs, responses, polls, rate,
+			      irqs ? div64_u64(responses, irqs) : 0,
+			      irqs ? div64_u64(responses * 100, irqs) % 100 :
+			      0);
+	file->private_data = dump;
+
+	return 0;
+}
+
+static ssize_t ipu_isys_irq_stats_read(struct file *file, char __user *buf,
+				       size_t len, loff_t *ppos)
+{
+	struct ipu_isys_irq_stats_dump *dump = file->private_data;
+
+	return simple_read_from_buffer(buf, len, ppos, dump->buf, dump->len);
+}
+
+static int ipu_isys_irq_stats_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations isys_irq_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ipu_isys_irq_stats_open,
+	.release = ipu_isys_irq_stats_release,
+	.read = ipu_isys_irq_stats_read,
+	.llseek = no_llseek,
+};
+
 static int ipu_isys_init_debugfs(struct ipu_isys *isys)
 {
 	struct dentry *file;
@@ -1346,6 +1639,46 @@ static int ipu_isys_init_debugfs(struct ipu_isys *isys)
 #endif
 	isys->debugfsdir = dir;
 
+	debugfs_create_u64("sof_seq_misses", 0400, isys->debugfsdir,
+			   &isys->sof_seq_misses);
+
+	dir = debugfs_create_dir("mmu", isys->debugfsdir);
+	if (!IS_ERR(dir)) {
+		debugfs_create_u64("tlb_inv_issued", 0400, dir,
+				   &isys->adev->mmu->tlb_inv_issued);
+		debugfs_create_u64("tlb_inv_coalesced", 0400, dir,
+				   &isys->adev->mmu->tlb_inv_coalesced);
+		ipu_dma_debugfs_init(isys->adev->mmu, dir);
+	}
+
+	dir = debugfs_create_dir("dmabuf_cache", isys->debugfsdir);
+	if (!IS_ERR(dir)) {
+		debugfs_create_u64("hits", 0400, dir,
+				   &isys->dmabuf_cache.hits);
+		debugfs_create_u64("misses", 0400, dir,
+				   &isys->dmabuf_cache.misses);
+		debugfs_create_u64("evictions", 0400, dir,
+				   &isys->dmabuf_cache.evictions);
+	}
+
+	dir = debugfs_create_dir("latency", isys->debugfsdir);
+	if (!IS_ERR(dir)) {
+		debugfs_create_file("enable", 0600, dir, isys,
+				    &isys_lat_enable_fops);
+		debugfs_create_file("histogram", 0600, dir, isys,
+				    &isys_lat_hist_fops);
+	}
+
+	dir = debugfs_create_dir("irq_coalesce", isys->debugfsdir);
+	if (!IS_ERR(dir)) {
+		debugfs_create_u32("budget", 0600, dir,
+				   &isys->coalesce.budget);
+		debugfs_create_u32("timeout_us", 0600, dir,
+				   &isys->coalesce.timeout_us);
+		debugfs_create_file("stats", 0400, dir, isys,
+				    &isys_irq_stats_fops);
+	}
+
 #ifdef IPU_ISYS_GPC
 	ret = ipu_isys_gpc_init_debugfs(isys);
 	if (ret)
@@ -1405,16 +1738,102 @@ static int alloc_fw_msg_bufs(struct ipu_isys *isys, int amount)
 	return -ENOMEM;
 }
 
+/*
+ * Move up to count messages from the global free list to the pipeline
+ * pool. Called at stream start so that the queueing path never has to
+ * allocate DMA memory or take listlock while streaming.
+ */
+int ipu_isys_fw_msg_pool_reserve(struct ipu_isys_pipeline *ip,
+				 unsigned int count)
+{
+	struct ipu_isys_video *pipe_av =
+	    container_of(ip, struct ipu_isys_video, ip);
+	struct ipu_isys *isys = pipe_av->isys;
+	struct isys_fw_msgs *msg;
+	unsigned int avail = 0;
+	unsigned long flags;
+
+	if (ip->nr_fw_msgs)
+		return 0;
+
+	init_llist_head(&ip->fw_msgs);
+
+	spin_lock_irqsave(&isys->listlock, flags);
+	list_for_each_entry(msg, &isys->framebuflist, head)
+		if (++avail >= count)
+			break;
+	spin_unlock_irqrestore(&isys->listlock, flags);
+
+	if (avail < count)
+		alloc_fw_msg_bufs(isys, count - avail);
+
+	spin_lock_irqsave(&isys->listlock, flags);
+	while (ip->nr_fw_msgs < count && !list_empty(&isys->framebuflist)) {
+		msg = list_last_entry(&isys->framebuflist,
+				      struct isys_fw_msgs, head);
+		list_move(&msg->head, &isys->framebuflist_fw);
+		msg->ip = ip;
+		atomic_set(&msg->busy, 0);
+		llist_add(&msg->free, &ip->fw_msgs);
+		ip->nr_fw_msgs++;
+	}
+	spin_unlock_irqrestore(&isys->listlock, flags);
+
+	dev_dbg(&isys->adev->dev, "%d: reserved %u/%u fw msgs\n",
+		ip->stream_handle, ip->nr_fw_msgs, count);
+
+	return ip->nr_fw_msgs ? 0 : -ENOMEM;
+}
+
+/* Return all messages owned by the pipeline to the global free list */
+void ipu_isys_fw_msg_pool_release(struct ipu_isys_pipeline *ip)
+{
+	struct ipu_isys_video *pipe_av =
+	    container_of(ip, struct ipu_isys_video, ip);
+	struct ipu_isys *isys = pipe_av->isys;
+	struct isys_fw_msgs *msg, *safe;
+	unsigned long flags;
+
+	if (!ip->nr_fw_msgs)
+		return;
+
+	ip->nr_fw_msgs = 0;
+	llist_del_all(&ip->fw_msgs);
+
+	spin_lock_irqsave(&isys->listlock, flags);
+	list_for_each_entry_safe(msg, safe, &isys->framebuflist_fw, head) {
+		if (msg->ip != ip)
+			continue;
+		WRITE_ONCE(msg->ip, NULL);
+		list_move(&msg->head, &isys->framebuflist);
+	}
+	spin_unlock_irqrestore(&isys->listlock, flags);
+}
+
 struct isys_fw_msgs *ipu_get_fw_msg_buf(struct ipu_isys_pipeline *ip)
 {
 	struct ipu_isys_video *pipe_av =
 	    container_of(ip, struct ipu_isys_video, ip);
 	struct ipu_isys *isys;
 	struct isys_fw_msgs *msg;
+	struct llist_node *node;
 	unsigned long flags;
 
 	isys = pipe_av->isys;
 
+	/* Single consumer: callers hold the pipeline video mutex */
+	if (ip->nr_fw_msgs) {
+		node = llist_del_first(&ip->fw_msgs);
+		if (node) {
+			msg = llist_entry(node, struct isys_fw_msgs, free);
+			atomic_set(&msg->busy, 1);
+			memset(&msg->fw_msg, 0, sizeof(msg->fw_msg));
+			return msg;
+		}
+		dev_dbg(&isys->adev->dev, "%d: fw msg pool empty\n",
+			ip->stream_handle);
+	}
+
 	spin_lock_irqsave(&isys->listlock, flags);
 	if (list_empty(&isys->framebuflist)) {
 		spin_unlock_irqrestore(&isys->listlock, flags);
@@ -1431,6 +1850,7 @@ struct isys_fw_msgs *ipu_get_fw_msg_buf(struct ipu_isys_pipeline *ip)
 	}
 	msg = list_last_entry(&isys->framebuflist, struct isys_fw_msgs, head);
 	list_move(&msg->head, &isys->framebuflist_fw);
+	msg->ip = NULL;
 	spin_unlock_irqrestore(&isys->listlock, flags);
 	memset(&msg->fw_msg, 0, sizeof(msg->fw_msg));
 
@@ -1443,13 +1863,21 @@ void ipu_cleanup_fw_msg_bufs(struct ipu_isys *isys)
 	unsigned long flags;
 
 	spin_lock_irqsave(&isys->listlock, flags);
-	list_for_each_entry_safe(fwmsg, fwmsg0, &isys->framebuflist_fw, head)
+	list_for_each_entry_safe(fwmsg, fwmsg0, &isys->framebuflist_fw, head) {
+		/* The owning pipeline's pool goes away with its messages */
+		if (fwmsg->ip) {
+			fwmsg->ip->nr_fw_msgs = 0;
+			init_llist_head(&fwmsg->ip->fw_msgs);
+		}
+		WRITE_ONCE(fwmsg->ip, NULL);
 		list_move(&fwmsg->head, &isys->framebuflist);
+	}
 	spin_unlock_irqrestore(&isys->listlock, flags);
 }
 
 void ipu_put_fw_mgs_buf(struct ipu_isys *isys, u64 data)
 {
+	struct ipu_isys_pipeline *ip;
 	struct isys_fw_msgs *msg;
 	unsigned long flags;
 	u64 *ptr = (u64 *)(unsigned long)data;
@@ -1457,8 +1885,20 @@ void ipu_put_fw_mgs_buf(struct ipu_isys *isys, u64 data)
 	if (!ptr)
 		return;
 
-	spin_lock_irqsave(&isys->listlock, flags);
 	msg = container_of(ptr, struct isys_fw_msgs, fw_msg.dummy);
+
+	/*
+	 * Every output pin reports the same frame message, hand a pooled
+	 * message back only once.
+	 */
+	ip = READ_ONCE(msg->ip);
+	if (ip) {
+		if (atomic_xchg(&msg->busy, 0))
+			llist_add(&msg->free, &ip->fw_msgs);
+		return;
+	}
+
+	spin_lock_irqsave(&isys->listlock, flags);
 	list_move(&msg->head, &isys->framebuflist);
 	spin_unlock_irqrestore(&isys->listlock, flags);
 }
@@ -1548,12 +1988,15 @@ static int isys_probe(struct ipu_bus_device *adev)
 	spin_lock_init(&isys->listlock);
 	INIT_LIST_HEAD(&isys->framebuflist);
 	INIT_LIST_HEAD(&isys->framebuflist_fw);
+	INIT_LIST_HEAD(&isys->dmabuf_cache.lru);
 
 	dev_dbg(&adev->dev, "isys probe %p %p\n", adev, &adev->dev);
 	ipu_bus_set_drvdata(adev, isys);
 
 	isys->line_align = IPU_ISYS_2600_MEM_LINE_ALIGN;
 	isys->icache_prefetch = 0;
+	isys->coalesce.budget = irq_coalesce_budget;
+	isys->coalesce.timeout_us = irq_coalesce_timeout_us;
 
 #ifndef CONFIG_PM
 	isys_setup_hw(isys);
@@ -1663,22 +2106,53 @@ static int resp_type_to_index(int type)
 	return i - 1;
 }
 
+/*
+ * Take one response, starting from the queue after the one served last so
+ * that a stream flooding its queue cannot starve the others.
+ */
+static struct ipu_fw_isys_resp_info_abi *
+isys_get_resp(struct ipu_isys *isys, struct ipu_fw_isys_resp_info_abi *data,
+	      unsigned int *queue)
+{
+	struct ipu_fw_isys_resp_info_abi *resp;
+	unsigned int n = max(isys->num_recv_queues, 1U);
+	unsigned int i, q;
+
+	for (i = 0; i < n; i++) {
+		q = (isys->recv_queue_next + i) % n;
+		resp = ipu_fw_isys_get_resp(isys->fwcom,
+					    IPU_BASE_MSG_RECV_QUEUES + q, data);
+		if (resp) {
+			isys->recv_queue_next = (q + 1) % n;
+			*queue = IPU_BASE_MSG_RECV_QUEUES + q;
+			return resp;
+		}
+	}
+
+	return NULL;
+}
+
 int isys_isr_one(struct ipu_bus_device *adev)
 {
 	struct ipu_isys *isys = ipu_bus_get_drvdata(adev);
 	struct ipu_fw_isys_resp_info_abi resp_data;
 	struct ipu_fw_isys_resp_info_abi *resp;
 	struct ipu_isys_pipeline *pipe;
+	unsigned int queue;
 	u64 ts;
 	unsigned int i;
 
 	if (!isys->fwcom)
 		return 0;
 
-	resp = ipu_fw_isys_get_resp(isys->fwcom, IPU_BASE_MSG_RECV_QUEUES,
-				    &resp_data);
+	if (static_branch_unlikely(&ipu_isys_lat_enabled)) {
+		WRITE_ONCE(isys->lat.stamp[IPU_ISYS_LAT_ISR], ktime_get_ns());
+		WRITE_ONCE(isys->lat.stamp[IPU_ISYS_LAT_MATCHED], 0);
+	}
+	resp = isys_get_resp(isys, &resp_data, &queue);
 	if (!resp)
 		return 1;
+	ipu_isys_lat_stamp(isys, IPU_ISYS_LAT_DEQUEUED);
 
 	ts = (u64)resp->timestamp[1] << 32 | resp->timestamp[0];
 
@@ -1723,6 +2197,7 @@ int isys_isr_one(struct ipu_bus_device *adev)
 		goto leave;
 	}
 	pipe->error = resp->error_info.error;
+	isys->lat.stream = resp->stream_handle;
 
 	switch (resp->type) {
 	case IPU_FW_ISYS_RESP_TYPE_STREAM_OPEN_DONE:
@@ -1811,15 +2286,13 @@ int isys_isr_one(struct ipu_bus_device *adev)
 		if (pipe->csi2)
 			ipu_isys_csi2_sof_event(pipe->csi2, pipe->vc);
 
-		pipe->seq[pipe->seq_index].sequence =
-		    atomic_read(&pipe->sequence) - 1;
-		pipe->seq[pipe->seq_index].timestamp = ts;
+		ipu_isys_pipeline_sof_record(pipe,
+					     atomic_read(&pipe->sequence) - 1,
+					     ts);
 		dev_dbg(&adev->dev,
 			"sof: handle %d: (index %u), timestamp 0x%16.16llx\n",
 			resp->stream_handle,
-			pipe->seq[pipe->seq_index].sequence, ts);
-		pipe->seq_index = (pipe->seq_index + 1)
-		    % IPU_ISYS_MAX_PARALLEL_SOF;
+			atomic_read(&pipe->sequence) - 1, ts);
 		break;
 	case IPU_FW_ISYS_RESP_TYPE_FRAME_EOF:
 		if (pipe->csi2)
@@ -1828,7 +2301,7 @@ int isys_isr_one(struct ipu_bus_device *adev)
 		dev_dbg(&adev->dev,
 			"eof: handle %d: (index %u), timestamp 0x%16.16llx\n",
 			resp->stream_handle,
-			pipe->seq[pipe->seq_index].sequence, ts);
+			atomic_read(&pipe->sequence) - 1, ts);
 		break;
 	case IPU_FW_ISYS_RESP_TYPE_STATS_DATA_READY:
 		break;
@@ -1839,7 +2312,10 @@ int isys_isr_one(struct ipu_bus_device *adev)
 	}
 
 leave:
-	ipu_fw_isys_put_resp(isys->fwcom, IPU_BASE_MSG_RECV_QUEUES);
+	/* Buffers completed outside of the ISR are not accounted */
+	if (static_branch_unlikely(&ipu_isys_lat_enabled))
+		WRITE_ONCE(isys->lat.stamp[IPU_ISYS_LAT_ISR], 0);
+	ipu_fw_isys_put_resp(isys->fwcom, queue);
 	return 0;
 }
 
@@ -1847,6 +2323,7 @@ static struct ipu_bus_driver isys_driver = {
 	.probe = isys_probe,
 	.remove = isys_remove,
 	.isr = isys_isr,
+	.isr_threaded = isys_isr_threaded,
 	.wanted = IPU_ISYS_NAME,
 	.drv = {
 		.name = IPU_ISYS_NAME,
@@ -4,6 +4,7 @@
 #ifndef IPU_ISYS_H
 #define IPU_ISYS_H
 
+#include <linux/jump_label.h>
 #include <linux/pm_qos.h>
 #include <linux/spinlock.h>
 
@@ -60,8 +61,74 @@
 
 #define NR_OF_CSI2_BE_SOC_DEV 8
 
+/* Number of log2(ns) buckets in the ISR to buffer done latency histograms */
+#define IPU_ISYS_LAT_BUCKETS	32
+
 struct task_struct;
 
+/*
+ * Points on the path from the firmware response interrupt to the vb2
+ * buffer done. Histograms are kept of the time between two consecutive
+ * points; the IPU_ISYS_LAT_ISR slot of a stream holds the total time
+ * from ISR entry to buffer done.
+ */
+enum ipu_isys_lat_point {
+	IPU_ISYS_LAT_ISR,	/* isys_isr_one() entry */
+	IPU_ISYS_LAT_DEQUEUED,	/* response taken from the recv queue */
+	IPU_ISYS_LAT_MATCHED,	/* response matched to an active buffer */
+	IPU_ISYS_LAT_DONE,	/* vb2_buffer_done() called */
+	IPU_ISYS_LAT_NUM_POINTS,
+};
+
+struct ipu_isys_lat_hist {
+	u64 count;
+	u64 max;
+	u32 bucket[IPU_ISYS_LAT_BUCKETS];
+};
+
+/*
+ * struct ipu_isys_latency - ISR to buffer done latency statistics
+ *
+ * @stamp: timestamps (ns) of the response currently being handled
+ * @stream: stream handle of the response currently being handled
+ * @hist: per stream histograms, indexed by the latter point of each step
+ *
+ * Only accessed under ipu_isys.power_lock, which isys_isr_one() runs
+ * under; stamps are written with WRITE_ONCE() and read as one snapshot.
+ * Recording is behind the ipu_isys_lat_enabled static key.
+ */
+struct ipu_isys_latency {
+	u64 stamp[IPU_ISYS_LAT_NUM_POINTS];
+	unsigned int stream;
+	struct ipu_isys_lat_hist
+		hist[IPU_ISYS_MAX_STREAMS][IPU_ISYS_LAT_NUM_POINTS];
+};
+
+/*
+ * struct ipu_isys_irq_coalesce - firmware response interrupt coalescing
+ *
+ * @budget: responses handled per hard IRQ before the rest is left to the
+ *	    threaded handler, 0 disables
+ * @timeout_us: how long the threaded handler polls an empty queue before
+ *		going back to interrupts
+ * @irqs: hard IRQs taken for ISYS
+ * @responses: firmware responses handled, hard IRQ and threaded
+ * @polls: threaded handler runs
+ * @rate_irqs: @irqs at @rate_ns, to report IRQs per second
+ * @rate_ns: time of the last statistics read
+ *
+ * Counters are written under ipu_isys.power_lock.
+ */
+struct ipu_isys_irq_coalesce {
+	u32 budget;
+	u32 timeout_us;
+	u64 irqs;
+	u64 responses;
+	u64 polls;
+	u64 rate_irqs;
+	u64 rate_ns;
+};
+
 struct ipu_isys_sensor_info {
 	unsigned int vc1_data_start;
 	unsigned int vc1_data_end;
@@ -102,6 +169,8 @@ struct ipu_isys_sensor_info {
  * @pkg_dir_dma_addr: I/O virtual address for pkg_dir
  * @pkg_dir_size: size of pkg_dir in bytes
  * @short_packet_source: select short packet capture mode
+ * @lat: ISR to buffer done latency statistics
+ * @sof_seq_misses: pin ready responses not matched to a SOF sequence
  */
 struct ipu_isys {
 	struct media_device media_dev;
@@ -163,6 +232,14 @@ struct ipu_isys {
 	struct mutex reset_mutex;
 	bool in_reset;
 	bool in_stop_streaming;
+
+	struct ipu_isys_latency lat;
+	u64 sof_seq_misses;
+	struct ipu_isys_dmabuf_cache dmabuf_cache;
+	/* Firmware response queues, drained round-robin in the ISR */
+	unsigned int num_recv_queues;
+	unsigned int recv_queue_next;
+	struct ipu_isys_irq_coalesce coalesce;
 };
 
 struct isys_fw_msgs {
@@ -173,6 +250,9 @@ struct isys_fw_msgs {
 	} fw_msg;
 	struct list_head head;
 	dma_addr_t dma_addr;
+	struct llist_node free;
+	struct ipu_isys_pipeline *ip;	/* owning pool, NULL if global */
+	atomic_t busy;
 };
 
 #define to_frame_msg_buf(a) (&(a)->fw_msg.frame)
@@ -185,12 +265,34 @@ int ipu_pipeline_pm_use(struct media_entity *entity, int use);
 struct isys_fw_msgs *ipu_get_fw_msg_buf(struct ipu_isys_pipeline *ip);
 void ipu_put_fw_mgs_buf(struct ipu_isys *isys, u64 data);
 void ipu_cleanup_fw_msg_bufs(struct ipu_isys *isys);
+int ipu_isys_fw_msg_pool_reserve(struct ipu_isys_pipeline *ip,
+				 unsigned int count);
+void ipu_isys_fw_msg_pool_release(struct ipu_isys_pipeline *ip);
 
 extern const struct v4l2_ioctl_ops ipu_isys_ioctl_ops;
 
+DECLARE_STATIC_KEY_FALSE(ipu_isys_lat_enabled);
+
+void __ipu_isys_lat_done(struct ipu_isys *isys);
+u64 ipu_isys_tsc_now(struct ipu_isys *isys);
+
+static inline void ipu_isys_lat_stamp(struct ipu_isys *isys,
+				      enum ipu_isys_lat_point point)
+{
+	if (static_branch_unlikely(&ipu_isys_lat_enabled))
+		WRITE_ONCE(isys->lat.stamp[point], ktime_get_ns());
+}
+
+static inline void ipu_isys_lat_done(struct ipu_isys *isys)
+{
+	if (static_branch_unlikely(&ipu_isys_lat_enabled))
+		__ipu_isys_lat_done(isys);
+}
+
 void isys_setup_hw(struct ipu_isys *isys);
 int isys_isr_one(struct ipu_bus_device *adev);
 irqreturn_t isys_isr(struct ipu_bus_device *adev);
+irqreturn_t isys_isr_threaded(struct ipu_bus_device *adev);
 #ifdef IPU_ISYS_GPC
 int ipu_isys_gpc_init_debugfs(struct ipu_isys *isys);
 #endif
@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2024 Intel Corporation
+
+/*
+ * KUnit tests for the IPU MMU page tables, included from ipu-mmu.c so
+ * that the static setup and teardown can be reached. The page tables are
+ * real and DMA mapped through a stand-in PCI device; the pages they point
+ * at are not, as nothing but the PTEs is ever looked at.
+ */
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/scatterlist.h>
+
+#define MMU_TEST_BUF_PAGES		(SZ_64M >> PAGE_SHIFT)
+#define MMU_TEST_BENCH_ITERS		8
+/* Well away from the iova the buffer is mapped at */
+#define MMU_TEST_PADDR_BASE		SZ_1G
+
+struct mmu_test {
+	struct ipu_device isp;
+	struct pci_dev pdev;
+	struct ipu_mmu mmu;
+	struct ipu_dma_mapping dmap;
+	struct sg_table sgt;
+};
+
+static int mmu_test_init(struct kunit *test)
+{
+	struct mmu_test *t;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+
+	t->pdev.dev.init_name = "ipu-mmu-test";
+	t->pdev.dev.coherent_dma_mask = DMA_BIT_MASK(32);
+	t->pdev.dev.dma_mask = &t->pdev.dev.coherent_dma_mask;
+	t->isp.pdev = &t->pdev;
+	t->mmu.dmap = &t->dmap;
+
+	test->priv = t;
+
+	t->dmap.mmu_info = ipu_mmu_alloc(&t->isp);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->dmap.mmu_info);
+
+	return 0;
+}
+
+static void mmu_test_exit(struct kunit *test)
+{
+	struct mmu_test *t = test->priv;
+	u32 **l2_pts;
+
+	if (!t)
+		return;
+
+	sg_free_table(&t->sgt);
+	if (!t->dmap.mmu_info)
+		return;
+
+	/* ipu_mmu_destroy() leaves the L2 table index to the caller */
+	l2_pts = t->dmap.mmu_info->l2_pts;
+	ipu_mmu_destroy(&t->mmu);
+	vfree(l2_pts);
+}
+
+/*
+ * A 64 MB buffer of 4K pages none of which are contiguous, the worst
+ * case for the page tables: one sg entry and one PTE range per page.
+ */
+static void mmu_test_alloc_sgt(struct kunit *test, struct mmu_test *t)
+{
+	struct scatterlist *sg;
+	unsigned int i;
+
+	KUNIT_ASSERT_EQ(test, sg_alloc_table(&t->sgt, MMU_TEST_BUF_PAGES,
+					     GFP_KERNEL), 0);
+
+	for_each_sg(t->sgt.sgl, sg, t->sgt.nents, i) {
+		sg_dma_address(sg) = MMU_TEST_PADDR_BASE +
+			((dma_addr_t)i << (PAGE_SHIFT + 1));
+		sg_dma_len(sg) = PAGE_SIZE;
+	}
+}
+
+static void mmu_test_expect_mapped(struct kunit *test, struct mmu_test *t,
+				   unsigned long iova)
+{
+	struct ipu_mmu_info *mmu_info = t->dmap.mmu_info;
+	struct scatterlist *sg;
+	unsigned int i;
+
+	for_each_sg(t->sgt.sgl, sg, t->sgt.nents, i)
+		if (!(i % 997) || i == t->sgt.nents - 1)
+			KUNIT_EXPECT_EQ(test,
+					ipu_mmu_iova_to_phys(mmu_info,
+						iova + ((unsigned long)i << PAGE_SHIFT)),
+					(phys_addr_t)sg_dma_address(sg));
+}
+
+static void mmu_test_map_sg(struct kunit *test)
+{
+	struct mmu_test *t = test->priv;
+	struct ipu_mmu_info *mmu_info = t->dmap.mmu_info;
+	unsigned long iova = SZ_4M - SZ_64K;	/* straddle L2 tables */
+	size_t size = (size_t)MMU_TEST_BUF_PAGES << PAGE_SHIFT;
+
+	mmu_test_alloc_sgt(test, t);
+
+	KUNIT_ASSERT_EQ(test, ipu_mmu_map_sg(mmu_info, iova, t->sgt.sgl,
+					     t->sgt.nents), 0);
+	mmu_test_expect_mapped(test, t, iova);
+
+	ipu_mmu_unmap(mmu_info, iova, size);
+	KUNIT_EXPECT_EQ(test, ipu_mmu_iova_to_phys(mmu_info, iova),
+			TBL_PHYS_ADDR(mmu_info->dummy_page_pteval));
+	KUNIT_EXPECT_EQ(test,
+			ipu_mmu_iova_to_phys(mmu_info, iova + size - PAGE_SIZE),
+			TBL_PHYS_ADDR(mmu_info->dummy_page_pteval));
+
+	/* Misaligned entries are refused and nothing is left mapped */
+	sg_dma_address(sg_next(t->sgt.sgl)) += SZ_1K;
+	KUNIT_EXPECT_EQ(test, ipu_mmu_map_sg(mmu_info, iova, t->sgt.sgl,
+					     t->sgt.nents), -EINVAL);
+	KUNIT_EXPECT_EQ(test, ipu_mmu_iova_to_phys(mmu_info, iova),
+			TBL_PHYS_ADDR(mmu_info->dummy_page_pteval));
+}
+
+/*
+ * Cost of mapping and unmapping the 64 MB buffer. The per-page
+ * ipu_mmu_map() loop is what DMA mapping did before ipu_mmu_map_sg().
+ * The first round allocates the L2 tables and is not counted.
+ */
+static void mmu_test_bench_map(struct kunit *test)
+{
+	struct mmu_test *t = test->priv;
+	struct ipu_mmu_info *mmu_info = t->dmap.mmu_info;
+	size_t size = (size_t)MMU_TEST_BUF_PAGES << PAGE_SHIFT;
+	u64 start, map_ns = 0, map_sg_ns = 0, unmap_ns = 0;
+	unsigned long iova = 0;
+	struct scatterlist *sg;
+	unsigned int i, j;
+
+	mmu_test_alloc_sgt(test, t);
+
+	for (i = 0; i <= MMU_TEST_BENCH_ITERS; i++) {
+		start = ktime_get_ns();
+		for_each_sg(t->sgt.sgl, sg, t->sgt.nents, j)
+			KUNIT_ASSERT_EQ(test,
+					ipu_mmu_map(mmu_info,
+						    iova + ((unsigned long)j << PAGE_SHIFT),
+						    sg_dma_address(sg),
+						    sg_dma_len(sg)), 0);
+		if (i)
+			map_ns += ktime_get_ns() - start;
+
+		start = ktime_get_ns();
+		ipu_mmu_unmap(mmu_info, iova, size);
+		if (i)
+			unmap_ns += ktime_get_ns() - start;
+
+		start = ktime_get_ns();
+		KUNIT_ASSERT_EQ(test, ipu_mmu_map_sg(mmu_info, iova, t->sgt.sgl,
+						     t->sgt.nents), 0);
+		if (i)
+			map_sg_ns += ktime_get_ns() - start;
+
+		ipu_mmu_unmap(mmu_info, iova, size);
+	}
+
+	kunit_info(test,
+		   "64M of 4K pages: map_sg %llu us, per-page map %llu us, unmap %llu us\n",
+		   div_u64(map_sg_ns, MMU_TEST_BENCH_ITERS * NSEC_PER_USEC),
+		   div_u64(map_ns, MMU_TEST_BENCH_ITERS * NSEC_PER_USEC),
+		   div_u64(unmap_ns, MMU_TEST_BENCH_ITERS * NSEC_PER_USEC));
+}
+
+static struct kunit_case mmu_test_cases[] = {
+	KUNIT_CASE(mmu_test_map_sg),
+	KUNIT_CASE(mmu_test_bench_map),
+	{}
+};
+
+static struct kunit_suite mmu_test_suite = {
+	.name = "ipu-mmu",
+	.init = mmu_test_init,
+	.exit = mmu_test_exit,
+	.test_cases = mmu_test_cases,
+};
+
+kunit_test_suite(mmu_test_suite);
@@ -42,16 +42,14 @@
 
 #define TBL_PHYS_ADDR(a)	((phys_addr_t)(a) << ISP_PADDR_SHIFT)
 
-static void tlb_invalidate(struct ipu_mmu *mmu)
+/* Called with ready_lock held */
+static void __tlb_invalidate(struct ipu_mmu *mmu)
 {
 	unsigned int i;
-	unsigned long flags;
 
-	spin_lock_irqsave(&mmu->ready_lock, flags);
-	if (!mmu->ready) {
-		spin_unlock_irqrestore(&mmu->ready_lock, flags);
+	mmu->tlb_inv_pending = false;
+	if (!mmu->ready)
 		return;
-	}
 
 	for (i = 0; i < mmu->nr_mmus; i++) {
 		/*
@@ -75,7 +73,83 @@ static void tlb_invalidate(struct ipu_mmu *mmu)
 		 */
 		wmb();
 	}
+	mmu->tlb_inv_issued++;
+}
+
+static void tlb_invalidate(struct ipu_mmu *mmu)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mmu->ready_lock, flags);
+	__tlb_invalidate(mmu);
+	spin_unlock_irqrestore(&mmu->ready_lock, flags);
+}
+
+/*
+ * Unmap gathering: between begin and end, invalidations requested by
+ * unmap paths through ipu_mmu_unmap_defer() are folded into one issued
+ * at the end, and the memory and IOVA behind those unmaps are only
+ * released once that invalidation is done. Map paths keep invalidating
+ * immediately, which also retires any pending unmap invalidation.
+ * Calls may nest.
+ */
+void ipu_mmu_unmap_gather_begin(struct ipu_mmu *mmu)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mmu->ready_lock, flags);
+	mmu->unmap_gather++;
+	spin_unlock_irqrestore(&mmu->ready_lock, flags);
+}
+EXPORT_SYMBOL_GPL(ipu_mmu_unmap_gather_begin);
+
+void ipu_mmu_unmap_gather_end(struct ipu_mmu *mmu)
+{
+	struct ipu_mmu_deferred *d, *tmp;
+	unsigned long flags;
+	LIST_HEAD(release);
+
+	spin_lock_irqsave(&mmu->ready_lock, flags);
+	if (!WARN_ON(!mmu->unmap_gather) && !--mmu->unmap_gather) {
+		if (mmu->tlb_inv_pending)
+			__tlb_invalidate(mmu);
+		list_splice_init(&mmu->gather_release, &release);
+	}
+	spin_unlock_irqrestore(&mmu->ready_lock, flags);
+
+	list_for_each_entry_safe(d, tmp, &release, list) {
+		list_del(&d->list);
+		d->release(d);
+	}
+}
+EXPORT_SYMBOL_GPL(ipu_mmu_unmap_gather_end);
+
+/*
+ * Invalidate the TLB after an unmap and then call d->release, which
+ * returns the backing memory and IOVA. Inside a gather window both are
+ * postponed to ipu_mmu_unmap_gather_end().
+ */
+void ipu_mmu_unmap_defer(struct ipu_mmu *mmu, struct ipu_mmu_deferred *d)
+{
+	unsigned long flags;
+	bool deferred = false;
+
+	spin_lock_irqsave(&mmu->ready_lock, flags);
+	if (!mmu->unmap_gather) {
+		__tlb_invalidate(mmu);
+	} else {
+		if (mmu->ready) {
+			if (mmu->tlb_inv_pending)
+				mmu->tlb_inv_coalesced++;
+			mmu->tlb_inv_pending = true;
+		}
+		list_add_tail(&d->list, &mmu->gather_release);
+		deferred = true;
+	}
 	spin_unlock_irqrestore(&mmu->ready_lock, flags);
+
+	if (!deferred)
+		d->release(d);
 }
 
 #ifdef DEBUG
@@ -243,93 +317,127 @@ static u32 *alloc_l2_pt(struct ipu_mmu_info *mmu_info)
 	return pt;
 }
 
-static void l2_unmap(struct ipu_mmu_info *mmu_info, unsigned long iova,
-		     phys_addr_t dummy, size_t size);
-static int l2_map(struct ipu_mmu_info *mmu_info, unsigned long iova,
-		  phys_addr_t paddr, size_t size)
-{
-	struct device *dev = mmu_info->dev;
+/*
+ * State carried across the ranges of one map call. PTE writes go to
+ * l2_pt[lo..hi) and are flushed in one go when the walk moves to
+ * another L2 table or the call ends.
+ */
+struct l2_map_batch {
 	u32 l1_idx;
-	u32 l1_entry;
-	u32 *l2_pt, *l2_virt;
-	unsigned int l2_idx;
-	unsigned long flags;
-	dma_addr_t dma;
-	unsigned int l2_entries;
-	size_t mapped = 0;
-	int err = 0;
-
-	spin_lock_irqsave(&mmu_info->lock, flags);
-
-	paddr = ALIGN(paddr, ISP_PAGE_SIZE);
-	for (l1_idx = iova >> ISP_L1PT_SHIFT;
-	     size > 0 && l1_idx < ISP_L1PT_PTES; l1_idx++) {
-		dev_dbg(dev,
-			"mapping l2 page table for l1 index %u (iova %8.8x)\n",
-			l1_idx, (u32)iova);
-
-		l1_entry = mmu_info->l1_pt[l1_idx];
-		if (l1_entry == mmu_info->dummy_l2_pteval) {
-			l2_virt = mmu_info->l2_pts[l1_idx];
-			if (likely(!l2_virt)) {
-				l2_virt = alloc_l2_pt(mmu_info);
-				if (!l2_virt) {
-					err = -ENOMEM;
-					goto error;
-				}
-			}
+	u32 *l2_pt;
+	unsigned int lo;
+	unsigned int hi;
+	size_t mapped;
+};
 
-			dma = map_single(mmu_info, l2_virt);
-			if (!dma) {
-				dev_err(dev, "Failed to map l2pt page\n");
-				free_page((unsigned long)l2_virt);
-				err = -EINVAL;
-				goto error;
-			}
+static void l2_map_flush(struct l2_map_batch *b)
+{
+	if (b->l2_pt && b->hi > b->lo)
+		clflush_cache_range(&b->l2_pt[b->lo],
+				    sizeof(b->l2_pt[0]) * (b->hi - b->lo));
+	b->lo = b->hi;
+}
 
-			l1_entry = dma >> ISP_PADDR_SHIFT;
+/* Return the L2 table for l1_idx, allocating it if needed */
+static u32 *l2_get_pt(struct ipu_mmu_info *mmu_info, u32 l1_idx)
+{
+	struct device *dev = mmu_info->dev;
+	u32 *l2_virt;
+	dma_addr_t dma;
 
-			dev_dbg(dev, "page for l1_idx %u %p allocated\n",
-				l1_idx, l2_virt);
-			mmu_info->l1_pt[l1_idx] = l1_entry;
-			mmu_info->l2_pts[l1_idx] = l2_virt;
+	if (mmu_info->l1_pt[l1_idx] != mmu_info->dummy_l2_pteval)
+		return mmu_info->l2_pts[l1_idx];
 
-			clflush_cache_range(&mmu_info->l1_pt[l1_idx],
-					    sizeof(mmu_info->l1_pt[l1_idx]));
-		}
+	l2_virt = mmu_info->l2_pts[l1_idx];
+	if (likely(!l2_virt)) {
+		l2_virt = alloc_l2_pt(mmu_info);
+		if (!l2_virt)
+			return ERR_PTR(-ENOMEM);
+	}
 
-		l2_pt = mmu_info->l2_pts[l1_idx];
-		l2_entries = 0;
+	dma = map_single(mmu_info, l2_virt);
+	if (!dma) {
+		dev_err(dev, "Failed to map l2pt page\n");
+		free_page((unsigned long)l2_virt);
+		return ERR_PTR(-EINVAL);
+	}
 
-		for (l2_idx = (iova & ISP_L2PT_MASK) >> ISP_L2PT_SHIFT;
-		     size > 0 && l2_idx < ISP_L2PT_PTES; l2_idx++) {
-			l2_pt[l2_idx] = paddr >> ISP_PADDR_SHIFT;
+	dev_dbg(dev, "page for l1_idx %u %p allocated\n", l1_idx, l2_virt);
+	mmu_info->l1_pt[l1_idx] = dma >> ISP_PADDR_SHIFT;
+	mmu_info->l2_pts[l1_idx] = l2_virt;
 
-			dev_dbg(dev, "l2 index %u mapped as 0x%8.8x\n", l2_idx,
-				l2_pt[l2_idx]);
+	clflush_cache_range(&mmu_info->l1_pt[l1_idx],
+			    sizeof(mmu_info->l1_pt[l1_idx]));
 
-			iova += ISP_PAGE_SIZE;
-			paddr += ISP_PAGE_SIZE;
-			mapped += ISP_PAGE_SIZE;
-			size -= ISP_PAGE_SIZE;
+	return l2_virt;
+}
 
-			l2_entries++;
+/* Fill PTEs for one physically contiguous range, mmu_info->lock held */
+static int l2_map_range(struct ipu_mmu_info *mmu_info, struct l2_map_batch *b,
+			unsigned long iova, phys_addr_t paddr, size_t size)
+{
+	while (size) {
+		u32 l1_idx = iova >> ISP_L1PT_SHIFT;
+		unsigned int l2_idx = (iova & ISP_L2PT_MASK) >> ISP_L2PT_SHIFT;
+		u32 pteval = paddr >> ISP_PADDR_SHIFT;
+		unsigned int i, n;
+		u32 *l2_pt;
+
+		if (l1_idx >= ISP_L1PT_PTES)
+			return -EINVAL;
+
+		if (!b->l2_pt || b->l1_idx != l1_idx) {
+			l2_map_flush(b);
+			dev_dbg(mmu_info->dev,
+				"mapping l2 page table for l1 index %u (iova %8.8x)\n",
+				l1_idx, (u32)iova);
+			l2_pt = l2_get_pt(mmu_info, l1_idx);
+			if (IS_ERR(l2_pt))
+				return PTR_ERR(l2_pt);
+			b->l1_idx = l1_idx;
+			b->l2_pt = l2_pt;
+			b->lo = l2_idx;
+			b->hi = l2_idx;
+		} else if (b->hi != l2_idx) {
+			l2_map_flush(b);
+			b->lo = l2_idx;
+			b->hi = l2_idx;
 		}
 
-		WARN_ON_ONCE(!l2_entries);
-		clflush_cache_range(&l2_pt[l2_idx - l2_entries],
-				    sizeof(l2_pt[0]) * l2_entries);
+		l2_pt = b->l2_pt;
+		n = min_t(size_t, ISP_L2PT_PTES - l2_idx,
+			  DIV_ROUND_UP(size, ISP_PAGE_SIZE));
+		for (i = 0; i < n; i++)
+			l2_pt[l2_idx + i] = pteval + i;
+
+		b->hi = l2_idx + n;
+		b->mapped += (size_t)n << ISP_PAGE_SHIFT;
+		iova += (unsigned long)n << ISP_PAGE_SHIFT;
+		paddr += (phys_addr_t)n << ISP_PAGE_SHIFT;
+		size -= min_t(size_t, size, (size_t)n << ISP_PAGE_SHIFT);
 	}
 
-	spin_unlock_irqrestore(&mmu_info->lock, flags);
-
 	return 0;
+}
 
-error:
+static void l2_unmap(struct ipu_mmu_info *mmu_info, unsigned long iova,
+		     phys_addr_t dummy, size_t size);
+static int l2_map(struct ipu_mmu_info *mmu_info, unsigned long iova,
+		  phys_addr_t paddr, size_t size)
+{
+	struct l2_map_batch b = { 0 };
+	unsigned long flags;
+	int err;
+
+	spin_lock_irqsave(&mmu_info->lock, flags);
+	err = l2_map_range(mmu_info, &b, iova, ALIGN(paddr, ISP_PAGE_SIZE),
+			   size);
+	l2_map_flush(&b);
 	spin_unlock_irqrestore(&mmu_info->lock, flags);
+
 	/* unroll mapping in case something went wrong */
-	if (mapped)
-		l2_unmap(mmu_info, iova - mapped, paddr - mapped, mapped);
+	if (err && b.mapped)
+		l2_unmap(mmu_info, iova, 0, b.mapped);
 
 	return err;
 }
@@ -627,6 +735,10 @@ static struct ipu_dma_mapping *alloc_dma_mapping(struct ipu_device *isp)
 #endif
 	dmap->mmu_info->dmap = dmap;
 
+	/* Without the cache IOVAs come straight from the rbtree */
+	if (ipu_dma_iova_cache_init(dmap))
+		dev_warn(&isp->pdev->dev, "no iova cache\n");
+
 	kref_init(&dmap->ref);
 
 	dev_dbg(&isp->pdev->dev, "alloc mapping\n");
@@ -707,6 +819,56 @@ int ipu_mmu_map(struct ipu_mmu_info *mmu_info, unsigned long iova,
 	return  __ipu_mmu_map(mmu_info, iova, paddr, size);
 }
 
+/*
+ * Map the DMA addresses of a scatterlist back to back starting at iova.
+ * All entries are written under one lock hold and each touched L2 table
+ * range is flushed once. The caller invalidates the TLB.
+ */
+int ipu_mmu_map_sg(struct ipu_mmu_info *mmu_info, unsigned long iova,
+		   struct scatterlist *sglist, int nents)
+{
+	struct l2_map_batch b = { 0 };
+	struct scatterlist *sg;
+	unsigned int min_pagesz;
+	unsigned long flags;
+	unsigned long addr = iova;
+	int i, err = 0;
+
+	if (mmu_info->pgsize_bitmap == 0UL)
+		return -ENODEV;
+
+	min_pagesz = 1 << __ffs(mmu_info->pgsize_bitmap);
+
+	spin_lock_irqsave(&mmu_info->lock, flags);
+	for_each_sg(sglist, sg, nents, i) {
+		phys_addr_t paddr = sg_dma_address(sg);
+		size_t size = PAGE_ALIGN(sg_dma_len(sg));
+
+		if (!IS_ALIGNED(addr | paddr | size, min_pagesz)) {
+			dev_err(mmu_info->dev,
+				"unaligned: iova 0x%lx pa %pa size 0x%zx min_pagesz 0x%x\n",
+				addr, &paddr, size, min_pagesz);
+			err = -EINVAL;
+			break;
+		}
+
+		err = l2_map_range(mmu_info, &b, addr, paddr, size);
+		if (err)
+			break;
+		addr += size;
+	}
+	l2_map_flush(&b);
+	spin_unlock_irqrestore(&mmu_info->lock, flags);
+
+	dev_dbg(mmu_info->dev, "map_sg: iova 0x%lx size 0x%zx ents %d (%d)\n",
+		iova, b.mapped, nents, err);
+
+	if (err && b.mapped)
+		l2_unmap(mmu_info, iova, 0, b.mapped);
+
+	return err;
+}
+
 static void ipu_mmu_destroy(struct ipu_mmu *mmu)
 {
 	struct ipu_dma_mapping *dmap = mmu->dmap;
@@ -789,6 +951,7 @@ struct ipu_mmu *ipu_mmu_init(struct device *dev,
 	mmu->tlb_invalidate = tlb_invalidate;
 	mmu->ready = false;
 	INIT_LIST_HEAD(&mmu->vma_list);
+	INIT_LIST_HEAD(&mmu->gather_release);
 	spin_lock_init(&mmu->ready_lock);
 
 	mmu->dmap = alloc_dma_mapping(isp);
@@ -806,11 +969,16 @@ void ipu_mmu_cleanup(struct ipu_mmu *mmu)
 
 	ipu_mmu_destroy(mmu);
 	mmu->dmap = NULL;
+	ipu_dma_iova_cache_destroy(dmap);
 	iova_cache_put();
 	put_iova_domain(&dmap->iovad);
 	kfree(dmap);
 }
 
+#if IS_ENABLED(CONFIG_VIDEO_INTEL_IPU6_DMA_KUNIT_TEST)
+#include "ipu-mmu-test.c"
+#endif
+
 MODULE_AUTHOR("Sakari Ailus <sakari.ailus@linux.intel.com>");
 MODULE_AUTHOR("Samu Onkalo <samu.onkalo@intel.com>");
 MODULE_LICENSE("GPL");
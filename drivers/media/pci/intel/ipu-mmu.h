@@ -35,6 +35,15 @@ struct ipu_mmu_info {
 	struct ipu_dma_mapping *dmap;
 };
 
+/*
+ * Backing memory and IOVA of an unmapped range, released by the MMU once
+ * the TLB no longer references them.
+ */
+struct ipu_mmu_deferred {
+	struct list_head list;
+	void (*release)(struct ipu_mmu_deferred *d);
+};
+
 /*
  * @pgtbl: physical address of the l1 page table
  */
@@ -58,6 +67,13 @@ struct ipu_mmu {
 	bool ready;
 	spinlock_t ready_lock;	/* Serialize access to bool ready */
 
+	/* Unmap invalidation batching, protected by ready_lock */
+	unsigned int unmap_gather;
+	bool tlb_inv_pending;
+	u64 tlb_inv_issued;
+	u64 tlb_inv_coalesced;
+	struct list_head gather_release;
+
 	void (*tlb_invalidate)(struct ipu_mmu *mmu);
 };
 
@@ -69,8 +85,13 @@ int ipu_mmu_hw_init(struct ipu_mmu *mmu);
 int ipu_mmu_hw_cleanup(struct ipu_mmu *mmu);
 int ipu_mmu_map(struct ipu_mmu_info *mmu_info, unsigned long iova,
 		phys_addr_t paddr, size_t size);
+int ipu_mmu_map_sg(struct ipu_mmu_info *mmu_info, unsigned long iova,
+		   struct scatterlist *sglist, int nents);
 void ipu_mmu_unmap(struct ipu_mmu_info *mmu_info, unsigned long iova,
 		   size_t size);
+void ipu_mmu_unmap_gather_begin(struct ipu_mmu *mmu);
+void ipu_mmu_unmap_gather_end(struct ipu_mmu *mmu);
+void ipu_mmu_unmap_defer(struct ipu_mmu *mmu, struct ipu_mmu_deferred *d);
 phys_addr_t ipu_mmu_iova_to_phys(struct ipu_mmu_info *mmu_info,
 				 dma_addr_t iova);
 #endif
@@ -81,6 +81,8 @@ get_ipu_psys_command32(struct ipu_psys_command *kp,
 
 	kp->pg_manifest = compat_ptr(pgm);
 	kp->buffers = compat_ptr(bufs);
+	kp->sched_class = IPU_PSYS_SCHED_CLASS_AUTO;
+	kp->deadline_us = 0;
 
 	return 0;
 }
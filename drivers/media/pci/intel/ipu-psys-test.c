@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2024 Intel Corporation
+
+/*
+ * KUnit tests for the PSYS fh buffer map, included from ipu-psys.c so
+ * that the static helpers can be reached. kbuffers are only tracked,
+ * never backed by a dmabuf, which is all the QCMD lookups look at.
+ */
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+#define PSYS_TEST_MAX_KBUFS		1024
+#define PSYS_TEST_BENCH_QCMDS		10000
+#define PSYS_TEST_FD_BASE		10
+
+struct psys_test {
+	struct ipu_psys_fh fh;
+	struct ipu_psys_kbuffer kbufs[PSYS_TEST_MAX_KBUFS];
+};
+
+static int psys_test_init(struct kunit *test)
+{
+	struct psys_test *t;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+
+	INIT_LIST_HEAD(&t->fh.bufmap);
+	hash_init(t->fh.bufmap_fd);
+	hash_init(t->fh.bufmap_kaddr);
+
+	test->priv = t;
+
+	return 0;
+}
+
+/* Track n kbuffers with fds from PSYS_TEST_FD_BASE, as MAPBUF does */
+static void psys_test_map(struct psys_test *t, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		struct ipu_psys_kbuffer *kbuf = &t->kbufs[i];
+
+		kbuf->fd = PSYS_TEST_FD_BASE + i;
+		kbuf->kaddr = kbuf;
+		ipu_psys_kbuf_track(&t->fh, kbuf);
+		hash_add(t->fh.bufmap_kaddr, &kbuf->kaddr_node,
+			 (unsigned long)kbuf->kaddr);
+	}
+}
+
+static void psys_test_lookup(struct kunit *test)
+{
+	struct psys_test *t = test->priv;
+	struct ipu_psys_kbuffer *kbuf;
+	unsigned int i, n = PSYS_TEST_MAX_KBUFS;
+
+	psys_test_map(t, n);
+
+	for (i = 0; i < n; i++) {
+		kbuf = &t->kbufs[i];
+		KUNIT_EXPECT_PTR_EQ(test,
+				    ipu_psys_lookup_kbuffer(&t->fh, kbuf->fd),
+				    kbuf);
+		KUNIT_EXPECT_PTR_EQ(test,
+				    ipu_psys_lookup_kbuffer_by_kaddr(&t->fh,
+								     kbuf),
+				    kbuf);
+	}
+	KUNIT_EXPECT_PTR_EQ(test, ipu_psys_lookup_kbuffer(&t->fh, -1), NULL);
+	KUNIT_EXPECT_PTR_EQ(test,
+			    ipu_psys_lookup_kbuffer(&t->fh,
+						    PSYS_TEST_FD_BASE + n),
+			    NULL);
+	KUNIT_EXPECT_PTR_EQ(test,
+			    ipu_psys_lookup_kbuffer_by_kaddr(&t->fh, t), NULL);
+
+	/* Unmapped buffers drop out of both indexes */
+	for (i = 0; i < n; i += 2)
+		ipu_psys_kbuf_untrack(&t->kbufs[i]);
+	for (i = 0; i < n; i++) {
+		kbuf = &t->kbufs[i];
+		KUNIT_EXPECT_PTR_EQ(test,
+				    ipu_psys_lookup_kbuffer(&t->fh, kbuf->fd),
+				    i % 2 ? kbuf : NULL);
+		KUNIT_EXPECT_PTR_EQ(test,
+				    ipu_psys_lookup_kbuffer_by_kaddr(&t->fh,
+								     kbuf),
+				    i % 2 ? kbuf : NULL);
+	}
+}
+
+/* The fh->bufmap walk that the fd index replaced, for reference */
+static struct ipu_psys_kbuffer *psys_test_walk(struct ipu_psys_fh *fh, int fd)
+{
+	struct ipu_psys_kbuffer *kbuf;
+
+	list_for_each_entry(kbuf, &fh->bufmap, list)
+		if (kbuf->fd == fd)
+			return kbuf;
+
+	return NULL;
+}
+
+/*
+ * Buffer lookups of one QCMD with n buffers mapped on the fh: each of
+ * its IPU_MAX_PSYS_CMD_BUFFERS fds is looked up twice by
+ * ipu_psys_resolve_cmd() and the pg once more by kaddr on completion.
+ */
+static void psys_test_bench_qcmd(struct kunit *test, unsigned int n)
+{
+	struct psys_test *t = test->priv;
+	unsigned int i, j, fd = 0;
+	u64 start, hash_ns, walk_ns;
+
+	psys_test_map(t, n);
+
+	start = ktime_get_ns();
+	for (i = 0; i < PSYS_TEST_BENCH_QCMDS; i++) {
+		for (j = 0; j < IPU_MAX_PSYS_CMD_BUFFERS; j++, fd++) {
+			int bfd = PSYS_TEST_FD_BASE + fd % n;
+
+			KUNIT_ASSERT_NOT_ERR_OR_NULL(test,
+				ipu_psys_lookup_kbuffer(&t->fh, bfd));
+			KUNIT_ASSERT_NOT_ERR_OR_NULL(test,
+				ipu_psys_lookup_kbuffer(&t->fh, bfd));
+		}
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test,
+			ipu_psys_lookup_kbuffer_by_kaddr(&t->fh,
+							 &t->kbufs[i % n]));
+	}
+	hash_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	for (i = 0; i < PSYS_TEST_BENCH_QCMDS; i++) {
+		for (j = 0; j < IPU_MAX_PSYS_CMD_BUFFERS; j++, fd++) {
+			int bfd = PSYS_TEST_FD_BASE + fd % n;
+
+			KUNIT_ASSERT_NOT_ERR_OR_NULL(test,
+				psys_test_walk(&t->fh, bfd));
+			KUNIT_ASSERT_NOT_ERR_OR_NULL(test,
+				psys_test_walk(&t->fh, bfd));
+		}
+	}
+	walk_ns = ktime_get_ns() - start;
+
+	kunit_info(test,
+		   "qcmd lookups: %llu ns/cmd indexed, %llu ns/cmd list walk, %u bufs mapped\n",
+		   div_u64(hash_ns, PSYS_TEST_BENCH_QCMDS),
+		   div_u64(walk_ns, PSYS_TEST_BENCH_QCMDS), n);
+}
+
+static void psys_test_bench_qcmd_16(struct kunit *test)
+{
+	psys_test_bench_qcmd(test, 16);
+}
+
+static void psys_test_bench_qcmd_128(struct kunit *test)
+{
+	psys_test_bench_qcmd(test, 128);
+}
+
+static void psys_test_bench_qcmd_1024(struct kunit *test)
+{
+	psys_test_bench_qcmd(test, 1024);
+}
+
+static struct kunit_case psys_test_cases[] = {
+	KUNIT_CASE(psys_test_lookup),
+	KUNIT_CASE(psys_test_bench_qcmd_16),
+	KUNIT_CASE(psys_test_bench_qcmd_128),
+	KUNIT_CASE(psys_test_bench_qcmd_1024),
+	{}
+};
+
+static struct kunit_suite psys_test_suite = {
+	.name = "ipu-psys-bufmap",
+	.init = psys_test_init,
+	.test_cases = psys_test_cases,
+};
+
+kunit_test_suite(psys_test_suite);
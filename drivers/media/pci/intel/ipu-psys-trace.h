@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2024 Intel Corporation */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ipu_psys
+
+#if !defined(IPU_PSYS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define IPU_PSYS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "ipu-psys.h"
+#include "ipu-fw-psys.h"
+
+DECLARE_EVENT_CLASS(ipu_psys_kcmd_class,
+	TP_PROTO(struct ipu_psys_kcmd *kcmd),
+	TP_ARGS(kcmd),
+	TP_STRUCT__entry(
+		__field(const void *, fh)
+		__field(int, pg_id)
+		__field(unsigned int, state)
+		__field(u64, issue_id)
+		__field(u64, user_token)
+	),
+	TP_fast_assign(
+		__entry->fh = kcmd->fh;
+		__entry->pg_id = ipu_fw_psys_pg_get_id(kcmd);
+		__entry->state = kcmd->state;
+		__entry->issue_id = kcmd->issue_id;
+		__entry->user_token = kcmd->user_token;
+	),
+	TP_printk("fh=%p pg=%d state=%u issue_id=0x%llx user_token=0x%llx",
+		  __entry->fh, __entry->pg_id, __entry->state,
+		  __entry->issue_id, __entry->user_token)
+);
+
+DEFINE_EVENT(ipu_psys_kcmd_class, ipu_psys_kcmd_new,
+	TP_PROTO(struct ipu_psys_kcmd *kcmd),
+	TP_ARGS(kcmd)
+);
+
+DEFINE_EVENT(ipu_psys_kcmd_class, ipu_psys_kcmd_send,
+	TP_PROTO(struct ipu_psys_kcmd *kcmd),
+	TP_ARGS(kcmd)
+);
+
+DEFINE_EVENT(ipu_psys_kcmd_class, ipu_psys_kcmd_start,
+	TP_PROTO(struct ipu_psys_kcmd *kcmd),
+	TP_ARGS(kcmd)
+);
+
+DEFINE_EVENT(ipu_psys_kcmd_class, ipu_psys_kcmd_dequeue,
+	TP_PROTO(struct ipu_psys_kcmd *kcmd),
+	TP_ARGS(kcmd)
+);
+
+TRACE_EVENT(ipu_psys_kcmd_complete,
+	TP_PROTO(struct ipu_psys_kcmd *kcmd, int error),
+	TP_ARGS(kcmd, error),
+	TP_STRUCT__entry(
+		__field(const void *, fh)
+		__field(int, pg_id)
+		__field(int, error)
+		__field(u64, issue_id)
+		__field(u64, user_token)
+	),
+	TP_fast_assign(
+		__entry->fh = kcmd->fh;
+		__entry->pg_id = ipu_fw_psys_pg_get_id(kcmd);
+		__entry->error = error;
+		__entry->issue_id = kcmd->issue_id;
+		__entry->user_token = kcmd->user_token;
+	),
+	TP_printk("fh=%p pg=%d error=%d issue_id=0x%llx user_token=0x%llx",
+		  __entry->fh, __entry->pg_id, __entry->error,
+		  __entry->issue_id, __entry->user_token)
+);
+
+#endif /* IPU_PSYS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ipu-psys-trace
+#include <trace/define_trace.h>
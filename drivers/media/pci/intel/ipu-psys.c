@@ -9,7 +9,9 @@
 #include <linux/fs.h>
 #include <linux/highmem.h>
 #include <linux/init_task.h>
+#include <linux/jhash.h>
 #include <linux/kthread.h>
+#include <linux/log2.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/pm_runtime.h>
@@ -31,6 +33,7 @@
 #include <uapi/linux/ipu-psys.h>
 
 #include "ipu.h"
+#include "ipu-dma.h"
 #include "ipu-mmu.h"
 #include "ipu-bus.h"
 #include "ipu-platform.h"
@@ -42,10 +45,18 @@
 #include "ipu-platform-regs.h"
 #include "ipu-fw-com.h"
 
+#define CREATE_TRACE_POINTS
+#include "ipu-psys-trace.h"
+
 static bool async_fw_init;
 module_param(async_fw_init, bool, 0664);
 MODULE_PARM_DESC(async_fw_init, "Enable asynchronous firmware initialization");
 
+static bool pg_pool_strict;
+module_param(pg_pool_strict, bool, 0664);
+MODULE_PARM_DESC(pg_pool_strict,
+		 "Never allocate PG buffers when commands are submitted");
+
 #define IPU_PSYS_NUM_DEVICES		4
 
 static int psys_runtime_pm_resume(struct device *dev);
@@ -66,48 +77,510 @@ static struct bus_type ipu_psys_bus = {
 	.name = IPU_PSYS_NAME,
 };
 
-struct ipu_psys_pg *__get_pg_buf(struct ipu_psys *psys, size_t pg_size)
+static unsigned int ipu_psys_pg_class(size_t size)
+{
+	if (size <= BIT(IPU_PSYS_PG_MIN_SHIFT))
+		return 0;
+
+	return order_base_2(size) - IPU_PSYS_PG_MIN_SHIFT;
+}
+
+static struct ipu_psys_pg *ipu_psys_pg_alloc(struct ipu_psys *psys,
+					     size_t size)
 {
 	struct ipu_psys_pg *kpg;
-	unsigned long flags;
 
-	spin_lock_irqsave(&psys->pgs_lock, flags);
-	list_for_each_entry(kpg, &psys->pgs, list) {
-		if (!kpg->pg_size && kpg->size >= pg_size) {
-			kpg->pg_size = pg_size;
-			spin_unlock_irqrestore(&psys->pgs_lock, flags);
-			return kpg;
-		}
-	}
-	spin_unlock_irqrestore(&psys->pgs_lock, flags);
-	/* no big enough buffer available, allocate new one */
 	kpg = kzalloc(sizeof(*kpg), GFP_KERNEL);
 	if (!kpg)
 		return NULL;
 
-	kpg->pg = dma_alloc_attrs(&psys->adev->dev, pg_size,
+	kpg->pg = dma_alloc_attrs(&psys->adev->dev, size,
 				  &kpg->pg_dma_addr, GFP_KERNEL, 0);
 	if (!kpg->pg) {
 		kfree(kpg);
 		return NULL;
 	}
 
+	kpg->size = size;
+	INIT_LIST_HEAD(&kpg->pool_list);
+
+	return kpg;
+}
+
+/* Add a newly allocated, unused kpg to the pool, pgs_lock held or at probe */
+static void ipu_psys_pg_pool_add(struct ipu_psys *psys,
+				 struct ipu_psys_pg *kpg)
+{
+	unsigned int class = ipu_psys_pg_class(kpg->size);
+
+	list_add(&kpg->list, &psys->pgs);
+	if (class < IPU_PSYS_PG_POOL_CLASSES)
+		list_add(&kpg->pool_list, &psys->pg_pool.free[class]);
+	else
+		list_add(&kpg->pool_list, &psys->pg_pool.oversize);
+}
+
+struct ipu_psys_pg *__get_pg_buf(struct ipu_psys *psys, size_t pg_size)
+{
+	struct ipu_psys_pg_pool *pool = &psys->pg_pool;
+	unsigned int class = ipu_psys_pg_class(pg_size);
+	struct ipu_psys_pg *kpg, *spare = NULL;
+	unsigned long flags;
+	bool prewarm;
+	unsigned int i;
+
+	spin_lock_irqsave(&psys->pgs_lock, flags);
+	for (i = class; i < IPU_PSYS_PG_POOL_CLASSES; i++) {
+		kpg = list_first_entry_or_null(&pool->free[i],
+					       struct ipu_psys_pg, pool_list);
+		if (kpg)
+			goto found;
+	}
+	list_for_each_entry(kpg, &pool->oversize, pool_list) {
+		if (kpg->size >= pg_size)
+			goto found;
+	}
+
+	if (pg_pool_strict) {
+		pool->exhausted++;
+		spin_unlock_irqrestore(&psys->pgs_lock, flags);
+		dev_dbg(&psys->adev->dev, "no pg buffer for size %zu\n",
+			pg_size);
+		return NULL;
+	}
+	pool->misses++;
+	prewarm = class < IPU_PSYS_PG_POOL_CLASSES &&
+		  !__test_and_set_bit(class, &pool->prewarmed);
+	spin_unlock_irqrestore(&psys->pgs_lock, flags);
+
+	/* no big enough buffer available, allocate new one */
+	kpg = ipu_psys_pg_alloc(psys, BIT(class + IPU_PSYS_PG_MIN_SHIFT));
+	if (!kpg)
+		return NULL;
+
+	/*
+	 * The first miss of a class comes from the first PG of that size.
+	 * Its ppg keeps this buffer, so add a spare for the commands which
+	 * follow it.
+	 */
+	if (prewarm)
+		spare = ipu_psys_pg_alloc(psys,
+					  BIT(class + IPU_PSYS_PG_MIN_SHIFT));
+
 	kpg->pg_size = pg_size;
-	kpg->size = pg_size;
 	spin_lock_irqsave(&psys->pgs_lock, flags);
 	list_add(&kpg->list, &psys->pgs);
+	if (spare)
+		ipu_psys_pg_pool_add(psys, spare);
+	spin_unlock_irqrestore(&psys->pgs_lock, flags);
+
+	return kpg;
+
+found:
+	list_del_init(&kpg->pool_list);
+	kpg->pg_size = pg_size;
+	pool->hits++;
 	spin_unlock_irqrestore(&psys->pgs_lock, flags);
 
 	return kpg;
 }
 
+void __put_pg_buf(struct ipu_psys *psys, struct ipu_psys_pg *kpg)
+{
+	unsigned int class = ipu_psys_pg_class(kpg->size);
+	unsigned long flags;
+
+	spin_lock_irqsave(&psys->pgs_lock, flags);
+	kpg->pg_size = 0;
+	if (class < IPU_PSYS_PG_POOL_CLASSES)
+		list_add(&kpg->pool_list, &psys->pg_pool.free[class]);
+	else
+		list_add(&kpg->pool_list, &psys->pg_pool.oversize);
+	spin_unlock_irqrestore(&psys->pgs_lock, flags);
+}
+
+static int ipu_psys_pg_pool_init(struct ipu_psys *psys)
+{
+	struct ipu_psys_pg *kpg;
+	unsigned int i;
+
+	for (i = 0; i < IPU_PSYS_PG_POOL_CLASSES; i++)
+		INIT_LIST_HEAD(&psys->pg_pool.free[i]);
+	INIT_LIST_HEAD(&psys->pg_pool.oversize);
+
+	/* allocate and map memory for process groups */
+	for (i = 0; i < IPU_PSYS_PG_POOL_SIZE; i++) {
+		kpg = ipu_psys_pg_alloc(psys, IPU_PSYS_PG_MAX_SIZE);
+		if (!kpg)
+			return -ENOMEM;
+		ipu_psys_pg_pool_add(psys, kpg);
+	}
+
+	return 0;
+}
+
+/* A kcmd together with room for its buffer arrays */
+struct ipu_psys_kcmd_slot {
+	struct ipu_psys_kcmd kcmd;
+	struct ipu_psys_buffer buffers[IPU_PSYS_KCMD_INLINE_BUFFERS];
+	struct ipu_psys_kbuffer *kbufs[IPU_PSYS_KCMD_INLINE_BUFFERS];
+};
+
+struct ipu_psys_kcmd *ipu_psys_kcmd_pool_get(struct ipu_psys *psys)
+{
+	struct ipu_psys_kcmd_pool *pool = &psys->kcmd_pool;
+	struct ipu_psys_kcmd_slot *slot = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (!list_empty(&pool->free)) {
+		slot = list_first_entry(&pool->free, struct ipu_psys_kcmd_slot,
+					kcmd.list);
+		list_del(&slot->kcmd.list);
+		pool->nfree--;
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (!slot) {
+		slot = kmem_cache_alloc(pool->cache, GFP_KERNEL);
+		if (!slot)
+			return NULL;
+	}
+
+	memset(&slot->kcmd, 0, sizeof(slot->kcmd));
+
+	return &slot->kcmd;
+}
+
+/* Set up kcmd->buffers and kcmd->kbufs for kcmd->nbuffers terminals */
+int ipu_psys_kcmd_pool_get_buffers(struct ipu_psys *psys,
+				   struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys_kcmd_slot *slot =
+		container_of(kcmd, struct ipu_psys_kcmd_slot, kcmd);
+	struct ipu_psys_kcmd_pool *pool = &psys->kcmd_pool;
+	unsigned long flags;
+
+	if (kcmd->nbuffers <= IPU_PSYS_KCMD_INLINE_BUFFERS) {
+		memset(slot->buffers, 0,
+		       kcmd->nbuffers * sizeof(slot->buffers[0]));
+		memset(slot->kbufs, 0, kcmd->nbuffers * sizeof(slot->kbufs[0]));
+		kcmd->buffers = slot->buffers;
+		kcmd->kbufs = slot->kbufs;
+		return 0;
+	}
+
+	spin_lock_irqsave(&pool->lock, flags);
+	pool->array_allocs++;
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	kcmd->buffers = kcalloc(kcmd->nbuffers, sizeof(*kcmd->buffers),
+				GFP_KERNEL);
+	if (!kcmd->buffers)
+		return -ENOMEM;
+
+	kcmd->kbufs = kcalloc(kcmd->nbuffers, sizeof(kcmd->kbufs[0]),
+			      GFP_KERNEL);
+	if (!kcmd->kbufs)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void ipu_psys_kcmd_pool_put(struct ipu_psys *psys, struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys_kcmd_slot *slot =
+		container_of(kcmd, struct ipu_psys_kcmd_slot, kcmd);
+	struct ipu_psys_kcmd_pool *pool = &psys->kcmd_pool;
+	unsigned long flags;
+
+	if (kcmd->buffers != slot->buffers)
+		kfree(kcmd->buffers);
+	if (kcmd->kbufs != slot->kbufs)
+		kfree(kcmd->kbufs);
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (pool->nfree < IPU_PSYS_KCMD_POOL_SIZE) {
+		list_add(&kcmd->list, &pool->free);
+		pool->nfree++;
+		slot = NULL;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (slot)
+		kmem_cache_free(pool->cache, slot);
+}
+
+static int ipu_psys_kcmd_pool_init(struct ipu_psys *psys)
+{
+	struct ipu_psys_kcmd_pool *pool = &psys->kcmd_pool;
+	struct ipu_psys_kcmd_slot *slot;
+	unsigned int i;
+
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->free);
+	pool->nfree = 0;
+
+	pool->cache = kmem_cache_create("ipu_psys_kcmd",
+					sizeof(struct ipu_psys_kcmd_slot),
+					0, 0, NULL);
+	if (!pool->cache)
+		return -ENOMEM;
+
+	for (i = 0; i < IPU_PSYS_KCMD_POOL_SIZE; i++) {
+		slot = kmem_cache_alloc(pool->cache, GFP_KERNEL);
+		if (!slot)
+			break;
+		list_add(&slot->kcmd.list, &pool->free);
+		pool->nfree++;
+	}
+
+	return 0;
+}
+
+static void ipu_psys_kcmd_pool_cleanup(struct ipu_psys *psys)
+{
+	struct ipu_psys_kcmd_pool *pool = &psys->kcmd_pool;
+	struct ipu_psys_kcmd_slot *slot, *slot0;
+
+	if (!pool->cache)
+		return;
+
+	list_for_each_entry_safe(slot, slot0, &pool->free, kcmd.list) {
+		list_del(&slot->kcmd.list);
+		kmem_cache_free(pool->cache, slot);
+	}
+	pool->nfree = 0;
+
+	kmem_cache_destroy(pool->cache);
+	pool->cache = NULL;
+}
+
+struct ipu_psys_manifest_entry {
+	struct hlist_node node;
+	struct kref ref;
+	struct ipu_psys *psys;
+	u32 pg_id;
+	u32 hash;
+	size_t size;
+	u8 data[];
+};
+
+/* An fh passed entry from uptr; holds a reference to entry */
+struct ipu_psys_manifest_key {
+	struct hlist_node node;
+	struct ipu_psys_fh *fh;
+	const void __user *uptr;
+	size_t size;
+	struct ipu_psys_manifest_entry *entry;
+};
+
+static void ipu_psys_manifest_entry_free(struct kref *ref)
+{
+	struct ipu_psys_manifest_entry *entry =
+		container_of(ref, struct ipu_psys_manifest_entry, ref);
+
+	hash_del(&entry->node);
+	kfree(entry);
+}
+
+/* Drop a reference with the cache lock already held */
+static void
+ipu_psys_manifest_entry_put_locked(struct ipu_psys_manifest_entry *entry)
+{
+	kref_put(&entry->ref, ipu_psys_manifest_entry_free);
+}
+
+static struct ipu_psys_manifest_key *
+ipu_psys_manifest_key_find(struct ipu_psys_manifest_cache *cache,
+			   struct ipu_psys_fh *fh,
+			   const void __user *uptr, size_t size)
+{
+	struct ipu_psys_manifest_key *key;
+
+	hash_for_each_possible(cache->keys, key, node, (unsigned long)uptr)
+		if (key->fh == fh && key->uptr == uptr && key->size == size)
+			return key;
+
+	return NULL;
+}
+
+/*
+ * Return the cached instance of a user space manifest, adding it to the
+ * cache if no identical manifest is there yet. The returned data is
+ * read-only and must be released with ipu_psys_manifest_cache_put().
+ *
+ * A manifest the fh passed from the same address with the same size
+ * before is taken from the cache after comparing only its header; the
+ * whole manifest is copied and hashed on a miss. Rewriting a manifest
+ * in place without changing its header is not noticed.
+ */
+void *ipu_psys_manifest_cache_get(struct ipu_psys_fh *fh,
+				  const void __user *umanifest, size_t size)
+{
+	struct ipu_psys *psys = fh->psys;
+	struct ipu_psys_manifest_cache *cache = &psys->manifest_cache;
+	struct ipu_fw_psys_program_group_manifest hdr;
+	const struct ipu_fw_psys_program_group_manifest *pgm;
+	struct ipu_psys_manifest_entry *entry, *e, *stale = NULL;
+	struct ipu_psys_manifest_key *key, *old = NULL;
+
+	if (size < sizeof(*pgm))
+		return ERR_PTR(-EINVAL);
+
+	if (copy_from_user(&hdr, umanifest, sizeof(hdr)))
+		return ERR_PTR(-EFAULT);
+
+	mutex_lock(&cache->lock);
+	key = ipu_psys_manifest_key_find(cache, fh, umanifest, size);
+	if (key && !memcmp(key->entry->data, &hdr, sizeof(hdr))) {
+		kref_get(&key->entry->ref);
+		cache->hits++;
+		mutex_unlock(&cache->lock);
+		return key->entry->data;
+	}
+	mutex_unlock(&cache->lock);
+
+	entry = kmalloc(struct_size(entry, data, size), GFP_KERNEL);
+	if (!entry)
+		return ERR_PTR(-ENOMEM);
+
+	if (copy_from_user(entry->data, umanifest, size)) {
+		kfree(entry);
+		return ERR_PTR(-EFAULT);
+	}
+
+	pgm = (const struct ipu_fw_psys_program_group_manifest *)entry->data;
+	entry->psys = psys;
+	entry->pg_id = pgm->ID;
+	entry->size = size;
+	entry->hash = jhash(entry->data, size, entry->pg_id);
+	kref_init(&entry->ref);
+
+	/* Allocated before the lock, freed again if the fh has no room */
+	key = kmalloc(sizeof(*key), GFP_KERNEL);
+
+	mutex_lock(&cache->lock);
+	hash_for_each_possible(cache->entries, e, node, entry->hash) {
+		if (e->hash != entry->hash || e->pg_id != entry->pg_id ||
+		    e->size != size || memcmp(e->data, entry->data, size))
+			continue;
+		kref_get(&e->ref);
+		cache->hits++;
+		kfree(entry);
+		entry = e;
+		goto found;
+	}
+	hash_add(cache->entries, &entry->node, entry->hash);
+	cache->misses++;
+
+found:
+	/* Point the key of this fh and address at what it holds now */
+	if (key)
+		old = ipu_psys_manifest_key_find(cache, fh, umanifest, size);
+	if (old) {
+		stale = old->entry;
+		old->entry = entry;
+		kref_get(&entry->ref);
+	} else if (key && fh->manifest_keys < IPU_PSYS_FH_MANIFEST_KEYS) {
+		key->fh = fh;
+		key->uptr = umanifest;
+		key->size = size;
+		key->entry = entry;
+		kref_get(&entry->ref);
+		hash_add(cache->keys, &key->node, (unsigned long)umanifest);
+		fh->manifest_keys++;
+		key = NULL;
+	}
+	if (stale)
+		ipu_psys_manifest_entry_put_locked(stale);
+	mutex_unlock(&cache->lock);
+	kfree(key);
+
+	return entry->data;
+}
+
+void *ipu_psys_manifest_cache_ref(void *manifest)
+{
+	struct ipu_psys_manifest_entry *entry =
+		container_of(manifest, struct ipu_psys_manifest_entry, data);
+
+	kref_get(&entry->ref);
+
+	return manifest;
+}
+
+static void ipu_psys_manifest_entry_release(struct kref *ref)
+{
+	struct ipu_psys_manifest_entry *entry =
+		container_of(ref, struct ipu_psys_manifest_entry, ref);
+
+	hash_del(&entry->node);
+	mutex_unlock(&entry->psys->manifest_cache.lock);
+	kfree(entry);
+}
+
+void ipu_psys_manifest_cache_put(struct ipu_psys *psys, void *manifest)
+{
+	struct ipu_psys_manifest_entry *entry;
+
+	if (!manifest)
+		return;
+
+	entry = container_of(manifest, struct ipu_psys_manifest_entry, data);
+	kref_put_mutex(&entry->ref, ipu_psys_manifest_entry_release,
+		       &psys->manifest_cache.lock);
+}
+
+/* Drop the keys of an fh which is going away */
+void ipu_psys_manifest_cache_forget(struct ipu_psys_fh *fh)
+{
+	struct ipu_psys_manifest_cache *cache = &fh->psys->manifest_cache;
+	struct ipu_psys_manifest_key *key;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	mutex_lock(&cache->lock);
+	hash_for_each_safe(cache->keys, bkt, tmp, key, node) {
+		if (key->fh != fh)
+			continue;
+		hash_del(&key->node);
+		ipu_psys_manifest_entry_put_locked(key->entry);
+		kfree(key);
+	}
+	fh->manifest_keys = 0;
+	mutex_unlock(&cache->lock);
+}
+
 static int ipu_psys_unmapbuf_locked(int fd, struct ipu_psys_fh *fh,
 				    struct ipu_psys_kbuffer *kbuf);
+
+/*
+ * Add kbuf to the fh bufmap and index it by fd. The kaddr index is
+ * only filled once the buffer has been vmapped. Called with fh->mutex.
+ */
+static void ipu_psys_kbuf_track(struct ipu_psys_fh *fh,
+				struct ipu_psys_kbuffer *kbuf)
+{
+	list_add(&kbuf->list, &fh->bufmap);
+	hash_add(fh->bufmap_fd, &kbuf->fd_node, kbuf->fd);
+}
+
+static void ipu_psys_kbuf_untrack(struct ipu_psys_kbuffer *kbuf)
+{
+	list_del(&kbuf->list);
+	hash_del(&kbuf->fd_node);
+	hash_del(&kbuf->kaddr_node);
+}
+
 struct ipu_psys_kbuffer *ipu_psys_lookup_kbuffer(struct ipu_psys_fh *fh, int fd)
 {
 	struct ipu_psys_kbuffer *kbuf;
 
-	list_for_each_entry(kbuf, &fh->bufmap, list) {
+	hash_for_each_possible(fh->bufmap_fd, kbuf, fd_node, fd) {
 		if (kbuf->fd == fd)
 			return kbuf;
 	}
@@ -120,7 +593,8 @@ ipu_psys_lookup_kbuffer_by_kaddr(struct ipu_psys_fh *fh, void *kaddr)
 {
 	struct ipu_psys_kbuffer *kbuffer;
 
-	list_for_each_entry(kbuffer, &fh->bufmap, list) {
+	hash_for_each_possible(fh->bufmap_kaddr, kbuffer, kaddr_node,
+			       (unsigned long)kaddr) {
 		if (kbuffer->kaddr == kaddr)
 			return kbuffer;
 	}
@@ -321,6 +795,7 @@ static struct sg_table *ipu_dma_buf_map(struct dma_buf_attachment *attach,
 					enum dma_data_direction dir)
 {
 	struct ipu_dma_buf_attach *ipu_attach = attach->priv;
+	struct ipu_psys_kbuffer *kbuf = attach->dmabuf->priv;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
 	DEFINE_DMA_ATTRS(attrs);
 #else
@@ -362,8 +837,10 @@ static struct sg_table *ipu_dma_buf_map(struct dma_buf_attachment *attach,
 	 * Initial cache flush to avoid writing dirty pages for buffers which
 	 * are later marked as IPU_BUFFER_FLAG_NO_FLUSH.
 	 */
-	dma_sync_sg_for_device(attach->dev, ipu_attach->sgt->sgl,
-			       ipu_attach->sgt->orig_nents, DMA_BIDIRECTIONAL);
+	if (!(kbuf->flags & IPU_BUFFER_FLAG_DEVICE_ONLY))
+		dma_sync_sg_for_device(attach->dev, ipu_attach->sgt->sgl,
+				       ipu_attach->sgt->orig_nents,
+				       DMA_BIDIRECTIONAL);
 
 	return ipu_attach->sgt;
 }
@@ -580,7 +1057,14 @@ static int ipu_psys_open(struct inode *inode, struct file *file)
 
 	mutex_init(&fh->mutex);
 	INIT_LIST_HEAD(&fh->bufmap);
+	hash_init(fh->bufmap_fd);
+	hash_init(fh->bufmap_kaddr);
 	init_waitqueue_head(&fh->wait);
+	init_llist_head(&fh->done_queue);
+	INIT_LIST_HEAD(&fh->done_list);
+	spin_lock_init(&fh->done_lock);
+	spin_lock_init(&fh->ring_lock);
+	init_llist_head(&fh->reap_queue);
 
 	rval = ipu_psys_fh_init(fh);
 	if (rval)
@@ -653,11 +1137,21 @@ static int ipu_psys_release(struct inode *inode, struct file *file)
 	struct ipu_psys_kbuffer *kbuf, *kbuf0;
 	struct dma_buf_attachment *db_attach;
 
+	mutex_lock(&psys->mutex);
+	list_del(&fh->list);
+
+	mutex_unlock(&psys->mutex);
+	/* Stop the ppgs before unmapping the buffers they may still use */
+	ipu_psys_fh_deinit(fh);
+	ipu_psys_manifest_cache_forget(fh);
+
 	mutex_lock(&fh->mutex);
+	/* The ppgs are stopped: one TLB invalidate for all the unmaps */
+	ipu_mmu_unmap_gather_begin(psys->adev->mmu);
 	/* clean up buffers */
 	if (!list_empty(&fh->bufmap)) {
 		list_for_each_entry_safe(kbuf, kbuf0, &fh->bufmap, list) {
-			list_del(&kbuf->list);
+			ipu_psys_kbuf_untrack(kbuf);
 			db_attach = kbuf->db_attach;
 
 			/* Unmap and release buffers */
@@ -671,13 +1165,11 @@ static int ipu_psys_release(struct inode *inode, struct file *file)
 			}
 		}
 	}
+	ipu_mmu_unmap_gather_end(psys->adev->mmu);
 	mutex_unlock(&fh->mutex);
 
-	mutex_lock(&psys->mutex);
-	list_del(&fh->list);
-
-	mutex_unlock(&psys->mutex);
-	ipu_psys_fh_deinit(fh);
+	if (fh->ring_eventfd)
+		eventfd_ctx_put(fh->ring_eventfd);
 
 	mutex_lock(&psys->mutex);
 	if (list_empty(&psys->fhs))
@@ -741,7 +1233,7 @@ static int ipu_psys_getbuf(struct ipu_psys_buffer *buf, struct ipu_psys_fh *fh)
 	kbuf->flags = buf->flags;
 
 	mutex_lock(&fh->mutex);
-	list_add(&kbuf->list, &fh->bufmap);
+	ipu_psys_kbuf_track(fh, kbuf);
 	mutex_unlock(&fh->mutex);
 
 	dev_dbg(&psys->adev->dev, "IOC_GETBUF: userptr %p size %llu to fd %d",
@@ -782,7 +1274,8 @@ int ipu_psys_mapbuf_locked(int fd, struct ipu_psys_fh *fh,
 			goto mapbuf_fail;
 		}
 
-		list_add(&kbuf->list, &fh->bufmap);
+		kbuf->fd = fd;
+		ipu_psys_kbuf_track(fh, kbuf);
 	}
 
 	/* fd valid and found, need remap */
@@ -802,7 +1295,8 @@ int ipu_psys_mapbuf_locked(int fd, struct ipu_psys_fh *fh,
 				ret = -ENOMEM;
 				goto mapbuf_fail;
 			}
-			list_add(&kbuf->list, &fh->bufmap);
+			kbuf->fd = fd;
+			ipu_psys_kbuf_track(fh, kbuf);
 		}
 	}
 
@@ -859,6 +1353,9 @@ int ipu_psys_mapbuf_locked(int fd, struct ipu_psys_fh *fh,
 		goto kbuf_map_fail;
 	}
 #endif
+	hash_del(&kbuf->kaddr_node);
+	hash_add(fh->bufmap_kaddr, &kbuf->kaddr_node,
+		 (unsigned long)kbuf->kaddr);
 
 	dev_dbg(&psys->adev->dev, "%s kbuf %p fd %d with len %llu mapped\n",
 		__func__, kbuf, fd, kbuf->len);
@@ -871,7 +1368,7 @@ mapbuf_end:
 kbuf_map_fail:
 	ipu_psys_kbuf_unmap(kbuf);
 
-	list_del(&kbuf->list);
+	ipu_psys_kbuf_untrack(kbuf);
 	if (!kbuf->userptr)
 		kfree(kbuf);
 
@@ -910,7 +1407,7 @@ static int ipu_psys_unmapbuf_locked(int fd, struct ipu_psys_fh *fh,
 	/* From now on it is not safe to use this kbuffer */
 	ipu_psys_kbuf_unmap(kbuf);
 
-	list_del(&kbuf->list);
+	ipu_psys_kbuf_untrack(kbuf);
 
 	if (!kbuf->userptr)
 		kfree(kbuf);
@@ -941,6 +1438,117 @@ static long ipu_psys_unmapbuf(int fd, struct ipu_psys_fh *fh)
 	return ret;
 }
 
+#define IPU_PSYS_EVENT_RING_MAX	4096
+
+static long ipu_psys_event_ring_setup(struct ipu_psys_event_ring_setup *setup,
+				      struct ipu_psys_fh *fh)
+{
+	struct eventfd_ctx *eventfd = NULL;
+	struct ipu_psys_event_ring *ring;
+	unsigned long flags;
+	size_t size;
+
+	if (!setup->entries || !is_power_of_2(setup->entries) ||
+	    setup->entries > IPU_PSYS_EVENT_RING_MAX)
+		return -EINVAL;
+
+	size = PAGE_ALIGN(sizeof(*ring) +
+			  setup->entries * sizeof(struct ipu_psys_event));
+
+	if (setup->eventfd >= 0) {
+		eventfd = eventfd_ctx_fdget(setup->eventfd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	ring = vmalloc_user(size);
+	if (!ring) {
+		if (eventfd)
+			eventfd_ctx_put(eventfd);
+		return -ENOMEM;
+	}
+	ring->mask = setup->entries - 1;
+
+	mutex_lock(&fh->mutex);
+	if (fh->ring) {
+		mutex_unlock(&fh->mutex);
+		vfree(ring);
+		if (eventfd)
+			eventfd_ctx_put(eventfd);
+		return -EBUSY;
+	}
+
+	fh->ring_size = size;
+	fh->ring_mask = ring->mask;
+	fh->ring_eventfd = eventfd;
+	spin_lock_irqsave(&fh->ring_lock, flags);
+	fh->ring = ring;
+	spin_unlock_irqrestore(&fh->ring_lock, flags);
+	mutex_unlock(&fh->mutex);
+
+	setup->mmap_size = size;
+
+	dev_dbg(&fh->psys->adev->dev, "event ring of %u entries, %zu bytes\n",
+		setup->entries, size);
+
+	return 0;
+}
+
+/*
+ * Post a completion to the shared ring of the fh. Head is owned by user
+ * space and only read here; tail, mask and overflow are kept in the fh
+ * so that user space cannot make the kernel write outside the ring.
+ * Returns false if there is no ring or it is full.
+ */
+bool ipu_psys_event_ring_post(struct ipu_psys_fh *fh,
+			      const struct ipu_psys_event *ev)
+{
+	struct ipu_psys_event_ring *ring;
+	unsigned long flags;
+	bool posted = false;
+	u32 head, tail;
+
+	spin_lock_irqsave(&fh->ring_lock, flags);
+	ring = fh->ring;
+	if (!ring)
+		goto out;
+
+	head = smp_load_acquire(&ring->head);
+	tail = fh->ring_tail;
+	if (tail - head > fh->ring_mask) {
+		WRITE_ONCE(ring->overflow, ++fh->ring_overflow);
+		goto out;
+	}
+
+	memcpy(&ring->events[tail & fh->ring_mask], ev, sizeof(*ev));
+	fh->ring_tail = tail + 1;
+	smp_store_release(&ring->tail, fh->ring_tail);
+	posted = true;
+out:
+	spin_unlock_irqrestore(&fh->ring_lock, flags);
+
+	if (posted && fh->ring_eventfd)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(fh->ring_eventfd);
+#else
+		eventfd_signal(fh->ring_eventfd, 1);
+#endif
+
+	return posted;
+}
+
+static int ipu_psys_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ipu_psys_fh *fh = file->private_data;
+	struct ipu_psys_event_ring *ring = READ_ONCE(fh->ring);
+
+	if (!ring || vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > fh->ring_size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring, 0);
+}
+
 static unsigned int ipu_psys_poll(struct file *file,
 				  struct poll_table_struct *wait)
 {
@@ -952,7 +1560,7 @@ static unsigned int ipu_psys_poll(struct file *file,
 
 	poll_wait(file, &fh->wait, wait);
 
-	if (ipu_get_completed_kcmd(fh))
+	if (ipu_psys_has_completed_kcmd(fh))
 		res = POLLIN;
 
 	dev_dbg(&psys->adev->dev, "ipu psys poll res %u\n", res);
@@ -960,13 +1568,10 @@ static unsigned int ipu_psys_poll(struct file *file,
 	return res;
 }
 
-static long ipu_get_manifest(struct ipu_psys_manifest *manifest,
-			     struct ipu_psys_fh *fh)
+static struct ipu_cpd_client_pkg_hdr *
+ipu_psys_get_client_pkg(struct ipu_psys *psys, u32 index)
 {
-	struct ipu_psys *psys = fh->psys;
 	struct ipu_device *isp = psys->adev->isp;
-	struct ipu_cpd_client_pkg_hdr *client_pkg;
-	u32 entries;
 	void *host_fw_data;
 	dma_addr_t dma_fw_data;
 	u32 client_pkg_offset;
@@ -974,24 +1579,36 @@ static long ipu_get_manifest(struct ipu_psys_manifest *manifest,
 	host_fw_data = (void *)isp->cpd_fw->data;
 	dma_fw_data = sg_dma_address(psys->fw_sgt.sgl);
 
+	if (!ipu_cpd_pkg_dir_get_size(psys->pkg_dir, index) ||
+	    ipu_cpd_pkg_dir_get_type(psys->pkg_dir, index) <
+	    IPU_CPD_PKG_DIR_CLIENT_PG_TYPE)
+		return NULL;
+
+	client_pkg_offset = ipu_cpd_pkg_dir_get_address(psys->pkg_dir, index);
+	client_pkg_offset -= dma_fw_data;
+
+	return host_fw_data + client_pkg_offset;
+}
+
+static long ipu_get_manifest(struct ipu_psys_manifest *manifest,
+			     struct ipu_psys_fh *fh)
+{
+	struct ipu_psys *psys = fh->psys;
+	struct ipu_cpd_client_pkg_hdr *client_pkg;
+	u32 entries;
+
 	entries = ipu_cpd_pkg_dir_get_num_entries(psys->pkg_dir);
 	if (!manifest || manifest->index > entries - 1) {
 		dev_err(&psys->adev->dev, "invalid argument\n");
 		return -EINVAL;
 	}
 
-	if (!ipu_cpd_pkg_dir_get_size(psys->pkg_dir, manifest->index) ||
-	    ipu_cpd_pkg_dir_get_type(psys->pkg_dir, manifest->index) <
-	    IPU_CPD_PKG_DIR_CLIENT_PG_TYPE) {
+	client_pkg = ipu_psys_get_client_pkg(psys, manifest->index);
+	if (!client_pkg) {
 		dev_dbg(&psys->adev->dev, "invalid pkg dir entry\n");
 		return -ENOENT;
 	}
 
-	client_pkg_offset = ipu_cpd_pkg_dir_get_address(psys->pkg_dir,
-							manifest->index);
-	client_pkg_offset -= dma_fw_data;
-
-	client_pkg = host_fw_data + client_pkg_offset;
 	manifest->size = client_pkg->pg_manifest_size;
 
 	if (!manifest->manifest)
@@ -1006,15 +1623,41 @@ static long ipu_get_manifest(struct ipu_psys_manifest *manifest,
 	return 0;
 }
 
+static long ipu_psys_qcmd_batch(struct ipu_psys_command_batch *batch,
+				struct ipu_psys_fh *fh)
+{
+	struct ipu_psys_command *cmds;
+	long ret;
+
+	if (!batch->ncmds || batch->ncmds > IPU_MAX_PSYS_CMD_BATCH)
+		return -EINVAL;
+
+	cmds = memdup_user(batch->cmds, batch->ncmds * sizeof(*cmds));
+	if (IS_ERR(cmds))
+		return PTR_ERR(cmds);
+
+	batch->nqueued = 0;
+	ret = ipu_psys_kcmd_new_batch(cmds, batch->ncmds, &batch->nqueued, fh);
+	kfree(cmds);
+
+	dev_dbg(&fh->psys->adev->dev,
+		"IOC_QCMD_BATCH: %u cmds %u queued ret %ld\n",
+		batch->ncmds, batch->nqueued, ret);
+
+	return ret;
+}
+
 static long ipu_psys_ioctl(struct file *file, unsigned int cmd,
 			   unsigned long arg)
 {
 	union {
 		struct ipu_psys_buffer buf;
 		struct ipu_psys_command cmd;
+		struct ipu_psys_command_batch batch;
 		struct ipu_psys_event ev;
 		struct ipu_psys_capability caps;
 		struct ipu_psys_manifest m;
+		struct ipu_psys_event_ring_setup ring;
 	} karg;
 	struct ipu_psys_fh *fh = file->private_data;
 	long err = 0;
@@ -1051,12 +1694,18 @@ static long ipu_psys_ioctl(struct file *file, unsigned int cmd,
 	case IPU_IOC_QCMD:
 		err = ipu_psys_kcmd_new(&karg.cmd, fh);
 		break;
+	case IPU_IOC_QCMD_BATCH:
+		err = ipu_psys_qcmd_batch(&karg.batch, fh);
+		break;
 	case IPU_IOC_DQEVENT:
 		err = ipu_ioctl_dqevent(&karg.ev, fh, file->f_flags);
 		break;
 	case IPU_IOC_GET_MANIFEST:
 		err = ipu_get_manifest(&karg.m, fh);
 		break;
+	case IPU_IOC_EVENT_RING:
+		err = ipu_psys_event_ring_setup(&karg.ring, fh);
+		break;
 	default:
 		err = -ENOTTY;
 		break;
@@ -1080,6 +1729,7 @@ static const struct file_operations ipu_psys_fops = {
 	.compat_ioctl = ipu_psys_compat_ioctl32,
 #endif
 	.poll = ipu_psys_poll,
+	.mmap = ipu_psys_mmap,
 	.owner = THIS_MODULE,
 };
 
@@ -1330,6 +1980,52 @@ DEFINE_SIMPLE_ATTRIBUTE(psys_icache_prefetch_isp_fops,
 			ipu_psys_icache_prefetch_isp_get,
 			ipu_psys_icache_prefetch_isp_set, "%llu\n");
 
+#define IPU_PSYS_LAT_DUMP_SIZE	(64 * 1024)
+
+struct ipu_psys_lat_dump {
+	size_t len;
+	char buf[];
+};
+
+static int ipu_psys_lat_open(struct inode *inode, struct file *file)
+{
+	struct ipu_psys *psys = inode->i_private;
+	struct ipu_psys_lat_dump *dump;
+
+	dump = vzalloc(sizeof(*dump) + IPU_PSYS_LAT_DUMP_SIZE);
+	if (!dump)
+		return -ENOMEM;
+
+	mutex_lock(&psys->mutex);
+	dump->len = ipu_psys_lat_dump(psys, dump->buf, IPU_PSYS_LAT_DUMP_SIZE);
+	mutex_unlock(&psys->mutex);
+	file->private_data = dump;
+
+	return 0;
+}
+
+static ssize_t ipu_psys_lat_read(struct file *file, char __user *buf,
+				 size_t len, loff_t *ppos)
+{
+	struct ipu_psys_lat_dump *dump = file->private_data;
+
+	return simple_read_from_buffer(buf, len, ppos, dump->buf, dump->len);
+}
+
+static int ipu_psys_lat_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations psys_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = ipu_psys_lat_open,
+	.release = ipu_psys_lat_release,
+	.read = ipu_psys_lat_read,
+	.llseek = no_llseek,
+};
+
 static int ipu_psys_init_debugfs(struct ipu_psys *psys)
 {
 	struct dentry *file;
@@ -1351,6 +2047,43 @@ static int ipu_psys_init_debugfs(struct ipu_psys *psys)
 
 	psys->debugfsdir = dir;
 
+	dir = debugfs_create_dir("kcmd_pool", psys->debugfsdir);
+	if (!IS_ERR(dir)) {
+		debugfs_create_u64("hits", 0400, dir, &psys->kcmd_pool.hits);
+		debugfs_create_u64("misses", 0400, dir,
+				   &psys->kcmd_pool.misses);
+		debugfs_create_u64("array_allocs", 0400, dir,
+				   &psys->kcmd_pool.array_allocs);
+	}
+
+	dir = debugfs_create_dir("manifest_cache", psys->debugfsdir);
+	if (!IS_ERR(dir)) {
+		debugfs_create_u64("hits", 0400, dir,
+				   &psys->manifest_cache.hits);
+		debugfs_create_u64("misses", 0400, dir,
+				   &psys->manifest_cache.misses);
+	}
+
+	dir = debugfs_create_dir("pg_pool", psys->debugfsdir);
+	if (!IS_ERR(dir)) {
+		debugfs_create_u64("hits", 0400, dir, &psys->pg_pool.hits);
+		debugfs_create_u64("misses", 0400, dir, &psys->pg_pool.misses);
+		debugfs_create_u64("exhausted", 0400, dir,
+				   &psys->pg_pool.exhausted);
+	}
+
+	debugfs_create_file("kcmd_latency", 0400, psys->debugfsdir, psys,
+			    &psys_lat_fops);
+
+	dir = debugfs_create_dir("mmu", psys->debugfsdir);
+	if (!IS_ERR(dir)) {
+		debugfs_create_u64("tlb_inv_issued", 0400, dir,
+				   &psys->adev->mmu->tlb_inv_issued);
+		debugfs_create_u64("tlb_inv_coalesced", 0400, dir,
+				   &psys->adev->mmu->tlb_inv_coalesced);
+		ipu_dma_debugfs_init(psys->adev->mmu, dir);
+	}
+
 #ifdef IPU_PSYS_GPC
 	if (ipu_psys_gpc_init_debugfs(psys))
 		return -ENOMEM;
@@ -1494,7 +2227,7 @@ static int ipu_psys_probe(struct ipu_bus_device *adev)
 	struct ipu_psys_pg *kpg, *kpg0;
 	struct ipu_psys *psys;
 	unsigned int minor;
-	int i, rval = -E2BIG;
+	int rval = -E2BIG;
 
 	/* firmware is not ready, so defer the probe */
 	if (!isp->pkg_dir)
@@ -1540,10 +2273,14 @@ static int ipu_psys_probe(struct ipu_bus_device *adev)
 
 	spin_lock_init(&psys->ready_lock);
 	spin_lock_init(&psys->pgs_lock);
+	spin_lock_init(&psys->class_lock);
 	psys->ready = 0;
 	psys->timeout = IPU_PSYS_CMD_TIMEOUT_MS;
 
 	mutex_init(&psys->mutex);
+	mutex_init(&psys->manifest_cache.lock);
+	hash_init(psys->manifest_cache.entries);
+	hash_init(psys->manifest_cache.keys);
 	INIT_LIST_HEAD(&psys->fhs);
 	INIT_LIST_HEAD(&psys->pgs);
 	INIT_LIST_HEAD(&psys->started_kcmds_list);
@@ -1560,17 +2297,24 @@ static int ipu_psys_probe(struct ipu_bus_device *adev)
 
 	if (IS_ERR(psys->sched_cmd_thread)) {
 		psys->sched_cmd_thread = NULL;
+		mutex_destroy(&psys->manifest_cache.lock);
 		mutex_destroy(&psys->mutex);
 		goto out_unlock;
 	}
 
 	ipu_bus_set_drvdata(adev, psys);
 
+	rval = ipu_psys_kcmd_pool_init(psys);
+	if (rval) {
+		dev_err(&adev->dev, "unable to alloc kcmd pool\n");
+		goto out_mutex_destroy;
+	}
+
 	rval = ipu_psys_resource_pool_init(&psys->resource_pool_running);
 	if (rval < 0) {
 		dev_err(&psys->dev,
 			"unable to alloc process group resources\n");
-		goto out_mutex_destroy;
+		goto out_free_kcmd_pool;
 	}
 
 	ipu6_psys_hw_res_variant_init();
@@ -1579,22 +2323,9 @@ static int ipu_psys_probe(struct ipu_bus_device *adev)
 	psys->pkg_dir_size = isp->pkg_dir_size;
 	psys->fw_sgt = isp->fw_sgt;
 
-	/* allocate and map memory for process groups */
-	for (i = 0; i < IPU_PSYS_PG_POOL_SIZE; i++) {
-		kpg = kzalloc(sizeof(*kpg), GFP_KERNEL);
-		if (!kpg)
-			goto out_free_pgs;
-		kpg->pg = dma_alloc_attrs(&adev->dev,
-					  IPU_PSYS_PG_MAX_SIZE,
-					  &kpg->pg_dma_addr,
-					  GFP_KERNEL, 0);
-		if (!kpg->pg) {
-			kfree(kpg);
-			goto out_free_pgs;
-		}
-		kpg->size = IPU_PSYS_PG_MAX_SIZE;
-		list_add(&kpg->list, &psys->pgs);
-	}
+	rval = ipu_psys_pg_pool_init(psys);
+	if (rval)
+		goto out_free_pgs;
 
 	psys->caps.pg_count = ipu_cpd_pkg_dir_get_num_entries(psys->pkg_dir);
 
@@ -1653,7 +2384,10 @@ out_free_pgs:
 	}
 
 	ipu_psys_resource_pool_cleanup(&psys->resource_pool_running);
+out_free_kcmd_pool:
+	ipu_psys_kcmd_pool_cleanup(psys);
 out_mutex_destroy:
+	mutex_destroy(&psys->manifest_cache.lock);
 	mutex_destroy(&psys->mutex);
 	cdev_del(&psys->cdev);
 	if (psys->sched_cmd_thread) {
@@ -1703,6 +2437,7 @@ static void ipu_psys_remove(struct ipu_bus_device *adev)
 	ipu_trace_uninit(&adev->dev);
 
 	ipu_psys_resource_pool_cleanup(&psys->resource_pool_running);
+	ipu_psys_kcmd_pool_cleanup(psys);
 
 	device_unregister(&psys->dev);
 
@@ -1711,6 +2446,7 @@ static void ipu_psys_remove(struct ipu_bus_device *adev)
 
 	mutex_unlock(&ipu_psys_mutex);
 
+	mutex_destroy(&psys->manifest_cache.lock);
 	mutex_destroy(&psys->mutex);
 
 	dev_info(&adev->dev, "removed\n");
@@ -1805,6 +2541,10 @@ MODULE_DEVICE_TABLE(pci, ipu_pci_tbl);
 module_init(ipu_psys_init);
 module_exit(ipu_psys_exit);
 
+#if IS_ENABLED(CONFIG_VIDEO_INTEL_IPU6_PSYS_KUNIT_TEST)
+#include "ipu-psys-test.c"
+#endif
+
 MODULE_AUTHOR("Antti Laakso <antti.laakso@intel.com>");
 MODULE_AUTHOR("Bin Han <bin.b.han@intel.com>");
 MODULE_AUTHOR("Renwei Wu <renwei.wu@intel.com>");
@@ -5,6 +5,10 @@
 #define IPU_PSYS_H
 
 #include <linux/cdev.h>
+#include <linux/eventfd.h>
+#include <linux/hashtable.h>
+#include <linux/ktime.h>
+#include <linux/llist.h>
 #include <linux/workqueue.h>
 
 #include "ipu.h"
@@ -14,18 +18,33 @@
 
 #define IPU_PSYS_PG_POOL_SIZE 16
 #define IPU_PSYS_PG_MAX_SIZE 8192
+/* PG buffer size classes: 4K, 8K, ... 128K */
+#define IPU_PSYS_PG_MIN_SHIFT 12
+#define IPU_PSYS_PG_POOL_CLASSES 6
 #define IPU_MAX_PSYS_CMD_BUFFERS 32
+#define IPU_MAX_PSYS_CMD_BATCH 32
+/* Preallocated kcmds, enough for all commands in flight on 4 streams */
+#define IPU_PSYS_KCMD_POOL_SIZE 64
+/* Terminal count served from the kcmd slot without extra allocation */
+#define IPU_PSYS_KCMD_INLINE_BUFFERS 16
 #define IPU_PSYS_EVENT_CMD_COMPLETE IPU_FW_PSYS_EVENT_TYPE_SUCCESS
 #define IPU_PSYS_EVENT_FRAGMENT_COMPLETE IPU_FW_PSYS_EVENT_TYPE_SUCCESS
 #define IPU_PSYS_CLOSE_TIMEOUT_US   50
 #define IPU_PSYS_CLOSE_TIMEOUT (100000 / IPU_PSYS_CLOSE_TIMEOUT_US)
 #define IPU_MAX_RESOURCES 128
+/* Buckets for the per-fh kbuffer lookup tables, as a power of two */
+#define IPU_PSYS_BUFMAP_HASH_BITS 7
+#define IPU_PSYS_MANIFEST_HASH_BITS 4
+/* (user pointer, size) keys an fh may keep in the manifest cache */
+#define IPU_PSYS_FH_MANIFEST_KEYS 16
 
 /* Opaque structure. Do not access fields. */
 struct ipu_resource {
 	u32 id;
 	int elements;	/* Number of elements available to allocation */
 	unsigned long *bitmap;	/* Allocation bitmap, a bit for each element */
+	int free;	/* Number of clear bits, not kept for DFMs */
+	int hint;	/* All bits below are set, not kept for DFMs */
 };
 
 enum ipu_resource_type {
@@ -75,6 +94,47 @@ struct ipu_psys_resource_alloc {
 	int resources;
 };
 
+/*
+ * Free PG buffers bucketed by power-of-two size class. Buffers larger
+ * than the biggest class are kept on the oversize list. Protected by
+ * ipu_psys pgs_lock.
+ */
+struct ipu_psys_pg_pool {
+	struct list_head free[IPU_PSYS_PG_POOL_CLASSES];
+	struct list_head oversize;
+	unsigned long prewarmed;	/* classes given a spare on first miss */
+	u64 hits;
+	u64 misses;
+	u64 exhausted;
+};
+
+/*
+ * Pool of kcmd slots. Slots are preallocated at probe and recycled on
+ * free; the kmem_cache backs the pool when it runs dry.
+ */
+struct ipu_psys_kcmd_pool {
+	struct kmem_cache *cache;
+	struct list_head free;
+	unsigned int nfree;
+	spinlock_t lock;	/* Protects free list and counters */
+	u64 hits;
+	u64 misses;
+	u64 array_allocs;
+};
+
+/*
+ * Program group manifests shared between kcmds and ppgs. Entries are
+ * keyed by PG ID and content hash and live while referenced.
+ */
+struct ipu_psys_manifest_cache {
+	struct mutex lock;	/* Protects hash table and counters */
+	DECLARE_HASHTABLE(entries, IPU_PSYS_MANIFEST_HASH_BITS);
+	/* Where each fh last passed each manifest from */
+	DECLARE_HASHTABLE(keys, IPU_PSYS_MANIFEST_HASH_BITS);
+	u64 hits;
+	u64 misses;
+};
+
 struct task_struct;
 struct ipu_psys {
 	struct ipu_psys_capability caps;
@@ -89,6 +149,7 @@ struct ipu_psys {
 	spinlock_t pgs_lock;	/* Protect pgs list access */
 	struct list_head fhs;
 	struct list_head pgs;
+	struct ipu_psys_pg_pool pg_pool;
 	struct list_head started_kcmds_list;
 	struct ipu_psys_pdata *pdata;
 	struct ipu_bus_device *adev;
@@ -105,6 +166,12 @@ struct ipu_psys {
 	/* Resources needed to be managed for process groups */
 	struct ipu_psys_resource_pool resource_pool_running;
 
+	struct ipu_psys_kcmd_pool kcmd_pool;
+	struct ipu_psys_manifest_cache manifest_cache;
+
+	spinlock_t class_lock;	/* Protects class_stat */
+	struct ipu_psys_class_stat class_stat[IPU_PSYS_SCHED_NUM];
+
 	const struct firmware *fw;
 	struct sg_table fw_sgt;
 	u64 *pkg_dir;
@@ -123,8 +190,36 @@ struct ipu_psys_fh {
 	struct mutex mutex;	/* Protects bufmap & kcmds fields */
 	struct list_head list;
 	struct list_head bufmap;
+	/* bufmap entries indexed by dmabuf fd and by kernel vaddr */
+	DECLARE_HASHTABLE(bufmap_fd, IPU_PSYS_BUFMAP_HASH_BITS);
+	DECLARE_HASHTABLE(bufmap_kaddr, IPU_PSYS_BUFMAP_HASH_BITS);
 	wait_queue_head_t wait;
+	/*
+	 * Completed kcmds. The event handler pushes to done_queue without
+	 * taking any fh lock; readers move them in completion order to
+	 * done_list under done_lock.
+	 */
+	struct llist_head done_queue;
+	struct list_head done_list;
+	spinlock_t done_lock;	/* Protects done_list */
+	/*
+	 * Optional completion ring shared with user space. Completions
+	 * posted there are freed from reap_work instead of by DQEVENT.
+	 */
+	spinlock_t ring_lock;	/* Protects ring posting */
+	struct ipu_psys_event_ring *ring;
+	size_t ring_size;
+	u32 ring_mask;
+	u32 ring_tail;
+	u32 ring_overflow;
+	struct eventfd_ctx *ring_eventfd;
+	struct llist_head reap_queue;
+	struct work_struct reap_work;
 	struct ipu_psys_scheduler sched;
+	/* kcmd latencies of all ppgs of the fh, protected by mutex */
+	struct ipu_psys_lat_stat lat[IPU_PSYS_KCMD_TS_NUM];
+	/* Keys in the manifest cache, protected by its lock */
+	unsigned int manifest_keys;
 };
 
 struct ipu_psys_pg {
@@ -133,12 +228,14 @@ struct ipu_psys_pg {
 	size_t pg_size;
 	dma_addr_t pg_dma_addr;
 	struct list_head list;
+	struct list_head pool_list;
 	struct ipu_psys_resource_alloc resource_alloc;
 };
 
 struct ipu_psys_kcmd {
 	struct ipu_psys_fh *fh;
 	struct list_head list;
+	struct llist_node done;	/* ipu_psys_fh.done_queue */
 	struct ipu_psys_buffer_set *kbuf_set;
 	enum ipu_psys_cmd_state state;
 	void *pg_manifest;
@@ -151,6 +248,8 @@ struct ipu_psys_kcmd {
 	u64 user_token;
 	u64 issue_id;
 	u32 priority;
+	enum ipu_psys_sched_class sched_class;
+	u64 deadline;	/* absolute ktime ns, 0 for none */
 	u32 kernel_enable_bitmap[4];
 	u32 terminal_enable_bitmap[4];
 	u32 routing_enable_bitmap[4];
@@ -158,8 +257,15 @@ struct ipu_psys_kcmd {
 	struct ipu_buttress_constraint constraint;
 	struct ipu_psys_event ev;
 	struct timer_list watchdog;
+	u64 ts[IPU_PSYS_KCMD_TS_NUM];
 };
 
+static inline void ipu_psys_kcmd_stamp(struct ipu_psys_kcmd *kcmd,
+				       enum ipu_psys_kcmd_ts ts)
+{
+	kcmd->ts[ts] = ktime_get_ns();
+}
+
 struct ipu_dma_buf_attach {
 	struct device *dev;
 	u64 len;
@@ -177,6 +283,8 @@ struct ipu_psys_kbuffer {
 	int fd;
 	void *kaddr;
 	struct list_head list;
+	struct hlist_node fd_node;
+	struct hlist_node kaddr_node;
 	dma_addr_t dma_addr;
 	struct sg_table *sgt;
 	struct dma_buf_attachment *db_attach;
@@ -196,8 +304,22 @@ void ipu_psys_setup_hw(struct ipu_psys *psys);
 void ipu_psys_subdomains_power(struct ipu_psys *psys, bool on);
 void ipu_psys_handle_events(struct ipu_psys *psys);
 int ipu_psys_kcmd_new(struct ipu_psys_command *cmd, struct ipu_psys_fh *fh);
+int ipu_psys_kcmd_new_batch(struct ipu_psys_command *cmds, u32 ncmds,
+			    u32 *nqueued, struct ipu_psys_fh *fh);
 void ipu_psys_run_next(struct ipu_psys *psys);
 struct ipu_psys_pg *__get_pg_buf(struct ipu_psys *psys, size_t pg_size);
+void __put_pg_buf(struct ipu_psys *psys, struct ipu_psys_pg *kpg);
+struct ipu_psys_kcmd *ipu_psys_kcmd_pool_get(struct ipu_psys *psys);
+int ipu_psys_kcmd_pool_get_buffers(struct ipu_psys *psys,
+				   struct ipu_psys_kcmd *kcmd);
+void ipu_psys_kcmd_pool_put(struct ipu_psys *psys, struct ipu_psys_kcmd *kcmd);
+void *ipu_psys_manifest_cache_get(struct ipu_psys_fh *fh,
+				  const void __user *umanifest, size_t size);
+void *ipu_psys_manifest_cache_ref(void *manifest);
+void ipu_psys_manifest_cache_put(struct ipu_psys *psys, void *manifest);
+void ipu_psys_manifest_cache_forget(struct ipu_psys_fh *fh);
+void ipu_psys_lat_add(struct ipu_psys_lat_stat *stat, u64 ns);
+size_t ipu_psys_lat_dump(struct ipu_psys *psys, char *buf, size_t size);
 struct ipu_psys_kbuffer *
 ipu_psys_lookup_kbuffer(struct ipu_psys_fh *fh, int fd);
 int ipu_psys_mapbuf_locked(int fd, struct ipu_psys_fh *fh,
@@ -210,6 +332,9 @@ int ipu_psys_gpc_init_debugfs(struct ipu_psys *psys);
 int ipu_psys_resource_pool_init(struct ipu_psys_resource_pool *pool);
 void ipu_psys_resource_pool_cleanup(struct ipu_psys_resource_pool *pool);
 struct ipu_psys_kcmd *ipu_get_completed_kcmd(struct ipu_psys_fh *fh);
+bool ipu_psys_has_completed_kcmd(struct ipu_psys_fh *fh);
+bool ipu_psys_event_ring_post(struct ipu_psys_fh *fh,
+			      const struct ipu_psys_event *ev);
 long ipu_ioctl_dqevent(struct ipu_psys_event *event,
 		       struct ipu_psys_fh *fh, unsigned int f_flags);
 
@@ -24,6 +24,7 @@
 #include "ipu-pdata.h"
 #include "ipu-bus.h"
 #include "ipu-mmu.h"
+#include "ipu-dma.h"
 #include "ipu-platform-regs.h"
 #include "ipu-platform-isys-csi2-reg.h"
 #include "ipu-trace.h"
@@ -825,6 +826,10 @@ static int ipu_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		 IPU_MAJOR_VERSION,
 		 IPU_MINOR_VERSION);
 
+	/* A short reserve only means more buddy allocations later */
+	if (ipu_dma_pool_init(&pdev->dev))
+		dev_warn(&pdev->dev, "dma pool reserve incomplete\n");
+
 	pm_runtime_put_noidle(&pdev->dev);
 	pm_runtime_allow(&pdev->dev);
 
@@ -895,6 +900,8 @@ static void ipu_pci_remove(struct pci_dev *pdev)
 
 	ipu_mmu_cleanup(psys_mmu);
 	ipu_mmu_cleanup(isys_mmu);
+
+	ipu_dma_pool_exit();
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
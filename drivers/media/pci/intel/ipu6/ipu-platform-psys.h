@@ -20,6 +20,57 @@ enum ipu_psys_cmd_state {
 	KCMD_STATE_PPG_COMPLETE
 };
 
+/* Points in the life of a kcmd which are timestamped */
+enum ipu_psys_kcmd_ts {
+	IPU_PSYS_KCMD_TS_NEW,		/* copied from user */
+	IPU_PSYS_KCMD_TS_SEND,		/* handed over to its ppg */
+	IPU_PSYS_KCMD_TS_START,		/* submitted to firmware */
+	IPU_PSYS_KCMD_TS_COMPLETE,	/* completion event received */
+	IPU_PSYS_KCMD_TS_DEQUEUE,	/* event dequeued by user */
+	IPU_PSYS_KCMD_TS_NUM
+};
+
+#define IPU_PSYS_LAT_BUCKETS 32
+
+/*
+ * Latency statistics with log2(ns) buckets, used to estimate the p99.
+ * Arrays of IPU_PSYS_KCMD_TS_NUM stats are indexed by the latter point
+ * of each step; the IPU_PSYS_KCMD_TS_NEW slot holds new -> dequeue.
+ */
+struct ipu_psys_lat_stat {
+	u64 count;
+	u64 sum;
+	u64 min;
+	u64 max;
+	u32 bucket[IPU_PSYS_LAT_BUCKETS];
+};
+
+/* Scheduling classes, in the order the l-scheduler serves them */
+enum ipu_psys_sched_class {
+	IPU_PSYS_SCHED_REALTIME,
+	IPU_PSYS_SCHED_INTERACTIVE,
+	IPU_PSYS_SCHED_BATCH,
+	IPU_PSYS_SCHED_NUM
+};
+
+/* Per class statistics, protected by ipu_psys.class_lock */
+struct ipu_psys_class_stat {
+	struct ipu_psys_lat_stat delay;	/* new -> start */
+	u64 deadlines;
+	u64 missed;
+};
+
+/*
+ * Resources a PG may claim, known before it is started. Cells chosen by
+ * type count as all cells of that type, so two footprints which do not
+ * overlap can always run together as far as cells and fixed DFM ports
+ * are concerned.
+ */
+struct ipu_psys_resource_footprint {
+	u32 cells;	/* Bitmask of cells the PG may run on */
+	u32 dfms[16];	/* Fixed DFM ports per DFM id */
+};
+
 struct ipu_psys_scheduler {
 	struct list_head ppgs;
 	struct mutex bs_mutex;  /* Protects buf_set field */
@@ -52,10 +103,21 @@ struct ipu_psys_ppg {
 	struct mutex mutex;     /* Protects kcmd and ppg state field */
 	struct list_head kcmds_new_list;
 	struct list_head kcmds_processing_list;
-	struct list_head kcmds_finished_list;
 	enum ipu_psys_ppg_state state;
-	u32 pri_base;
+	u32 pri_base;	/* enum ipu_psys_sched_class */
 	int pri_dynamic;
+	/* Earliest deadline of the queued kcmds, l-scheduler only */
+	u64 deadline;
+	/* Last ppg start pass of the l-scheduler that looked at it */
+	u32 sched_pass;
+	/* Cells and DFM ports the ppg may use, set at creation */
+	struct ipu_psys_resource_footprint footprint;
+	u64 run_ts;	/* Last transition to RUNNING */
+	/* Protected by mutex */
+	struct ipu_psys_lat_stat lat[IPU_PSYS_KCMD_TS_NUM];
+	/* Time spent waiting for resources, l-scheduler only */
+	struct ipu_psys_lat_stat res_lat;
+	u64 res_wait_ts;
 };
 
 struct ipu_psys_buffer_set {
@@ -81,6 +81,14 @@ int ipu_psys_try_allocate_resources(struct device *dev,
 				    void *pg_manifest,
 				    struct ipu_psys_resource_pool *pool);
 
+struct ipu_psys_resource_footprint;
+int ipu_psys_resource_footprint(const struct device *dev,
+				struct ipu_fw_psys_process_group *pg,
+				void *pg_manifest,
+				struct ipu_psys_resource_footprint *fp);
+bool ipu_psys_resource_footprint_overlap(const struct ipu_psys_resource_footprint *a,
+					 const struct ipu_psys_resource_footprint *b);
+
 void ipu_psys_reset_process_cell(const struct device *dev,
 				 struct ipu_fw_psys_process_group *pg,
 				 void *pg_manifest,
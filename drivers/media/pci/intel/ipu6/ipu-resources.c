@@ -58,9 +58,20 @@ static int ipu_resource_init(struct ipu_resource *res, u32 id, int elements)
 		return -ENOMEM;
 	res->elements = elements;
 	res->id = id;
+	res->free = elements;
+	res->hint = 0;
 	return 0;
 }
 
+/* Mark n elements at pos allocated, keeping the free extent index */
+static void ipu_resource_set(struct ipu_resource *res, int pos, int n)
+{
+	bitmap_set(res->bitmap, pos, n);
+	res->free -= n;
+	if (pos == res->hint)
+		res->hint = pos + n;
+}
+
 static unsigned long
 ipu_resource_alloc_with_pos(struct ipu_resource *res, int n,
 			    int pos,
@@ -74,7 +85,7 @@ ipu_resource_alloc_with_pos(struct ipu_resource *res, int n,
 		return 0;
 	}
 
-	if (!res->bitmap || pos >= res->elements)
+	if (!res->bitmap || pos >= res->elements || n > res->free)
 		return (unsigned long)(-ENOSPC);
 
 	p = bitmap_find_next_zero_area(res->bitmap, res->elements, pos, n, 0);
@@ -82,7 +93,7 @@ ipu_resource_alloc_with_pos(struct ipu_resource *res, int n,
 
 	if (p != pos)
 		return (unsigned long)(-ENOSPC);
-	bitmap_set(res->bitmap, p, n);
+	ipu_resource_set(res, p, n);
 	alloc->resource = res;
 	alloc->elements = n;
 	alloc->pos = p;
@@ -103,15 +114,18 @@ ipu_resource_alloc(struct ipu_resource *res, int n,
 		return 0;
 	}
 
-	if (!res->bitmap)
+	/* Too few elements left at all, no need to scan */
+	if (!res->bitmap || n > res->free)
 		return (unsigned long)(-ENOSPC);
 
-	p = bitmap_find_next_zero_area(res->bitmap, res->elements, 0, n, 0);
+	/* Nothing is free below the hint, start the search from there */
+	p = bitmap_find_next_zero_area(res->bitmap, res->elements,
+				       res->hint, n, 0);
 	alloc->resource = NULL;
 
 	if (p >= res->elements)
 		return (unsigned long)(-ENOSPC);
-	bitmap_set(res->bitmap, p, n);
+	ipu_resource_set(res, p, n);
 	alloc->resource = res;
 	alloc->elements = n;
 	alloc->pos = p;
@@ -122,14 +136,19 @@ ipu_resource_alloc(struct ipu_resource *res, int n,
 
 static void ipu_resource_free(struct ipu_resource_alloc *alloc)
 {
+	struct ipu_resource *res = alloc->resource;
+
 	if (alloc->elements <= 0)
 		return;
 
-	if (alloc->type == IPU_RESOURCE_DFM)
-		*alloc->resource->bitmap &= ~(unsigned long)(alloc->elements);
-	else
-		bitmap_clear(alloc->resource->bitmap, alloc->pos,
-			     alloc->elements);
+	if (alloc->type == IPU_RESOURCE_DFM) {
+		*res->bitmap &= ~(unsigned long)(alloc->elements);
+	} else {
+		bitmap_clear(res->bitmap, alloc->pos, alloc->elements);
+		res->free += alloc->elements;
+		if (alloc->pos < res->hint)
+			res->hint = alloc->pos;
+	}
 	alloc->resource = NULL;
 }
 
@@ -195,6 +214,18 @@ error:
 	return ret;
 }
 
+/* Memory banks span more than one word of bitmap */
+static void ipu_resource_copy(struct ipu_resource *src,
+			      struct ipu_resource *dest)
+{
+	if (!src->bitmap)
+		return;
+
+	bitmap_copy(dest->bitmap, src->bitmap, src->elements);
+	dest->free = src->free;
+	dest->hint = src->hint;
+}
+
 void ipu_psys_resource_copy(struct ipu_psys_resource_pool *src,
 			    struct ipu_psys_resource_pool *dest)
 {
@@ -205,10 +236,11 @@ void ipu_psys_resource_copy(struct ipu_psys_resource_pool *src,
 
 	dest->cells = src->cells;
 	for (i = 0; i < res_defs->num_dev_channels; i++)
-		*dest->dev_channels[i].bitmap = *src->dev_channels[i].bitmap;
+		ipu_resource_copy(&src->dev_channels[i],
+				  &dest->dev_channels[i]);
 
 	for (i = 0; i < res_defs->num_ext_mem_ids; i++)
-		*dest->ext_memory[i].bitmap = *src->ext_memory[i].bitmap;
+		ipu_resource_copy(&src->ext_memory[i], &dest->ext_memory[i]);
 
 	for (i = 0; i < res_defs->num_dfm_ids; i++)
 		*dest->dfms[i].bitmap = *src->dfms[i].bitmap;
@@ -408,6 +440,12 @@ void ipu_psys_free_cmd_queue_resource(struct ipu_psys_resource_pool *pool,
 	spin_unlock(&pool->queues_lock);
 }
 
+/*
+ * Check whether pg fits into pool without changing it. Resources are
+ * allocated from the pool itself and released again before returning,
+ * so the pool does not need to be copied first. Callers serialize pool
+ * updates with psys->mutex.
+ */
 int ipu_psys_try_allocate_resources(struct device *dev,
 				    struct ipu_fw_psys_process_group *pg,
 				    void *pg_manifest,
@@ -536,17 +574,89 @@ int ipu_psys_try_allocate_resources(struct device *dev,
 		}
 	}
 
-	pool->cells |= cells;
-
+	ipu_psys_free_resources(alloc, pool);
 	kfree(alloc);
 	return 0;
 
 free_out:
 	dev_dbg(dev, "failed to try_allocate resource\n");
+	ipu_psys_free_resources(alloc, pool);
 	kfree(alloc);
 	return ret;
 }
 
+/*
+ * Collect the cells and fixed DFM ports pg may use without allocating
+ * anything, so the l-scheduler can tell which PGs are able to run
+ * together before trying to start them.
+ */
+int ipu_psys_resource_footprint(const struct device *dev,
+				struct ipu_fw_psys_process_group *pg,
+				void *pg_manifest,
+				struct ipu_psys_resource_footprint *fp)
+{
+	const struct ipu_fw_resource_definitions *res_defs;
+	u16 *process_offset_table;
+	u32 id, cell;
+	int ret, i;
+
+	if (!pg)
+		return -EINVAL;
+
+	memset(fp, 0, sizeof(*fp));
+	res_defs = get_res();
+	process_offset_table = (u16 *)((u8 *)pg + pg->processes_offset);
+
+	for (i = 0; i < pg->process_count; i++) {
+		struct ipu_fw_psys_process *process =
+			(struct ipu_fw_psys_process *)
+			((char *)pg + process_offset_table[i]);
+		struct ipu_fw_generic_program_manifest pm;
+
+		memset(&pm, 0, sizeof(pm));
+		ret = ipu_fw_psys_get_program_manifest_by_process
+			(&pm, pg_manifest, process);
+		if (ret < 0) {
+			dev_err(dev, "can not get manifest\n");
+			return ret;
+		}
+
+		if (pm.cell_type_id == res_defs->num_cells_type) {
+			if (pm.cell_id != res_defs->num_cells)
+				fp->cells |= 1 << pm.cell_id;
+		} else {
+			for (cell = 0; cell < res_defs->num_cells; cell++)
+				if (res_defs->cells[cell] == pm.cell_type_id)
+					fp->cells |= 1 << cell;
+		}
+
+		if (!pm.dfm_port_bitmap)
+			continue;
+
+		for (id = 0; id < res_defs->num_dfm_ids &&
+		     id < ARRAY_SIZE(fp->dfms); id++)
+			if (!pm.is_dfm_relocatable[id])
+				fp->dfms[id] |= pm.dfm_port_bitmap[id];
+	}
+
+	return 0;
+}
+
+bool ipu_psys_resource_footprint_overlap(const struct ipu_psys_resource_footprint *a,
+					 const struct ipu_psys_resource_footprint *b)
+{
+	unsigned int i;
+
+	if (a->cells & b->cells)
+		return true;
+
+	for (i = 0; i < ARRAY_SIZE(a->dfms); i++)
+		if (a->dfms[i] & b->dfms[i])
+			return true;
+
+	return false;
+}
+
 /*
  * Allocate resources for pg from `pool'. Mark the allocated
  * resources into `alloc'. Returns 0 on success, -ENOSPC
@@ -774,17 +884,17 @@ int ipu_psys_move_resources(const struct device *dev,
 
 		switch (alloc->resource_alloc[i].type) {
 		case IPU_RESOURCE_DEV_CHN:
-			bitmap_set(target_pool->dev_channels[id].bitmap,
-				   alloc->resource_alloc[i].pos,
-				   alloc->resource_alloc[i].elements);
+			ipu_resource_set(&target_pool->dev_channels[id],
+					 alloc->resource_alloc[i].pos,
+					 alloc->resource_alloc[i].elements);
 			ipu_resource_free(&alloc->resource_alloc[i]);
 			alloc->resource_alloc[i].resource =
 			    &target_pool->dev_channels[id];
 			break;
 		case IPU_RESOURCE_EXT_MEM:
-			bitmap_set(target_pool->ext_memory[id].bitmap,
-				   alloc->resource_alloc[i].pos,
-				   alloc->resource_alloc[i].elements);
+			ipu_resource_set(&target_pool->ext_memory[id],
+					 alloc->resource_alloc[i].pos,
+					 alloc->resource_alloc[i].elements);
 			ipu_resource_free(&alloc->resource_alloc[i]);
 			alloc->resource_alloc[i].resource =
 			    &target_pool->ext_memory[id];
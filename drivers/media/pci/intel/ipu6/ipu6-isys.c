@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 // Copyright (C) 2020 - 2024 Intel Corporation
 
+#include <linux/delay.h>
 #include <linux/module.h>
 #include <media/v4l2-event.h>
 
@@ -122,12 +123,41 @@ void isys_setup_hw(struct ipu_isys *isys)
 		writel(thd[i], base + IPU_REG_ISYS_CDC_THRESHOLD(i));
 }
 
+static void isys_csi2_status_regs(u32 *status, u32 *clear)
+{
+	if (ipu_ver == IPU_VER_6EP_MTL) {
+		*status = IPU6V6_REG_ISYS_CSI_TOP_CTRL0_IRQ_STATUS;
+		*clear = IPU6V6_REG_ISYS_CSI_TOP_CTRL0_IRQ_CLEAR;
+	} else {
+		*status = IPU_REG_ISYS_CSI_TOP_CTRL0_IRQ_STATUS;
+		*clear = IPU_REG_ISYS_CSI_TOP_CTRL0_IRQ_CLEAR;
+	}
+}
+
+static void isys_csi2_isr(struct ipu_isys *isys, u32 status_csi)
+{
+	unsigned int i;
+
+	if (!(isys->isr_csi2_bits & status_csi))
+		return;
+
+	for (i = 0; i < isys->pdata->ipdata->csi2.nports; i++) {
+		/* irq from not enabled port */
+		if (!isys->csi2[i].base)
+			continue;
+		if (status_csi & IPU_ISYS_UNISPART_IRQ_CSI2(i))
+			ipu_isys_csi2_isr(&isys->csi2[i]);
+	}
+}
+
 irqreturn_t isys_isr(struct ipu_bus_device *adev)
 {
 	struct ipu_isys *isys = ipu_bus_get_drvdata(adev);
 	void __iomem *base = isys->pdata->base;
 	u32 status_sw, status_csi;
 	u32 ctrl0_status, ctrl0_clear;
+	irqreturn_t ret = IRQ_HANDLED;
+	unsigned int handled = 0;
 
 	spin_lock(&isys->power_lock);
 	if (!isys->power) {
@@ -135,13 +165,8 @@ irqreturn_t isys_isr(struct ipu_bus_device *adev)
 		return IRQ_NONE;
 	}
 
-	if (ipu_ver == IPU_VER_6EP_MTL) {
-		ctrl0_status = IPU6V6_REG_ISYS_CSI_TOP_CTRL0_IRQ_STATUS;
-		ctrl0_clear = IPU6V6_REG_ISYS_CSI_TOP_CTRL0_IRQ_CLEAR;
-	} else {
-		ctrl0_status = IPU_REG_ISYS_CSI_TOP_CTRL0_IRQ_STATUS;
-		ctrl0_clear = IPU_REG_ISYS_CSI_TOP_CTRL0_IRQ_CLEAR;
-	}
+	isys->coalesce.irqs++;
+	isys_csi2_status_regs(&ctrl0_status, &ctrl0_clear);
 
 	status_csi = readl(isys->pdata->base + ctrl0_status);
 	status_sw = readl(isys->pdata->base + IPU_REG_ISYS_UNISPART_IRQ_STATUS);
@@ -155,24 +180,27 @@ irqreturn_t isys_isr(struct ipu_bus_device *adev)
 		writel(status_sw, isys->pdata->base +
 			   IPU_REG_ISYS_UNISPART_IRQ_CLEAR);
 
-		if (isys->isr_csi2_bits & status_csi) {
-			unsigned int i;
-
-			for (i = 0; i < isys->pdata->ipdata->csi2.nports; i++) {
-				/* irq from not enabled port */
-				if (!isys->csi2[i].base)
-					continue;
-				if (status_csi & IPU_ISYS_UNISPART_IRQ_CSI2(i))
-					ipu_isys_csi2_isr(&isys->csi2[i]);
-			}
-		}
+		isys_csi2_isr(isys, status_csi);
 
 		writel(0, base + IPU_REG_ISYS_UNISPART_SW_IRQ_REG);
 
-		if (!isys_isr_one(adev))
+		if (!isys_isr_one(adev)) {
 			status_sw = IPU_ISYS_UNISPART_IRQ_SW;
-		else
+			isys->coalesce.responses++;
+			/*
+			 * Under load leave the rest to the threaded handler.
+			 * The unispart IRQs are unmasked again below; it is
+			 * the buttress that holds the ISYS interrupt off
+			 * until the threaded handler is done.
+			 */
+			if (isys->coalesce.budget &&
+			    ++handled >= isys->coalesce.budget) {
+				ret = IRQ_WAKE_THREAD;
+				break;
+			}
+		} else {
 			status_sw = 0;
+		}
 
 		status_csi = readl(isys->pdata->base + ctrl0_status);
 		status_sw |= readl(isys->pdata->base +
@@ -185,6 +213,66 @@ irqreturn_t isys_isr(struct ipu_bus_device *adev)
 
 	spin_unlock(&isys->power_lock);
 
+	return ret;
+}
+
+/*
+ * Upper bound of one polling run. The PSYS threaded handler runs after
+ * this one from the same buttress thread, keep it far below a frame.
+ */
+#define IPU_ISYS_POLL_MAX_NS	(250 * NSEC_PER_USEC)
+
+irqreturn_t isys_isr_threaded(struct ipu_bus_device *adev)
+{
+	struct ipu_isys *isys = ipu_bus_get_drvdata(adev);
+	void __iomem *base = isys->pdata->base;
+	u32 ctrl0_status, ctrl0_clear, status_csi;
+	u64 start, now, idle_since;
+	unsigned int budget, n;
+	unsigned long flags;
+	bool first = true;
+
+	isys_csi2_status_regs(&ctrl0_status, &ctrl0_clear);
+	start = ktime_get_ns();
+	idle_since = start;
+
+	do {
+		spin_lock_irqsave(&isys->power_lock, flags);
+		if (!isys->power) {
+			spin_unlock_irqrestore(&isys->power_lock, flags);
+			break;
+		}
+		if (first)
+			isys->coalesce.polls++;
+		first = false;
+
+		status_csi = readl(base + ctrl0_status);
+		writel(status_csi, base + ctrl0_clear);
+		isys_csi2_isr(isys, status_csi);
+
+		/* A response arriving after this raises the IRQ again */
+		writel(IPU_ISYS_UNISPART_IRQ_SW,
+		       base + IPU_REG_ISYS_UNISPART_IRQ_CLEAR);
+		writel(0, base + IPU_REG_ISYS_UNISPART_SW_IRQ_REG);
+
+		budget = max(isys->coalesce.budget, 1U);
+		for (n = 0; n < budget && !isys_isr_one(adev); n++)
+			isys->coalesce.responses++;
+		spin_unlock_irqrestore(&isys->power_lock, flags);
+
+		now = ktime_get_ns();
+		if (n) {
+			idle_since = now;
+			cond_resched();
+		} else if (now - idle_since <
+			   isys->coalesce.timeout_us * NSEC_PER_USEC) {
+			usleep_range(10, 20);
+		} else {
+			break;
+		}
+	} while (now - start < IPU_ISYS_POLL_MAX_NS &&
+		 !isys->adev->isp->flr_done);
+
 	return IRQ_HANDLED;
 }
 
@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2024 Intel Corporation
+
+/*
+ * KUnit tests for the l-scheduler, included from ipu6-l-scheduler.c so
+ * that the sched lists can be reached. No firmware is involved: fhs and
+ * kppgs are built in memory and kept in states which the scheduler
+ * handles without talking to PSYS. The sched lists are shared with the
+ * device, run these with no PSYS user active.
+ */
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+#define SCHED_TEST_MAX_PPGS		64
+#define SCHED_TEST_BENCH_ITERS		10000
+
+struct sched_test {
+	struct ipu_psys psys;
+	struct ipu_bus_device adev;
+	struct ipu_psys_fh fhs[SCHED_TEST_MAX_PPGS];
+	struct ipu_psys_ppg kppgs[SCHED_TEST_MAX_PPGS];
+	struct ipu_psys_pg kpgs[SCHED_TEST_MAX_PPGS];
+	struct ipu_fw_psys_process_group pgs[SCHED_TEST_MAX_PPGS];
+	unsigned int nr_ppgs;
+	bool enable_power_gating;
+};
+
+static int sched_test_init(struct kunit *test)
+{
+	struct sched_test *t;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+
+	t->adev.dev.init_name = "ipu6-sched-test";
+	t->psys.adev = &t->adev;
+	t->psys.power_gating = PSYS_POWER_NORMAL;
+	mutex_init(&t->psys.mutex);
+	INIT_LIST_HEAD(&t->psys.fhs);
+	init_waitqueue_head(&t->psys.sched_cmd_wq);
+
+	/* Gating would suspend the idle ppgs through the firmware */
+	t->enable_power_gating = enable_power_gating;
+	enable_power_gating = false;
+
+	test->priv = t;
+
+	KUNIT_ASSERT_TRUE(test, list_empty(&start_list.list) &&
+			  list_empty(&stop_list.list));
+
+	return 0;
+}
+
+static void sched_test_exit(struct kunit *test)
+{
+	struct sched_test *t = test->priv;
+	unsigned int i;
+
+	if (!t)
+		return;
+
+	for (i = 0; i < t->nr_ppgs; i++) {
+		ipu_psys_scheduler_remove_kppg(&t->kppgs[i], SCHED_START_LIST);
+		ipu_psys_scheduler_remove_kppg(&t->kppgs[i], SCHED_STOP_LIST);
+		mutex_destroy(&t->kppgs[i].mutex);
+		mutex_destroy(&t->fhs[i].mutex);
+	}
+	mutex_destroy(&t->psys.mutex);
+
+	enable_power_gating = t->enable_power_gating;
+}
+
+/* One fh per ppg, like one camera pipeline per open PSYS file */
+static struct ipu_psys_ppg *sched_test_add_ppg(struct sched_test *t,
+					       enum ipu_psys_ppg_state state,
+					       u32 pri_base)
+{
+	unsigned int i = t->nr_ppgs++;
+	struct ipu_psys_ppg *kppg = &t->kppgs[i];
+	struct ipu_psys_fh *fh = &t->fhs[i];
+
+	fh->psys = &t->psys;
+	mutex_init(&fh->mutex);
+	INIT_LIST_HEAD(&fh->sched.ppgs);
+	list_add_tail(&fh->list, &t->psys.fhs);
+
+	t->pgs[i].ID = i;
+	t->kpgs[i].pg = &t->pgs[i];
+
+	kppg->fh = fh;
+	kppg->kpg = &t->kpgs[i];
+	kppg->state = state;
+	kppg->pri_base = pri_base;
+	kppg->run_ts = ktime_get_ns();
+	mutex_init(&kppg->mutex);
+	INIT_LIST_HEAD(&kppg->kcmds_new_list);
+	INIT_LIST_HEAD(&kppg->kcmds_processing_list);
+	INIT_LIST_HEAD(&kppg->sched_list);
+	list_add_tail(&kppg->list, &fh->sched.ppgs);
+
+	return kppg;
+}
+
+static void sched_test_add_kcmd(struct kunit *test, struct ipu_psys_ppg *kppg,
+				u64 deadline)
+{
+	struct ipu_psys_kcmd *kcmd;
+
+	kcmd = kunit_kzalloc(test, sizeof(*kcmd), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, kcmd);
+	kcmd->fh = kppg->fh;
+	kcmd->state = KCMD_STATE_PPG_ENQUEUE;
+	kcmd->deadline = deadline;
+	list_add_tail(&kcmd->list, &kppg->kcmds_new_list);
+}
+
+static void sched_test_expect_order(struct kunit *test,
+				    struct ipu_psys_ppg **order,
+				    unsigned int n)
+{
+	struct ipu_psys_ppg *kppg;
+	unsigned int i = 0;
+
+	mutex_lock(&start_list.lock);
+	list_for_each_entry(kppg, &start_list.list, sched_list) {
+		KUNIT_EXPECT_LT(test, i, n);
+		if (i < n)
+			KUNIT_EXPECT_PTR_EQ(test, kppg, order[i]);
+		i++;
+	}
+	mutex_unlock(&start_list.lock);
+	KUNIT_EXPECT_EQ(test, i, n);
+}
+
+static void sched_test_start_order(struct kunit *test)
+{
+	struct sched_test *t = test->priv;
+	struct ipu_psys_ppg *batch, *rt_late, *rt_early, *rt_none;
+
+	batch = sched_test_add_ppg(t, PPG_STATE_START, IPU_PSYS_SCHED_BATCH);
+	rt_late = sched_test_add_ppg(t, PPG_STATE_START,
+				     IPU_PSYS_SCHED_REALTIME);
+	sched_test_add_kcmd(test, rt_late, 200);
+	rt_early = sched_test_add_ppg(t, PPG_STATE_START,
+				      IPU_PSYS_SCHED_REALTIME);
+	sched_test_add_kcmd(test, rt_early, 300);
+	sched_test_add_kcmd(test, rt_early, 100);
+	rt_none = sched_test_add_ppg(t, PPG_STATE_RESUME,
+				     IPU_PSYS_SCHED_REALTIME);
+
+	ipu_psys_scheduler_add_kppg(batch, SCHED_START_LIST);
+	ipu_psys_scheduler_add_kppg(rt_late, SCHED_START_LIST);
+	ipu_psys_scheduler_add_kppg(rt_early, SCHED_START_LIST);
+	ipu_psys_scheduler_add_kppg(rt_none, SCHED_START_LIST);
+	/* Adding twice must not link it twice */
+	ipu_psys_scheduler_add_kppg(batch, SCHED_START_LIST);
+
+	/* Class first, then earliest deadline, no deadline last */
+	sched_test_expect_order(test, (struct ipu_psys_ppg *[]) {
+		rt_early, rt_late, rt_none, batch }, 4);
+
+	/* A queued kcmd with an earlier deadline moves its kppg forward */
+	sched_test_add_kcmd(test, rt_none, 50);
+	ipu_psys_scheduler_requeue_kppg(rt_none);
+	sched_test_expect_order(test, (struct ipu_psys_ppg *[]) {
+		rt_none, rt_early, rt_late, batch }, 4);
+
+	/* ... but never ahead of a higher class */
+	sched_test_add_kcmd(test, batch, 10);
+	ipu_psys_scheduler_requeue_kppg(batch);
+	sched_test_expect_order(test, (struct ipu_psys_ppg *[]) {
+		rt_none, rt_early, rt_late, batch }, 4);
+
+	ipu_psys_scheduler_remove_kppg(rt_early, SCHED_START_LIST);
+	sched_test_expect_order(test, (struct ipu_psys_ppg *[]) {
+		rt_none, rt_late, batch }, 3);
+}
+
+/*
+ * Cost of ipu_psys_run_next() for an event which finds nothing to do:
+ * every ppg is RUNNING, as after ipu_psys_ppg_complete(), with no kcmd
+ * queued. This is what each completion and each QCMD wakeup pays.
+ */
+static void sched_test_bench_run_next(struct kunit *test, unsigned int nr_ppgs)
+{
+	struct sched_test *t = test->priv;
+	unsigned int i;
+	u64 start, ns;
+
+	for (i = 0; i < nr_ppgs; i++)
+		ipu_psys_scheduler_add_kppg(sched_test_add_ppg(t,
+						PPG_STATE_RUNNING,
+						IPU_PSYS_SCHED_INTERACTIVE),
+					    SCHED_STOP_LIST);
+
+	start = ktime_get_ns();
+	for (i = 0; i < SCHED_TEST_BENCH_ITERS; i++) {
+		mutex_lock(&t->psys.mutex);
+		ipu_psys_run_next(&t->psys);
+		mutex_unlock(&t->psys.mutex);
+	}
+	ns = ktime_get_ns() - start;
+
+	for (i = 0; i < nr_ppgs; i++)
+		KUNIT_EXPECT_EQ(test, t->kppgs[i].state, PPG_STATE_RUNNING);
+
+	kunit_info(test, "run_next: %llu ns/call with %u ppgs\n",
+		   div_u64(ns, SCHED_TEST_BENCH_ITERS), nr_ppgs);
+}
+
+static void sched_test_bench_run_next_1(struct kunit *test)
+{
+	sched_test_bench_run_next(test, 1);
+}
+
+static void sched_test_bench_run_next_8(struct kunit *test)
+{
+	sched_test_bench_run_next(test, 8);
+}
+
+static void sched_test_bench_run_next_64(struct kunit *test)
+{
+	sched_test_bench_run_next(test, 64);
+}
+
+static struct kunit_case sched_test_cases[] = {
+	KUNIT_CASE(sched_test_start_order),
+	KUNIT_CASE(sched_test_bench_run_next_1),
+	KUNIT_CASE(sched_test_bench_run_next_8),
+	KUNIT_CASE(sched_test_bench_run_next_64),
+	{}
+};
+
+static struct kunit_suite sched_test_suite = {
+	.name = "ipu6-l-scheduler",
+	.init = sched_test_init,
+	.exit = sched_test_exit,
+	.test_cases = sched_test_cases,
+};
+
+kunit_test_suite(sched_test_suite);
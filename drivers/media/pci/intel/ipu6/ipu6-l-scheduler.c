@@ -6,6 +6,11 @@
 
 extern bool enable_power_gating;
 
+static unsigned int ppg_timeslice_ms = 33;
+module_param(ppg_timeslice_ms, uint, 0664);
+MODULE_PARM_DESC(ppg_timeslice_ms,
+		 "Minimum time a ppg runs before it is switched out for another");
+
 struct sched_list {
 	struct list_head list;
 	/* to protect the list */
@@ -64,127 +69,137 @@ void ipu_psys_scheduler_remove_kppg(struct ipu_psys_ppg *kppg,
 	mutex_unlock(&sc_list->lock);
 }
 
-void ipu_psys_scheduler_add_kppg(struct ipu_psys_ppg *kppg,
-				 enum SCHED_LIST type)
+/*
+ * Whether kppg a is served before b: by class, aged by pri_dynamic, then
+ * earliest deadline within the class. kppgs without a deadline go last.
+ */
+static bool ipu_psys_kppg_before(struct ipu_psys_ppg *a,
+				 struct ipu_psys_ppg *b)
+{
+	int a_pri = a->pri_base + a->pri_dynamic;
+	int b_pri = b->pri_base + b->pri_dynamic;
+
+	if (a_pri != b_pri)
+		return a_pri < b_pri;
+
+	return a->deadline && (!b->deadline || a->deadline < b->deadline);
+}
+
+/* Earliest deadline of the queued kcmds of kppg, called with kppg->mutex */
+static u64 ipu_psys_kppg_deadline(struct ipu_psys_ppg *kppg)
+{
+	struct ipu_psys_kcmd *kcmd;
+	u64 deadline = 0;
+
+	list_for_each_entry(kcmd, &kppg->kcmds_new_list, list)
+		if (kcmd->deadline &&
+		    (!deadline || kcmd->deadline < deadline))
+			deadline = kcmd->deadline;
+
+	return deadline;
+}
+
+/* Insert kppg in its place in sc_list, called with sc_list->lock */
+static void __ipu_psys_scheduler_add_kppg(struct ipu_psys_ppg *kppg,
+					  struct sched_list *sc_list,
+					  enum SCHED_LIST type)
 {
-	int cur_pri = kppg->pri_base + kppg->pri_dynamic;
-	struct sched_list *sc_list = get_sc_list(type);
 	struct ipu_psys *psys = kppg->fh->psys;
 	struct ipu_psys_ppg *tmp0, *tmp1;
 
-	dev_dbg(&psys->adev->dev,
-		"add to %s list, kppg(%d 0x%p) state %d prio(%d %d) fh 0x%p\n",
-		type == SCHED_START_LIST ? "start" : "stop",
-		kppg->kpg->pg->ID, kppg, kppg->state,
-		kppg->pri_base, kppg->pri_dynamic, kppg->fh);
-
-	mutex_lock(&sc_list->lock);
 	if (list_empty(&sc_list->list)) {
 		list_add(&kppg->sched_list, &sc_list->list);
-		goto out;
+		return;
 	}
 
 	if (is_kppg_in_list(kppg, &sc_list->list)) {
 		dev_dbg(&psys->adev->dev, "kppg already in list\n");
-		goto out;
+		return;
 	}
 
 	list_for_each_entry_safe(tmp0, tmp1, &sc_list->list, sched_list) {
-		int tmp_pri = tmp0->pri_base + tmp0->pri_dynamic;
-
 		dev_dbg(&psys->adev->dev,
 			"found kppg(%d 0x%p), state %d pri(%d %d) fh 0x%p\n",
 			tmp0->kpg->pg->ID, tmp0, tmp0->state,
 			tmp0->pri_base, tmp0->pri_dynamic, tmp0->fh);
 
-		if (type == SCHED_START_LIST && tmp_pri > cur_pri) {
+		if (type == SCHED_START_LIST &&
+		    ipu_psys_kppg_before(kppg, tmp0)) {
 			list_add(&kppg->sched_list, tmp0->sched_list.prev);
-			goto out;
-		} else if (type == SCHED_STOP_LIST && tmp_pri < cur_pri) {
+			return;
+		} else if (type == SCHED_STOP_LIST &&
+			   ipu_psys_kppg_before(tmp0, kppg)) {
 			list_add(&kppg->sched_list, tmp0->sched_list.prev);
-			goto out;
+			return;
 		}
 	}
 
 	list_add_tail(&kppg->sched_list, &sc_list->list);
-out:
-	mutex_unlock(&sc_list->lock);
 }
 
-static int ipu_psys_detect_resource_contention(struct ipu_psys_ppg *kppg)
+void ipu_psys_scheduler_add_kppg(struct ipu_psys_ppg *kppg,
+				 enum SCHED_LIST type)
 {
-	struct ipu_psys_resource_pool *try_res_pool;
+	struct sched_list *sc_list = get_sc_list(type);
 	struct ipu_psys *psys = kppg->fh->psys;
-	int ret = 0;
-	int state;
 
-	try_res_pool = kzalloc(sizeof(*try_res_pool), GFP_KERNEL);
-	if (IS_ERR_OR_NULL(try_res_pool))
-		return -ENOMEM;
+	if (type == SCHED_START_LIST)
+		kppg->deadline = ipu_psys_kppg_deadline(kppg);
 
-	mutex_lock(&kppg->mutex);
-	state = kppg->state;
-	mutex_unlock(&kppg->mutex);
-	if (state == PPG_STATE_STARTED || state == PPG_STATE_RUNNING ||
-	    state == PPG_STATE_RESUMED)
-		goto exit;
+	dev_dbg(&psys->adev->dev,
+		"add to %s list, kppg(%d 0x%p) state %d prio(%d %d) deadline %llu fh 0x%p\n",
+		type == SCHED_START_LIST ? "start" : "stop",
+		kppg->kpg->pg->ID, kppg, kppg->state,
+		kppg->pri_base, kppg->pri_dynamic, kppg->deadline, kppg->fh);
 
-	ret = ipu_psys_resource_pool_init(try_res_pool);
-	if (ret < 0) {
-		dev_err(&psys->adev->dev, "unable to alloc pg resources\n");
-		WARN_ON(1);
-		goto exit;
-	}
+	mutex_lock(&sc_list->lock);
+	__ipu_psys_scheduler_add_kppg(kppg, sc_list, type);
+	mutex_unlock(&sc_list->lock);
+}
 
-	ipu_psys_resource_copy(&psys->resource_pool_running, try_res_pool);
-	ret = ipu_psys_try_allocate_resources(&psys->adev->dev,
-					      kppg->kpg->pg,
-					      kppg->manifest,
-					      try_res_pool);
+/*
+ * A kcmd queued to a kppg waiting in the start list may bring its
+ * deadline forward; move the kppg to its new place. Called with
+ * kppg->mutex held.
+ */
+void ipu_psys_scheduler_requeue_kppg(struct ipu_psys_ppg *kppg)
+{
+	struct sched_list *sc_list = get_sc_list(SCHED_START_LIST);
+	u64 deadline;
+
+	if (kppg->state != PPG_STATE_START && kppg->state != PPG_STATE_RESUME)
+		return;
 
-	ipu_psys_resource_pool_cleanup(try_res_pool);
-exit:
-	kfree(try_res_pool);
+	deadline = ipu_psys_kppg_deadline(kppg);
+	if (deadline == kppg->deadline)
+		return;
 
-	return ret;
+	mutex_lock(&sc_list->lock);
+	if (is_kppg_in_list(kppg, &sc_list->list)) {
+		list_del_init(&kppg->sched_list);
+		kppg->deadline = deadline;
+		__ipu_psys_scheduler_add_kppg(kppg, sc_list, SCHED_START_LIST);
+	}
+	mutex_unlock(&sc_list->lock);
 }
 
-static void ipu_psys_scheduler_ppg_sort(struct ipu_psys *psys, bool *stopping)
+static int ipu_psys_detect_resource_contention(struct ipu_psys_ppg *kppg)
 {
-	struct ipu_psys_ppg *kppg, *tmp;
-	struct ipu_psys_scheduler *sched;
-	struct ipu_psys_fh *fh;
-
-	list_for_each_entry(fh, &psys->fhs, list) {
-		mutex_lock(&fh->mutex);
-		sched = &fh->sched;
+	struct ipu_psys *psys = kppg->fh->psys;
+	int state;
 
-		if (list_empty(&sched->ppgs)) {
-			mutex_unlock(&fh->mutex);
-			continue;
-		}
+	mutex_lock(&kppg->mutex);
+	state = kppg->state;
+	mutex_unlock(&kppg->mutex);
+	if (state == PPG_STATE_STARTED || state == PPG_STATE_RUNNING ||
+	    state == PPG_STATE_RESUMED)
+		return 0;
 
-		list_for_each_entry_safe(kppg, tmp, &sched->ppgs, list) {
-			mutex_lock(&kppg->mutex);
-			if (kppg->state == PPG_STATE_START ||
-			    kppg->state == PPG_STATE_RESUME) {
-				ipu_psys_scheduler_add_kppg(kppg,
-							    SCHED_START_LIST);
-			} else if (kppg->state == PPG_STATE_RUNNING) {
-				ipu_psys_scheduler_add_kppg(kppg,
-							    SCHED_STOP_LIST);
-			} else if (kppg->state == PPG_STATE_SUSPENDING ||
-				   kppg->state == PPG_STATE_STOPPING) {
-				/* there are some suspending/stopping ppgs */
-				*stopping = true;
-			} else if (kppg->state == PPG_STATE_RESUMING ||
-				   kppg->state == PPG_STATE_STARTING) {
-				   /* how about kppg are resuming/starting? */
-			}
-			mutex_unlock(&kppg->mutex);
-		}
-		mutex_unlock(&fh->mutex);
-	}
+	/* Trial allocation is rolled back, the running pool is unchanged */
+	return ipu_psys_try_allocate_resources(&psys->adev->dev,
+					       kppg->kpg->pg,
+					       kppg->manifest,
+					       &psys->resource_pool_running);
 }
 
 static void ipu_psys_scheduler_update_start_ppg_priority(void)
@@ -199,22 +214,49 @@ static void ipu_psys_scheduler_update_start_ppg_priority(void)
 	mutex_unlock(&sc_list->lock);
 }
 
-static bool ipu_psys_scheduler_switch_ppg(struct ipu_psys *psys)
+/*
+ * Pick a running ppg to suspend for `blocked'. Prefer the lowest
+ * priority one using cells or DFM ports `blocked' needs; ppgs which have
+ * not yet run for ppg_timeslice_ms are left alone so that conflicting
+ * ppgs take turns instead of bouncing between suspend and resume.
+ */
+static bool ipu_psys_scheduler_switch_ppg(struct ipu_psys *psys,
+					  struct ipu_psys_ppg *blocked)
 {
 	struct sched_list *sc_list = get_sc_list(SCHED_STOP_LIST);
-	struct ipu_psys_ppg *kppg;
+	u64 slice = (u64)ppg_timeslice_ms * NSEC_PER_MSEC;
+	struct ipu_psys_ppg *kppg, *victim = NULL, *fallback = NULL;
+	bool conflict = false;
+	u64 now = ktime_get_ns();
 	bool resched = false;
 
 	mutex_lock(&sc_list->lock);
-	if (list_empty(&sc_list->list)) {
-		/* some ppgs are RESUMING/STARTING */
+	list_for_each_entry(kppg, &sc_list->list, sched_list) {
+		bool overlap =
+			ipu_psys_resource_footprint_overlap(&kppg->footprint,
+							    &blocked->footprint);
+
+		conflict |= overlap;
+		if (now - kppg->run_ts < slice)
+			continue;
+		if (overlap) {
+			victim = kppg;
+			break;
+		}
+		if (!fallback)
+			fallback = kppg;
+	}
+	/* Contention is on other resources, any ppg frees some */
+	if (!conflict)
+		victim = fallback;
+	mutex_unlock(&sc_list->lock);
+
+	if (!victim) {
+		/* some ppgs are RESUMING/STARTING or within their slice */
 		dev_dbg(&psys->adev->dev, "no candidated stop ppg\n");
-		mutex_unlock(&sc_list->lock);
 		return false;
 	}
-	kppg = list_first_entry(&sc_list->list, struct ipu_psys_ppg,
-				sched_list);
-	mutex_unlock(&sc_list->lock);
+	kppg = victim;
 
 	mutex_lock(&kppg->mutex);
 	if (!(kppg->state & PPG_STATE_STOP)) {
@@ -229,19 +271,44 @@ static bool ipu_psys_scheduler_switch_ppg(struct ipu_psys *psys)
 }
 
 /*
- * search all kppgs and sort them into start_list and stop_list, alway start
- * first kppg(high priority) in start_list;
- * if there is resource contention, it would switch kppgs in stop_list
- * to suspend state one by one
+ * Next kppg of sc_list which this pass has not looked at yet, called
+ * with sc_list->lock
+ */
+static struct ipu_psys_ppg *
+ipu_psys_scheduler_next_kppg(struct sched_list *sc_list, u32 pass)
+{
+	struct ipu_psys_ppg *kppg;
+
+	list_for_each_entry(kppg, &sc_list->list, sched_list) {
+		if (kppg->sched_pass != pass) {
+			kppg->sched_pass = pass;
+			return kppg;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * kppgs enter start_list and stop_list on their state transitions, see
+ * ipu_psys_scheduler_add_kppg() callers. Alway start first kppg(high
+ * class, then earliest deadline) in start_list;
+ * kppgs that fit are started together. Once one does not fit, later
+ * kppgs are only started if their footprint leaves it alone, and after
+ * the pass kppgs in stop_list are switched to suspend state one by one
+ * to make room for it, unless some are suspending/stopping
  */
-static bool ipu_psys_scheduler_ppg_start(struct ipu_psys *psys)
+static bool ipu_psys_scheduler_ppg_start(struct ipu_psys *psys,
+					 bool stopping_existed)
 {
 	struct sched_list *sc_list = get_sc_list(SCHED_START_LIST);
-	struct ipu_psys_ppg *kppg, *kppg0;
-	bool stopping_existed = false;
+	struct ipu_psys_ppg *kppg, *blocked = NULL;
+	/* Called with psys->mutex, new kppgs start at pass 0 */
+	static u32 pass;
 	int ret;
 
-	ipu_psys_scheduler_ppg_sort(psys, &stopping_existed);
+	if (!++pass)
+		pass++;
 
 	mutex_lock(&sc_list->lock);
 	if (list_empty(&sc_list->list)) {
@@ -250,27 +317,35 @@ static bool ipu_psys_scheduler_ppg_start(struct ipu_psys *psys)
 		return false;
 	}
 
-	list_for_each_entry_safe(kppg, kppg0,
-				 &sc_list->list, sched_list) {
+	/*
+	 * sc_list->lock is dropped for each kppg and QCMD adds and requeues
+	 * kppgs meanwhile, so no next entry can be kept across the loop
+	 * body: look for the next one from the list head every time. The
+	 * kppgs themselves are only freed with psys->mutex held.
+	 */
+	while ((kppg = ipu_psys_scheduler_next_kppg(sc_list, pass))) {
 		mutex_unlock(&sc_list->lock);
 
+		if (blocked &&
+		    ipu_psys_resource_footprint_overlap(&kppg->footprint,
+							&blocked->footprint)) {
+			dev_dbg(&psys->adev->dev,
+				"ppg %d waits behind ppg %d\n",
+				kppg->kpg->pg->ID, blocked->kpg->pg->ID);
+			mutex_lock(&sc_list->lock);
+			continue;
+		}
+
 		ret = ipu_psys_detect_resource_contention(kppg);
 		if (ret < 0) {
 			dev_dbg(&psys->adev->dev,
 				"ppg %d resource detect failed(%d)\n",
 				kppg->kpg->pg->ID, ret);
-			/*
-			 * switch out other ppg in 2 cases:
-			 * 1. resource contention
-			 * 2. no suspending/stopping ppg
-			 */
 			if (ret == -ENOSPC) {
-				if (!stopping_existed &&
-				    ipu_psys_scheduler_switch_ppg(psys)) {
-					return true;
-				}
-				dev_dbg(&psys->adev->dev,
-					"ppg is suspending/stopping\n");
+				if (!kppg->res_wait_ts)
+					kppg->res_wait_ts = ktime_get_ns();
+				if (!blocked)
+					blocked = kppg;
 			} else {
 				dev_err(&psys->adev->dev,
 					"detect resource error %d\n", ret);
@@ -279,6 +354,12 @@ static bool ipu_psys_scheduler_ppg_start(struct ipu_psys *psys)
 			kppg->pri_dynamic = 0;
 
 			mutex_lock(&kppg->mutex);
+			if (kppg->res_wait_ts) {
+				ipu_psys_lat_add(&kppg->res_lat,
+						 ktime_get_ns() -
+						 kppg->res_wait_ts);
+				kppg->res_wait_ts = 0;
+			}
 			if (kppg->state == PPG_STATE_START)
 				ipu_psys_ppg_start(kppg);
 			else
@@ -293,6 +374,18 @@ static bool ipu_psys_scheduler_ppg_start(struct ipu_psys *psys)
 	}
 	mutex_unlock(&sc_list->lock);
 
+	/*
+	 * switch out other ppg in 2 cases:
+	 * 1. resource contention
+	 * 2. no suspending/stopping ppg
+	 */
+	if (blocked) {
+		if (!stopping_existed &&
+		    ipu_psys_scheduler_switch_ppg(psys, blocked))
+			return true;
+		dev_dbg(&psys->adev->dev, "ppg is suspending/stopping\n");
+	}
+
 	return false;
 }
 
@@ -324,16 +417,19 @@ static bool ipu_psys_scheduler_ppg_enqueue_bufset(struct ipu_psys *psys)
 /*
  * This function will check all kppgs within fhs, and if kppg state
  * is STOP or SUSPEND, l-scheduler will call ppg function to stop
- * or suspend it and update stop list
+ * or suspend it and update stop list. *stopping is set if any kppg
+ * is suspending/stopping afterwards, including those halted here.
  */
 
-static bool ipu_psys_scheduler_ppg_halt(struct ipu_psys *psys)
+static bool ipu_psys_scheduler_ppg_halt(struct ipu_psys *psys, bool *stopping)
 {
 	struct ipu_psys_scheduler *sched;
 	struct ipu_psys_ppg *kppg, *tmp;
 	struct ipu_psys_fh *fh;
 	bool stopping_exit = false;
 
+	*stopping = false;
+
 	list_for_each_entry(fh, &psys->fhs, list) {
 		mutex_lock(&fh->mutex);
 		sched = &fh->sched;
@@ -356,6 +452,9 @@ static bool ipu_psys_scheduler_ppg_halt(struct ipu_psys *psys)
 				   kppg->state == PPG_STATE_STOPPING) {
 				stopping_exit = true;
 			}
+			if (kppg->state == PPG_STATE_SUSPENDING ||
+			    kppg->state == PPG_STATE_STOPPING)
+				*stopping = true;
 			mutex_unlock(&kppg->mutex);
 		}
 		mutex_unlock(&fh->mutex);
@@ -405,6 +504,12 @@ static void ipu_psys_update_ppg_state_by_kcmd(struct ipu_psys *psys,
 	if (old_ppg_state != kppg->state)
 		dev_dbg(&psys->adev->dev, "s_change:%s: %p %d -> %d\n",
 			__func__, kppg, old_ppg_state, kppg->state);
+
+	/* Runnable again, queue for ipu_psys_scheduler_ppg_start() */
+	if (old_ppg_state != kppg->state &&
+	    (kppg->state == PPG_STATE_START ||
+	     kppg->state == PPG_STATE_RESUME))
+		ipu_psys_scheduler_add_kppg(kppg, SCHED_START_LIST);
 }
 
 static void ipu_psys_scheduler_kcmd_set(struct ipu_psys *psys)
@@ -579,6 +684,8 @@ void ipu_psys_run_next(struct ipu_psys *psys)
 	bool need_trigger = false;
 	/* Wait FW callback if there are stopping/suspending/running ppg */
 	bool wait_fw_finish = false;
+	/* Some ppgs are suspending/stopping, don't switch out another */
+	bool stopping = false;
 	/*
 	 * Code below will crash if fhs is empty. Normally this
 	 * shouldn't happen.
@@ -596,15 +703,16 @@ void ipu_psys_run_next(struct ipu_psys *psys)
 	/* Handle kcmd and related ppg switch */
 	if (psys->power_gating == PSYS_POWER_NORMAL) {
 		ipu_psys_scheduler_kcmd_set(psys);
-		wait_fw_finish = ipu_psys_scheduler_ppg_halt(psys);
-		need_trigger |= ipu_psys_scheduler_ppg_start(psys);
+		wait_fw_finish = ipu_psys_scheduler_ppg_halt(psys, &stopping);
+		need_trigger |= ipu_psys_scheduler_ppg_start(psys, stopping);
 		need_trigger |= ipu_psys_scheduler_ppg_enqueue_bufset(psys);
 	}
 	if (!(need_trigger || wait_fw_finish)) {
 		/* Nothing to do, enter power gating */
 		need_trigger = ipu_psys_scheduler_enter_power_gating(psys);
 		if (psys->power_gating == PSYS_POWER_GATING)
-			wait_fw_finish = ipu_psys_scheduler_ppg_halt(psys);
+			wait_fw_finish = ipu_psys_scheduler_ppg_halt(psys,
+								     &stopping);
 	}
 
 	if (need_trigger && !wait_fw_finish) {
@@ -613,3 +721,7 @@ void ipu_psys_run_next(struct ipu_psys *psys)
 		wake_up_interruptible(&psys->sched_cmd_wq);
 	}
 }
+
+#if IS_ENABLED(CONFIG_VIDEO_INTEL_IPU6_PSYS_KUNIT_TEST)
+#include "ipu6-l-scheduler-test.c"
+#endif
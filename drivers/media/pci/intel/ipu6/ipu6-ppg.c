@@ -7,6 +7,7 @@
 #include <asm/cacheflush.h>
 
 #include "ipu6-ppg.h"
+#include "ipu-psys-trace.h"
 
 static bool enable_suspend_resume;
 module_param(enable_suspend_resume, bool, 0664);
@@ -186,6 +187,8 @@ void ipu_psys_ppg_complete(struct ipu_psys *psys, struct ipu_psys_ppg *kppg)
 		} else if (kppg->state == PPG_STATE_STARTED ||
 			   kppg->state == PPG_STATE_RESUMED) {
 			kppg->state = PPG_STATE_RUNNING;
+			kppg->run_ts = ktime_get_ns();
+			ipu_psys_scheduler_add_kppg(kppg, SCHED_STOP_LIST);
 		}
 
 		/* Kick l-scheduler thread for FW callback,
@@ -201,6 +204,23 @@ void ipu_psys_ppg_complete(struct ipu_psys *psys, struct ipu_psys_ppg *kppg)
 	mutex_unlock(&kppg->mutex);
 }
 
+/* Undo resource allocation and power up of a failed ppg start */
+static void ipu_psys_ppg_start_cleanup(struct ipu_psys_ppg *kppg,
+				       struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys *psys = kppg->fh->psys;
+
+	pm_runtime_put_noidle(&psys->adev->dev);
+	ipu_psys_reset_process_cell(&psys->adev->dev,
+				    kcmd->kpg->pg,
+				    kcmd->pg_manifest,
+				    kcmd->kpg->pg->process_count);
+	ipu_psys_free_resources(&kppg->kpg->resource_alloc,
+				&psys->resource_pool_running);
+
+	dev_err(&psys->adev->dev, "failed to start ppg\n");
+}
+
 int ipu_psys_ppg_start(struct ipu_psys_ppg *kppg)
 {
 	struct ipu_psys *psys = kppg->fh->psys;
@@ -257,9 +277,13 @@ int ipu_psys_ppg_start(struct ipu_psys_ppg *kppg)
 
 	ret = ipu_psys_kcmd_start(psys, kcmd);
 	if (ret) {
+		ipu_psys_ppg_start_cleanup(kppg, kcmd);
+		/* May be freed by DQEVENT right away, complete it last */
 		ipu_psys_kcmd_complete(kppg, kcmd, -EIO);
-		goto error;
+		return ret;
 	}
+	ipu_psys_kcmd_stamp(kcmd, IPU_PSYS_KCMD_TS_START);
+	trace_ipu_psys_kcmd_start(kcmd);
 
 	dev_dbg(&psys->adev->dev, "s_change:%s: %p %d -> %d\n",
 		__func__, kppg, kppg->state, PPG_STATE_STARTED);
@@ -269,15 +293,7 @@ int ipu_psys_ppg_start(struct ipu_psys_ppg *kppg)
 	return 0;
 
 error:
-	pm_runtime_put_noidle(&psys->adev->dev);
-	ipu_psys_reset_process_cell(&psys->adev->dev,
-				    kcmd->kpg->pg,
-				    kcmd->pg_manifest,
-				    kcmd->kpg->pg->process_count);
-	ipu_psys_free_resources(&kppg->kpg->resource_alloc,
-				&psys->resource_pool_running);
-
-	dev_err(&psys->adev->dev, "failed to start ppg\n");
+	ipu_psys_ppg_start_cleanup(kppg, kcmd);
 	return ret;
 }
 
@@ -471,6 +487,9 @@ bool ipu_psys_ppg_enqueue_bufsets(struct ipu_psys_ppg *kppg)
 						kppg, ret);
 					break;
 				}
+				ipu_psys_kcmd_stamp(kcmd,
+						    IPU_PSYS_KCMD_TS_START);
+				trace_ipu_psys_kcmd_start(kcmd);
 				list_move_tail(&kcmd->list,
 					       &kppg->kcmds_processing_list);
 				dev_dbg(&psys->adev->dev,
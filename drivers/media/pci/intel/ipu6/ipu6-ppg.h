@@ -26,6 +26,7 @@ void ipu_psys_scheduler_remove_kppg(struct ipu_psys_ppg *kppg,
 				    enum SCHED_LIST type);
 void ipu_psys_scheduler_add_kppg(struct ipu_psys_ppg *kppg,
 				 enum SCHED_LIST type);
+void ipu_psys_scheduler_requeue_kppg(struct ipu_psys_ppg *kppg);
 int ipu_psys_ppg_start(struct ipu_psys_ppg *kppg);
 int ipu_psys_ppg_resume(struct ipu_psys_ppg *kppg);
 int ipu_psys_ppg_stop(struct ipu_psys_ppg *kppg);
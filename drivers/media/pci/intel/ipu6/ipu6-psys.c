@@ -17,9 +17,12 @@
 #endif
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
 
 #include "ipu.h"
 #include "ipu-psys.h"
+#include "ipu-psys-trace.h"
 #include "ipu6-ppg.h"
 #include "ipu-platform-regs.h"
 #include "ipu-trace.h"
@@ -158,6 +161,134 @@ void ipu_psys_setup_hw(struct ipu_psys *psys)
 	writel(irqs, base + IPU_REG_PSYS_GPDEV_IRQ_ENABLE);
 }
 
+void ipu_psys_lat_add(struct ipu_psys_lat_stat *stat, u64 ns)
+{
+	unsigned int b = ns ? min_t(unsigned int, ilog2(ns) + 1,
+				    IPU_PSYS_LAT_BUCKETS - 1) : 0;
+
+	if (!stat->count || ns < stat->min)
+		stat->min = ns;
+	if (ns > stat->max)
+		stat->max = ns;
+	stat->sum += ns;
+	stat->count++;
+	stat->bucket[b]++;
+}
+
+/* Upper bound of the bucket holding the 99th percentile, capped at max */
+static u64 ipu_psys_lat_p99(const struct ipu_psys_lat_stat *stat)
+{
+	u64 target = DIV_ROUND_UP_ULL(stat->count * 99, 100);
+	u64 seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < IPU_PSYS_LAT_BUCKETS - 1; b++) {
+		seen += stat->bucket[b];
+		if (seen >= target)
+			return min_t(u64, 1ULL << b, stat->max);
+	}
+
+	return stat->max;
+}
+
+static void ipu_psys_kcmd_lat_add(struct ipu_psys_lat_stat *lat,
+				  const struct ipu_psys_kcmd *kcmd)
+{
+	const u64 *ts = kcmd->ts;
+	unsigned int i;
+
+	/* Steps not taken by the kcmd (e.g. stop has no start) are skipped */
+	for (i = IPU_PSYS_KCMD_TS_SEND; i < IPU_PSYS_KCMD_TS_NUM; i++)
+		if (ts[i] && ts[i - 1])
+			ipu_psys_lat_add(&lat[i], ts[i] - ts[i - 1]);
+
+	ipu_psys_lat_add(&lat[IPU_PSYS_KCMD_TS_NEW],
+			 ts[IPU_PSYS_KCMD_TS_DEQUEUE] - ts[IPU_PSYS_KCMD_TS_NEW]);
+}
+
+static const char * const ipu_psys_lat_names[IPU_PSYS_KCMD_TS_NUM] = {
+	[IPU_PSYS_KCMD_TS_NEW] = "total",
+	[IPU_PSYS_KCMD_TS_SEND] = "new->send",
+	[IPU_PSYS_KCMD_TS_START] = "send->start",
+	[IPU_PSYS_KCMD_TS_COMPLETE] = "start->complete",
+	[IPU_PSYS_KCMD_TS_DEQUEUE] = "complete->dequeue",
+};
+
+static size_t ipu_psys_lat_dump_one(char *buf, size_t size, const char *name,
+				    const struct ipu_psys_lat_stat *stat)
+{
+	if (!stat->count)
+		return 0;
+
+	return scnprintf(buf, size,
+			 "  %-18s count %llu min %llu avg %llu p99 %llu max %llu ns\n",
+			 name, stat->count, stat->min,
+			 div64_u64(stat->sum, stat->count),
+			 ipu_psys_lat_p99(stat), stat->max);
+}
+
+static const char * const ipu_psys_class_names[IPU_PSYS_SCHED_NUM] = {
+	[IPU_PSYS_SCHED_REALTIME] = "realtime",
+	[IPU_PSYS_SCHED_INTERACTIVE] = "interactive",
+	[IPU_PSYS_SCHED_BATCH] = "batch",
+};
+
+/*
+ * Dump per class queueing delay and deadline misses, then kcmd
+ * latencies per fh and per ppg. Called with psys->mutex held, which
+ * keeps the fh list stable.
+ */
+size_t ipu_psys_lat_dump(struct ipu_psys *psys, char *buf, size_t size)
+{
+	struct ipu_psys_class_stat stat;
+	struct ipu_psys_ppg *kppg;
+	struct ipu_psys_fh *fh;
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < IPU_PSYS_SCHED_NUM; i++) {
+		spin_lock_irq(&psys->class_lock);
+		stat = psys->class_stat[i];
+		spin_unlock_irq(&psys->class_lock);
+
+		len += scnprintf(buf + len, size - len,
+				 "class %s deadlines %llu missed %llu\n",
+				 ipu_psys_class_names[i], stat.deadlines,
+				 stat.missed);
+		len += ipu_psys_lat_dump_one(buf + len, size - len,
+					     "new->start", &stat.delay);
+	}
+
+	list_for_each_entry(fh, &psys->fhs, list) {
+		mutex_lock(&fh->mutex);
+		len += scnprintf(buf + len, size - len, "fh %p\n", fh);
+		for (i = 0; i < IPU_PSYS_KCMD_TS_NUM; i++)
+			len += ipu_psys_lat_dump_one(buf + len, size - len,
+						     ipu_psys_lat_names[i],
+						     &fh->lat[i]);
+
+		list_for_each_entry(kppg, &fh->sched.ppgs, list) {
+			mutex_lock(&kppg->mutex);
+			len += scnprintf(buf + len, size - len,
+					 " ppg %d %p class %s\n",
+					 kppg->kpg->pg->ID, kppg,
+					 ipu_psys_class_names[kppg->pri_base]);
+			for (i = 0; i < IPU_PSYS_KCMD_TS_NUM; i++)
+				len += ipu_psys_lat_dump_one(buf + len,
+							     size - len,
+							     ipu_psys_lat_names[i],
+							     &kppg->lat[i]);
+			len += ipu_psys_lat_dump_one(buf + len, size - len,
+						     "resource wait",
+						     &kppg->res_lat);
+			mutex_unlock(&kppg->mutex);
+		}
+		mutex_unlock(&fh->mutex);
+	}
+
+	return len;
+}
+
 static struct ipu_psys_ppg *ipu_psys_identify_kppg(struct ipu_psys_kcmd *kcmd)
 {
 	struct ipu_psys_scheduler *sched = &kcmd->fh->sched;
@@ -180,6 +311,19 @@ not_found:
 	return NULL;
 }
 
+/*
+ * Free the memory of a kcmd which was never handed to a ppg, including
+ * the pg buffer it still owns. Does not take any lock, so it is usable
+ * with fh->mutex held.
+ */
+static void __ipu_psys_kcmd_free(struct ipu_psys_kcmd *kcmd)
+{
+	if (kcmd->kpg)
+		__put_pg_buf(kcmd->fh->psys, kcmd->kpg);
+	ipu_psys_manifest_cache_put(kcmd->fh->psys, kcmd->pg_manifest);
+	ipu_psys_kcmd_pool_put(kcmd->fh->psys, kcmd);
+}
+
 /*
  * Called to free up all resources associated with a kcmd.
  * After this the kcmd doesn't anymore exist in the driver.
@@ -206,25 +350,32 @@ static void ipu_psys_kcmd_free(struct ipu_psys_kcmd *kcmd)
 		mutex_lock(&kppg->mutex);
 		if (!list_empty(&kcmd->list))
 			list_del(&kcmd->list);
+		if (kcmd->ts[IPU_PSYS_KCMD_TS_DEQUEUE])
+			ipu_psys_kcmd_lat_add(kppg->lat, kcmd);
 		mutex_unlock(&kppg->mutex);
 	}
 
-	kfree(kcmd->pg_manifest);
-	kfree(kcmd->kbufs);
-	kfree(kcmd->buffers);
-	kfree(kcmd);
+	if (kcmd->ts[IPU_PSYS_KCMD_TS_DEQUEUE]) {
+		mutex_lock(&kcmd->fh->mutex);
+		ipu_psys_kcmd_lat_add(kcmd->fh->lat, kcmd);
+		mutex_unlock(&kcmd->fh->mutex);
+	}
+
+	/* kcmd->kpg belongs to the ppg by now */
+	ipu_psys_manifest_cache_put(kcmd->fh->psys, kcmd->pg_manifest);
+	ipu_psys_kcmd_pool_put(kcmd->fh->psys, kcmd);
 }
 
+/*
+ * Build a kcmd from a user command: everything which does not depend on
+ * the fh buffer map, including the copy of the buffer descriptors from
+ * user space. Called without fh->mutex.
+ */
 static struct ipu_psys_kcmd *ipu_psys_copy_cmd(struct ipu_psys_command *cmd,
 					       struct ipu_psys_fh *fh)
 {
 	struct ipu_psys *psys = fh->psys;
 	struct ipu_psys_kcmd *kcmd;
-	struct ipu_psys_kbuffer *kpgbuf;
-	unsigned int i;
-	int ret, prevfd, fd;
-
-	fd = prevfd = -1;
 
 	if (cmd->bufcount > IPU_MAX_PSYS_CMD_BUFFERS)
 		return NULL;
@@ -232,94 +383,138 @@ static struct ipu_psys_kcmd *ipu_psys_copy_cmd(struct ipu_psys_command *cmd,
 	if (!cmd->pg_manifest_size)
 		return NULL;
 
-	kcmd = kzalloc(sizeof(*kcmd), GFP_KERNEL);
+	/* A command with buffers but no descriptors to resolve them from */
+	if (cmd->buffers && !cmd->bufcount)
+		return NULL;
+
+	kcmd = ipu_psys_kcmd_pool_get(psys);
 	if (!kcmd)
 		return NULL;
 
+	ipu_psys_kcmd_stamp(kcmd, IPU_PSYS_KCMD_TS_NEW);
 	kcmd->state = KCMD_STATE_PPG_NEW;
 	kcmd->fh = fh;
 	INIT_LIST_HEAD(&kcmd->list);
 
-	mutex_lock(&fh->mutex);
+	kcmd->user_token = cmd->user_token;
+	kcmd->issue_id = cmd->issue_id;
+	kcmd->priority = cmd->priority & ~IPU_PSYS_CMD_FLAG_SCHED;
+	if (kcmd->priority >= IPU_PSYS_CMD_PRIORITY_NUM)
+		goto error;
+
+	/*
+	 * Priorities and classes map one to one, highest first. The class
+	 * and deadline words used to be reserved and unchecked, so they
+	 * only count when user space says so; unknown classes are AUTO.
+	 */
+	kcmd->sched_class = kcmd->priority;
+	kcmd->deadline = 0;
+	if (cmd->priority & IPU_PSYS_CMD_FLAG_SCHED) {
+		if (cmd->sched_class >= IPU_PSYS_SCHED_CLASS_REALTIME &&
+		    cmd->sched_class <= IPU_PSYS_SCHED_CLASS_BATCH)
+			kcmd->sched_class = cmd->sched_class - 1;
+		if (cmd->deadline_us)
+			kcmd->deadline = kcmd->ts[IPU_PSYS_KCMD_TS_NEW] +
+				(u64)cmd->deadline_us * NSEC_PER_USEC;
+	}
+
+	/*
+	 * Kenel enable bitmap be used only.
+	 */
+	memcpy(kcmd->kernel_enable_bitmap, cmd->kernel_enable_bitmap,
+	       sizeof(cmd->kernel_enable_bitmap));
+
+	/* should be stop cmd for ppg */
+	if (!cmd->buffers)
+		return kcmd;
+
+	/*
+	 * The terminal count is only known once the pg is resolved; copy
+	 * all the descriptors user space gave, the pg may use fewer.
+	 */
+	kcmd->nbuffers = cmd->bufcount;
+	if (ipu_psys_kcmd_pool_get_buffers(psys, kcmd))
+		goto error;
+
+	if (copy_from_user(kcmd->buffers, cmd->buffers,
+			   kcmd->nbuffers * sizeof(*kcmd->buffers)))
+		goto error;
+
+	return kcmd;
+error:
+	__ipu_psys_kcmd_free(kcmd);
+
+	dev_dbg(&psys->adev->dev, "failed to copy cmd\n");
+
+	return NULL;
+}
+
+/*
+ * Resolve the pg and the buffers of a kcmd from the fh buffer map and
+ * copy the pg. Called with fh->mutex held, so a batch of commands is
+ * resolved under a single lock hold. On failure the caller frees kcmd.
+ */
+static int ipu_psys_resolve_cmd(struct ipu_psys_command *cmd,
+				struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys_fh *fh = kcmd->fh;
+	struct ipu_psys *psys = fh->psys;
+	struct ipu_psys_kbuffer *kpgbuf;
+	size_t pg_size, nbuffers;
+	unsigned int i;
+	int ret, prevfd = -1, fd;
+
 	fd = cmd->pg;
 	kpgbuf = ipu_psys_lookup_kbuffer(fh, fd);
 	if (!kpgbuf || !kpgbuf->sgt) {
 		dev_err(&psys->adev->dev, "%s kbuf %p with fd %d not found.\n",
 			__func__, kpgbuf, fd);
-		mutex_unlock(&fh->mutex);
-		goto error;
+		return -EINVAL;
 	}
 
 	/* check and remap if possibe */
 	ret = ipu_psys_mapbuf_locked(fd, fh, kpgbuf);
 	if (ret) {
 		dev_err(&psys->adev->dev, "%s remap failed\n", __func__);
-		mutex_unlock(&fh->mutex);
-		goto error;
+		return -EINVAL;
 	}
 
 	kpgbuf = ipu_psys_lookup_kbuffer(fh, fd);
 	if (!kpgbuf || !kpgbuf->sgt) {
 		WARN(1, "kbuf not found or unmapped.\n");
-		mutex_unlock(&fh->mutex);
-		goto error;
+		return -EINVAL;
 	}
-	mutex_unlock(&fh->mutex);
 
+	/*
+	 * Take a pg buffer sized for the PG descriptor rather than for
+	 * the whole user buffer, so that the pool classes follow the real
+	 * PG sizes. The size is checked again once the pg is copied.
+	 */
 	kcmd->pg_user = kpgbuf->kaddr;
-	kcmd->kpg = __get_pg_buf(psys, kpgbuf->len);
+	pg_size = ((struct ipu_fw_psys_process_group *)kcmd->pg_user)->size;
+	if (pg_size < sizeof(*kcmd->kpg->pg) || pg_size > kpgbuf->len) {
+		dev_dbg(&psys->adev->dev, "bad pg size %zu, buffer %llu\n",
+			pg_size, kpgbuf->len);
+		return -EINVAL;
+	}
+
+	kcmd->kpg = __get_pg_buf(psys, pg_size);
 	if (!kcmd->kpg)
-		goto error;
+		return -EINVAL;
 
 	memcpy(kcmd->kpg->pg, kcmd->pg_user, kcmd->kpg->pg_size);
 
-	kcmd->pg_manifest = kzalloc(cmd->pg_manifest_size, GFP_KERNEL);
-	if (!kcmd->pg_manifest)
-		goto error;
-
-	ret = copy_from_user(kcmd->pg_manifest, cmd->pg_manifest,
-			     cmd->pg_manifest_size);
-	if (ret)
-		goto error;
-
-	kcmd->pg_manifest_size = cmd->pg_manifest_size;
-
-	kcmd->user_token = cmd->user_token;
-	kcmd->issue_id = cmd->issue_id;
-	kcmd->priority = cmd->priority;
-	if (kcmd->priority >= IPU_PSYS_CMD_PRIORITY_NUM)
-		goto error;
-
-	/*
-	 * Kenel enable bitmap be used only.
-	 */
-	memcpy(kcmd->kernel_enable_bitmap, cmd->kernel_enable_bitmap,
-	       sizeof(cmd->kernel_enable_bitmap));
-
-	kcmd->nbuffers = ipu_fw_psys_pg_get_terminal_count(kcmd);
-	kcmd->buffers = kcalloc(kcmd->nbuffers, sizeof(*kcmd->buffers),
-				GFP_KERNEL);
-	if (!kcmd->buffers)
-		goto error;
-
-	kcmd->kbufs = kcalloc(kcmd->nbuffers, sizeof(kcmd->kbufs[0]),
-			      GFP_KERNEL);
-	if (!kcmd->kbufs)
-		goto error;
+	nbuffers = ipu_fw_psys_pg_get_terminal_count(kcmd);
 
 	/* should be stop cmd for ppg */
 	if (!cmd->buffers) {
 		kcmd->state = KCMD_STATE_PPG_STOP;
-		return kcmd;
+		return 0;
 	}
 
-	if (!cmd->bufcount || kcmd->nbuffers > cmd->bufcount)
-		goto error;
-
-	ret = copy_from_user(kcmd->buffers, cmd->buffers,
-			     kcmd->nbuffers * sizeof(*kcmd->buffers));
-	if (ret)
-		goto error;
+	if (nbuffers > kcmd->nbuffers)
+		return -EINVAL;
+	kcmd->nbuffers = nbuffers;
 
 	for (i = 0; i < kcmd->nbuffers; i++) {
 		struct ipu_fw_psys_terminal *terminal;
@@ -335,43 +530,38 @@ static struct ipu_psys_kcmd *ipu_psys_copy_cmd(struct ipu_psys_command *cmd,
 		if (kcmd->state == KCMD_STATE_PPG_START) {
 			dev_err(&psys->adev->dev,
 				"err: all buffer.flags&DMA_HANDLE must 0\n");
-			goto error;
+			return -EINVAL;
 		}
 
-		mutex_lock(&fh->mutex);
 		fd = kcmd->buffers[i].base.fd;
 		kpgbuf = ipu_psys_lookup_kbuffer(fh, fd);
 		if (!kpgbuf || !kpgbuf->sgt) {
 			dev_err(&psys->adev->dev,
 				"%s kcmd->buffers[%d] %p fd %d not found.\n",
 				__func__, i, kpgbuf, fd);
-			mutex_unlock(&fh->mutex);
-			goto error;
+			return -EINVAL;
 		}
 
 		ret = ipu_psys_mapbuf_locked(fd, fh, kpgbuf);
 		if (ret) {
 			dev_err(&psys->adev->dev, "%s remap failed\n",
 				__func__);
-			mutex_unlock(&fh->mutex);
-			goto error;
+			return -EINVAL;
 		}
 
 		kpgbuf = ipu_psys_lookup_kbuffer(fh, fd);
 		if (!kpgbuf || !kpgbuf->sgt) {
 			WARN(1, "kbuf not found or unmapped.\n");
-			mutex_unlock(&fh->mutex);
-			goto error;
+			return -EINVAL;
 		}
-		mutex_unlock(&fh->mutex);
 		kcmd->kbufs[i] = kpgbuf;
 		if (!kcmd->kbufs[i] || !kcmd->kbufs[i]->sgt ||
 		    kcmd->kbufs[i]->len < kcmd->buffers[i].bytes_used)
-			goto error;
+			return -EINVAL;
 		if ((kcmd->kbufs[i]->flags &
-		     IPU_BUFFER_FLAG_NO_FLUSH) ||
+		     (IPU_BUFFER_FLAG_NO_FLUSH | IPU_BUFFER_FLAG_DEVICE_ONLY)) ||
 		    (kcmd->buffers[i].flags &
-		     IPU_BUFFER_FLAG_NO_FLUSH) ||
+		     (IPU_BUFFER_FLAG_NO_FLUSH | IPU_BUFFER_FLAG_DEVICE_ONLY)) ||
 		    prevfd == kcmd->buffers[i].base.fd)
 			continue;
 
@@ -385,13 +575,7 @@ static struct ipu_psys_kcmd *ipu_psys_copy_cmd(struct ipu_psys_command *cmd,
 	if (kcmd->state != KCMD_STATE_PPG_START)
 		kcmd->state = KCMD_STATE_PPG_ENQUEUE;
 
-	return kcmd;
-error:
-	ipu_psys_kcmd_free(kcmd);
-
-	dev_dbg(&psys->adev->dev, "failed to copy cmd\n");
-
-	return NULL;
+	return 0;
 }
 
 static struct ipu_psys_buffer_set *
@@ -444,6 +628,25 @@ static struct ipu_psys_ppg *ipu_psys_lookup_ppg(struct ipu_psys *psys,
 	return NULL;
 }
 
+static void ipu_psys_class_stat_add(struct ipu_psys *psys,
+				    const struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys_class_stat *stat = &psys->class_stat[kcmd->sched_class];
+	const u64 *ts = kcmd->ts;
+	unsigned long flags;
+
+	spin_lock_irqsave(&psys->class_lock, flags);
+	if (ts[IPU_PSYS_KCMD_TS_START])
+		ipu_psys_lat_add(&stat->delay, ts[IPU_PSYS_KCMD_TS_START] -
+				 ts[IPU_PSYS_KCMD_TS_NEW]);
+	if (kcmd->deadline) {
+		stat->deadlines++;
+		if (ts[IPU_PSYS_KCMD_TS_COMPLETE] > kcmd->deadline)
+			stat->missed++;
+	}
+	spin_unlock_irqrestore(&psys->class_lock, flags);
+}
+
 /*
  * Move kcmd into completed state (due to running finished or failure).
  * Fill up the event struct and notify waiters.
@@ -458,7 +661,9 @@ void ipu_psys_kcmd_complete(struct ipu_psys_ppg *kppg,
 	kcmd->ev.user_token = kcmd->user_token;
 	kcmd->ev.issue_id = kcmd->issue_id;
 	kcmd->ev.error = error;
-	list_move_tail(&kcmd->list, &kppg->kcmds_finished_list);
+	list_del_init(&kcmd->list);
+	ipu_psys_kcmd_stamp(kcmd, IPU_PSYS_KCMD_TS_COMPLETE);
+	trace_ipu_psys_kcmd_complete(kcmd, error);
 
 	if (kcmd->constraint.min_freq)
 		ipu_buttress_remove_psys_constraint(psys->adev->isp,
@@ -477,6 +682,17 @@ void ipu_psys_kcmd_complete(struct ipu_psys_ppg *kppg,
 	}
 
 	kcmd->state = KCMD_STATE_PPG_COMPLETE;
+	ipu_psys_class_stat_add(psys, kcmd);
+
+	/* Delivered through the shared ring, only the kcmd is left to free */
+	if (ipu_psys_event_ring_post(fh, &kcmd->ev)) {
+		ipu_psys_kcmd_stamp(kcmd, IPU_PSYS_KCMD_TS_DEQUEUE);
+		llist_add(&kcmd->done, &fh->reap_queue);
+		schedule_work(&fh->reap_work);
+		return;
+	}
+
+	llist_add(&kcmd->done, &fh->done_queue);
 	wake_up_interruptible(&fh->wait);
 }
 
@@ -534,28 +750,26 @@ static int ipu_psys_kcmd_send_to_ppg_start(struct ipu_psys_kcmd *kcmd)
 	kppg->fh = fh;
 	kppg->kpg = kcmd->kpg;
 	kppg->state = PPG_STATE_START;
-	kppg->pri_base = kcmd->priority;
+	kppg->pri_base = kcmd->sched_class;
 	kppg->pri_dynamic = 0;
 	INIT_LIST_HEAD(&kppg->list);
 
 	mutex_init(&kppg->mutex);
 	INIT_LIST_HEAD(&kppg->kcmds_new_list);
 	INIT_LIST_HEAD(&kppg->kcmds_processing_list);
-	INIT_LIST_HEAD(&kppg->kcmds_finished_list);
 	INIT_LIST_HEAD(&kppg->sched_list);
 
-	kppg->manifest = kzalloc(kcmd->pg_manifest_size, GFP_KERNEL);
-	if (!kppg->manifest) {
-		kfree(kppg);
-		return -ENOMEM;
-	}
-	memcpy(kppg->manifest, kcmd->pg_manifest,
-	       kcmd->pg_manifest_size);
+	kppg->manifest = ipu_psys_manifest_cache_ref(kcmd->pg_manifest);
+
+	/* Without a footprint the l-scheduler sees no conflicts to plan */
+	if (ipu_psys_resource_footprint(&psys->adev->dev, kcmd->kpg->pg,
+					kppg->manifest, &kppg->footprint))
+		dev_dbg(&psys->adev->dev, "no resource footprint for ppg\n");
 
 	queue_id = ipu_psys_allocate_cmd_queue_resource(rpr);
 	if (queue_id == -ENOSPC) {
 		dev_err(&psys->adev->dev, "no available queue\n");
-		kfree(kppg->manifest);
+		ipu_psys_manifest_cache_put(psys, kppg->manifest);
 		kfree(kppg);
 		mutex_unlock(&psys->mutex);
 		return -ENOMEM;
@@ -572,7 +786,7 @@ static int ipu_psys_kcmd_send_to_ppg_start(struct ipu_psys_kcmd *kcmd)
 					      kcmd->kpg->pg_dma_addr);
 	if (ret) {
 		ipu_psys_free_cmd_queue_resource(rpr, queue_id);
-		kfree(kppg->manifest);
+		ipu_psys_manifest_cache_put(psys, kppg->manifest);
 		kfree(kppg);
 		return -EIO;
 	}
@@ -584,37 +798,44 @@ static int ipu_psys_kcmd_send_to_ppg_start(struct ipu_psys_kcmd *kcmd)
 
 	mutex_lock(&kppg->mutex);
 	list_add(&kcmd->list, &kppg->kcmds_new_list);
+	ipu_psys_scheduler_add_kppg(kppg, SCHED_START_LIST);
 	mutex_unlock(&kppg->mutex);
 
 	dev_dbg(&psys->adev->dev,
 		"START ppg(%d, 0x%p) kcmd 0x%p, queue %d\n",
 		ipu_fw_psys_pg_get_id(kcmd), kppg, kcmd, queue_id);
 
-	/* Kick l-scheduler thread */
-	atomic_set(&psys->wakeup_count, 1);
-	wake_up_interruptible(&psys->sched_cmd_wq);
-
 	return 0;
 }
 
-static int ipu_psys_kcmd_send_to_ppg(struct ipu_psys_kcmd *kcmd)
+/*
+ * Hand kcmd over to its ppg. *resched is set when the l-scheduler has
+ * to run for it; the caller kicks the scheduler thread once all of its
+ * commands have been queued.
+ */
+static int ipu_psys_kcmd_send_to_ppg(struct ipu_psys_kcmd *kcmd,
+				     bool *resched)
 {
 	struct ipu_psys_fh *fh = kcmd->fh;
 	struct ipu_psys *psys = fh->psys;
 	struct ipu_psys_ppg *kppg;
 	struct ipu_psys_resource_pool *rpr;
-	unsigned long flags;
 	u8 id;
-	bool resche = true;
+	int ret;
+
+	ipu_psys_kcmd_stamp(kcmd, IPU_PSYS_KCMD_TS_SEND);
+	trace_ipu_psys_kcmd_send(kcmd);
 
 	rpr = &psys->resource_pool_running;
-	if (kcmd->state == KCMD_STATE_PPG_START)
-		return ipu_psys_kcmd_send_to_ppg_start(kcmd);
+	if (kcmd->state == KCMD_STATE_PPG_START) {
+		ret = ipu_psys_kcmd_send_to_ppg_start(kcmd);
+		if (!ret)
+			*resched = true;
+		return ret;
+	}
 
 	kppg = ipu_psys_identify_kppg(kcmd);
-	spin_lock_irqsave(&psys->pgs_lock, flags);
-	kcmd->kpg->pg_size = 0;
-	spin_unlock_irqrestore(&psys->pgs_lock, flags);
+	__put_pg_buf(psys, kcmd->kpg);
 	if (!kppg) {
 		dev_err(&psys->adev->dev, "token not match\n");
 		return -EINVAL;
@@ -636,82 +857,211 @@ static int ipu_psys_kcmd_send_to_ppg(struct ipu_psys_kcmd *kcmd)
 			ipu_psys_free_cmd_queue_resource(rpr, id);
 			ipu_psys_kcmd_complete(kppg, kcmd, 0);
 			pm_runtime_put(&psys->adev->dev);
-			resche = false;
 		} else {
 			list_add(&kcmd->list, &kppg->kcmds_new_list);
+			*resched = true;
 		}
 		mutex_unlock(&kppg->mutex);
 	} else {
-		int ret;
-
 		ret = ipu_psys_ppg_get_bufset(kcmd, kppg);
 		if (ret)
 			return ret;
 
 		mutex_lock(&kppg->mutex);
 		list_add_tail(&kcmd->list, &kppg->kcmds_new_list);
+		if (kcmd->deadline)
+			ipu_psys_scheduler_requeue_kppg(kppg);
 		mutex_unlock(&kppg->mutex);
+		*resched = true;
 	}
 
-	if (resche) {
-		/* Kick l-scheduler thread */
-		atomic_set(&psys->wakeup_count, 1);
-		wake_up_interruptible(&psys->sched_cmd_wq);
-	}
 	return 0;
 }
 
-int ipu_psys_kcmd_new(struct ipu_psys_command *cmd, struct ipu_psys_fh *fh)
+static void ipu_psys_kick_scheduler(struct ipu_psys *psys)
 {
-	struct ipu_psys *psys = fh->psys;
-	struct ipu_psys_kcmd *kcmd;
-	size_t pg_size;
-	int ret;
+	/* Kick l-scheduler thread */
+	atomic_set(&psys->wakeup_count, 1);
+	wake_up_interruptible(&psys->sched_cmd_wq);
+}
 
-	if (psys->adev->isp->flr_done)
-		return -EIO;
+/*
+ * Finish a resolved kcmd: fetch the manifest of a ppg start and check
+ * the pg. Called without fh->mutex. On failure the caller frees kcmd.
+ */
+static int ipu_psys_kcmd_prepare(struct ipu_psys_command *cmd,
+				 struct ipu_psys_kcmd *kcmd)
+{
+	struct ipu_psys *psys = kcmd->fh->psys;
+	size_t pg_size;
 
-	kcmd = ipu_psys_copy_cmd(cmd, fh);
-	if (!kcmd)
-		return -EINVAL;
+	/* Only a ppg start consumes the manifest, skip it otherwise */
+	if (kcmd->state == KCMD_STATE_PPG_START) {
+		kcmd->pg_manifest =
+			ipu_psys_manifest_cache_get(kcmd->fh,
+						    cmd->pg_manifest,
+						    cmd->pg_manifest_size);
+		if (IS_ERR(kcmd->pg_manifest)) {
+			kcmd->pg_manifest = NULL;
+			return -EINVAL;
+		}
+		kcmd->pg_manifest_size = cmd->pg_manifest_size;
+	}
 
 	pg_size = ipu_fw_psys_pg_get_size(kcmd);
 	if (pg_size > kcmd->kpg->pg_size) {
 		dev_dbg(&psys->adev->dev, "pg size mismatch %lu %lu\n",
 			pg_size, kcmd->kpg->pg_size);
-		ret = -EINVAL;
-		goto error;
+		return -EINVAL;
 	}
 
 	if (ipu_fw_psys_pg_get_protocol(kcmd) !=
 			IPU_FW_PSYS_PROCESS_GROUP_PROTOCOL_PPG) {
 		dev_err(&psys->adev->dev, "No support legacy pg now\n");
-		ret = -EINVAL;
-		goto error;
+		return -EINVAL;
 	}
 
+	trace_ipu_psys_kcmd_new(kcmd);
+
+	return 0;
+}
+
+static int ipu_psys_kcmd_submit(struct ipu_psys_command *cmd,
+				struct ipu_psys_kcmd *kcmd, bool *resched)
+{
+	struct ipu_psys *psys = kcmd->fh->psys;
+	int ret;
+
 	if (cmd->min_psys_freq) {
 		kcmd->constraint.min_freq = cmd->min_psys_freq;
 		ipu_buttress_add_psys_constraint(psys->adev->isp,
 						 &kcmd->constraint);
 	}
 
-	ret = ipu_psys_kcmd_send_to_ppg(kcmd);
-	if (ret)
-		goto error;
+	ret = ipu_psys_kcmd_send_to_ppg(kcmd, resched);
+	if (ret) {
+		/* A failed start never handed its pg buffer to a ppg */
+		struct ipu_psys_pg *kpg = kcmd->state == KCMD_STATE_PPG_START ?
+					  kcmd->kpg : NULL;
+
+		ipu_psys_kcmd_free(kcmd);
+		if (kpg)
+			__put_pg_buf(psys, kpg);
+		return ret;
+	}
 
 	dev_dbg(&psys->adev->dev,
 		"IOC_QCMD: user_token:%llx issue_id:0x%llx pri:%d\n",
 		cmd->user_token, cmd->issue_id, cmd->priority);
 
 	return 0;
+}
 
-error:
-	ipu_psys_kcmd_free(kcmd);
+int ipu_psys_kcmd_new(struct ipu_psys_command *cmd, struct ipu_psys_fh *fh)
+{
+	struct ipu_psys *psys = fh->psys;
+	struct ipu_psys_kcmd *kcmd;
+	bool resched = false;
+	int ret;
+
+	if (psys->adev->isp->flr_done)
+		return -EIO;
+
+	kcmd = ipu_psys_copy_cmd(cmd, fh);
+	if (!kcmd)
+		return -EINVAL;
+
+	mutex_lock(&fh->mutex);
+	ret = ipu_psys_resolve_cmd(cmd, kcmd);
+	mutex_unlock(&fh->mutex);
+	if (!ret)
+		ret = ipu_psys_kcmd_prepare(cmd, kcmd);
+	if (ret) {
+		__ipu_psys_kcmd_free(kcmd);
+		return ret;
+	}
+
+	ret = ipu_psys_kcmd_submit(cmd, kcmd, &resched);
+	if (resched)
+		ipu_psys_kick_scheduler(psys);
 
 	return ret;
 }
 
+/*
+ * Queue a batch of commands. The commands are copied from user space
+ * first; fh->mutex is then held once, only to resolve the buffers of
+ * all of them. If any command fails before it is queued, nothing is
+ * queued. A command failing to be queued after that drops the rest of
+ * the batch; *nqueued tells user space how far it got. The l-scheduler
+ * is kicked once for the whole batch.
+ */
+int ipu_psys_kcmd_new_batch(struct ipu_psys_command *cmds, u32 ncmds,
+			    u32 *nqueued, struct ipu_psys_fh *fh)
+{
+	struct ipu_psys *psys = fh->psys;
+	struct ipu_psys_kcmd **kcmds;
+	bool resched = false;
+	int ret = 0;
+	u32 i;
+
+	if (psys->adev->isp->flr_done)
+		return -EIO;
+
+	kcmds = kcalloc(ncmds, sizeof(*kcmds), GFP_KERNEL);
+	if (!kcmds)
+		return -ENOMEM;
+
+	for (i = 0; i < ncmds; i++) {
+		kcmds[i] = ipu_psys_copy_cmd(&cmds[i], fh);
+		if (!kcmds[i])
+			goto err_free;
+	}
+
+	mutex_lock(&fh->mutex);
+	for (i = 0; i < ncmds; i++)
+		if (ipu_psys_resolve_cmd(&cmds[i], kcmds[i]))
+			break;
+	mutex_unlock(&fh->mutex);
+	if (i < ncmds)
+		goto err_free;
+
+	for (i = 0; i < ncmds; i++)
+		if (ipu_psys_kcmd_prepare(&cmds[i], kcmds[i]))
+			goto err_free;
+
+	for (i = 0; i < ncmds; i++) {
+		ret = ipu_psys_kcmd_submit(&cmds[i], kcmds[i], &resched);
+		if (ret)
+			break;
+	}
+	*nqueued = i;
+
+	/* The rest never reached a ppg and still own their pg buffers */
+	if (i < ncmds) {
+		dev_dbg(&psys->adev->dev,
+			"IOC_QCMD_BATCH: cmd %u failed %d, dropping %u\n",
+			i, ret, ncmds - i - 1);
+		while (++i < ncmds)
+			__ipu_psys_kcmd_free(kcmds[i]);
+	}
+
+	if (resched)
+		ipu_psys_kick_scheduler(psys);
+
+	kfree(kcmds);
+
+	return *nqueued ? 0 : ret;
+
+err_free:
+	dev_dbg(&psys->adev->dev, "IOC_QCMD_BATCH: cmd %u invalid\n", i);
+	for (i = 0; i < ncmds && kcmds[i]; i++)
+		__ipu_psys_kcmd_free(kcmds[i]);
+	kfree(kcmds);
+
+	return -EINVAL;
+}
+
 static bool ipu_psys_kcmd_is_valid(struct ipu_psys *psys,
 				   struct ipu_psys_kcmd *kcmd)
 {
@@ -838,6 +1188,21 @@ void ipu_psys_handle_events(struct ipu_psys *psys)
 	} while (1);
 }
 
+/* Free kcmds whose completion went to the shared event ring */
+static void ipu_psys_reap_work(struct work_struct *work)
+{
+	struct ipu_psys_fh *fh = container_of(work, struct ipu_psys_fh,
+					      reap_work);
+	struct ipu_psys_kcmd *kcmd, *tmp;
+	struct llist_node *done;
+
+	done = llist_del_all(&fh->reap_queue);
+	llist_for_each_entry_safe(kcmd, tmp, done, done) {
+		trace_ipu_psys_kcmd_dequeue(kcmd);
+		ipu_psys_kcmd_free(kcmd);
+	}
+}
+
 int ipu_psys_fh_init(struct ipu_psys_fh *fh)
 {
 	struct ipu_psys *psys = fh->psys;
@@ -848,6 +1213,7 @@ int ipu_psys_fh_init(struct ipu_psys_fh *fh)
 	mutex_init(&sched->bs_mutex);
 	INIT_LIST_HEAD(&sched->buf_sets);
 	INIT_LIST_HEAD(&sched->ppgs);
+	INIT_WORK(&fh->reap_work, ipu_psys_reap_work);
 
 	/* allocate and map memory for buf_sets */
 	for (i = 0; i < IPU_PSYS_BUF_SET_POOL_SIZE; i++) {
@@ -892,13 +1258,31 @@ int ipu_psys_fh_deinit(struct ipu_psys_fh *fh)
 	struct ipu_psys_scheduler *sched = &fh->sched;
 	struct ipu_psys_resource_pool *rpr;
 	struct ipu_psys_resource_alloc *alloc;
+	struct ipu_psys_event_ring *ring;
+	unsigned long flags;
 	u8 id;
 
+	/*
+	 * Detach the event ring first so that completions from stopping
+	 * the ppgs below go to done_queue, and reap what is left while
+	 * the ppgs still exist.
+	 */
+	spin_lock_irqsave(&fh->ring_lock, flags);
+	ring = fh->ring;
+	fh->ring = NULL;
+	spin_unlock_irqrestore(&fh->ring_lock, flags);
+	cancel_work_sync(&fh->reap_work);
+	ipu_psys_reap_work(&fh->reap_work);
+	vfree(ring);
+
+	/*
+	 * The l-scheduler holds psys->mutex while it walks the sched lists
+	 * and uses the kppgs it finds there, so only free them under it.
+	 */
+	mutex_lock(&psys->mutex);
 	mutex_lock(&fh->mutex);
 	if (!list_empty(&sched->ppgs)) {
 		list_for_each_entry_safe(kppg, kppg0, &sched->ppgs, list) {
-			unsigned long flags;
-
 			mutex_lock(&kppg->mutex);
 			if (!(kppg->state &
 			      (PPG_STATE_STOPPED |
@@ -921,6 +1305,8 @@ int ipu_psys_fh_deinit(struct ipu_psys_fh *fh)
 					pm_runtime_put(&psys->adev->dev);
 			}
 			list_del(&kppg->list);
+			ipu_psys_scheduler_remove_kppg(kppg, SCHED_START_LIST);
+			ipu_psys_scheduler_remove_kppg(kppg, SCHED_STOP_LIST);
 			mutex_unlock(&kppg->mutex);
 
 			list_for_each_entry_safe(kcmd, kcmd0,
@@ -940,25 +1326,21 @@ int ipu_psys_fh_deinit(struct ipu_psys_fh *fh)
 				mutex_lock(&fh->mutex);
 			}
 
-			list_for_each_entry_safe(kcmd, kcmd0,
-						 &kppg->kcmds_finished_list,
-						 list) {
-				kcmd->pg_user = NULL;
-				mutex_unlock(&fh->mutex);
-				ipu_psys_kcmd_free(kcmd);
-				mutex_lock(&fh->mutex);
-			}
-
-			spin_lock_irqsave(&psys->pgs_lock, flags);
-			kppg->kpg->pg_size = 0;
-			spin_unlock_irqrestore(&psys->pgs_lock, flags);
+			__put_pg_buf(psys, kppg->kpg);
 
 			mutex_destroy(&kppg->mutex);
-			kfree(kppg->manifest);
+			ipu_psys_manifest_cache_put(psys, kppg->manifest);
 			kfree(kppg);
 		}
 	}
 	mutex_unlock(&fh->mutex);
+	mutex_unlock(&psys->mutex);
+
+	/* Completed but never dequeued */
+	while ((kcmd = ipu_get_completed_kcmd(fh))) {
+		kcmd->pg_user = NULL;
+		ipu_psys_kcmd_free(kcmd);
+	}
 
 	mutex_lock(&sched->bs_mutex);
 	list_for_each_entry_safe(kbuf_set, kbuf_set0, &sched->buf_sets, list) {
@@ -974,36 +1356,39 @@ int ipu_psys_fh_deinit(struct ipu_psys_fh *fh)
 	return 0;
 }
 
+/*
+ * Take the oldest completed kcmd of the fh. Only done_lock is taken, so
+ * this does not wait for the event handler holding psys or fh mutexes.
+ */
 struct ipu_psys_kcmd *ipu_get_completed_kcmd(struct ipu_psys_fh *fh)
 {
-	struct ipu_psys_scheduler *sched = &fh->sched;
-	struct ipu_psys_kcmd *kcmd;
-	struct ipu_psys_ppg *kppg;
-
-	mutex_lock(&fh->mutex);
-	if (list_empty(&sched->ppgs)) {
-		mutex_unlock(&fh->mutex);
-		return NULL;
+	struct ipu_psys_kcmd *kcmd, *tmp;
+	struct llist_node *done;
+
+	spin_lock(&fh->done_lock);
+	if (list_empty(&fh->done_list)) {
+		done = llist_reverse_order(llist_del_all(&fh->done_queue));
+		llist_for_each_entry_safe(kcmd, tmp, done, done)
+			list_add_tail(&kcmd->list, &fh->done_list);
 	}
 
-	list_for_each_entry(kppg, &sched->ppgs, list) {
-		mutex_lock(&kppg->mutex);
-		if (list_empty(&kppg->kcmds_finished_list)) {
-			mutex_unlock(&kppg->mutex);
-			continue;
-		}
+	kcmd = list_first_entry_or_null(&fh->done_list, struct ipu_psys_kcmd,
+					list);
+	if (kcmd)
+		list_del_init(&kcmd->list);
+	spin_unlock(&fh->done_lock);
 
-		kcmd = list_first_entry(&kppg->kcmds_finished_list,
-					struct ipu_psys_kcmd, list);
-		mutex_unlock(&fh->mutex);
-		mutex_unlock(&kppg->mutex);
+	if (kcmd)
 		dev_dbg(&fh->psys->adev->dev,
 			"get completed kcmd 0x%p\n", kcmd);
-		return kcmd;
-	}
-	mutex_unlock(&fh->mutex);
 
-	return NULL;
+	return kcmd;
+}
+
+bool ipu_psys_has_completed_kcmd(struct ipu_psys_fh *fh)
+{
+	return !llist_empty(&fh->done_queue) ||
+	       !list_empty_careful(&fh->done_list);
 }
 
 long ipu_ioctl_dqevent(struct ipu_psys_event *event,
@@ -1030,6 +1415,8 @@ long ipu_ioctl_dqevent(struct ipu_psys_event *event,
 	}
 
 	*event = kcmd->ev;
+	ipu_psys_kcmd_stamp(kcmd, IPU_PSYS_KCMD_TS_DEQUEUE);
+	trace_ipu_psys_kcmd_dequeue(kcmd);
 	ipu_psys_kcmd_free(kcmd);
 
 	return 0;
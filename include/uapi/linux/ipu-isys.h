@@ -14,6 +14,9 @@
 
 #define V4L2_CID_IPU_ENUMERATE_LINK	(V4L2_CID_IPU_BASE + 6)
 
+/* Capture buffers are never accessed by the CPU, skip cache maintenance */
+#define V4L2_CID_IPU_ISYS_DEVICE_ONLY	(V4L2_CID_IPU_BASE + 7)
+
 #define VIDIOC_IPU_GET_DRIVER_VERSION \
 	_IOWR('v', BASE_VIDIOC_PRIVATE + 3, uint32_t)
 
@@ -58,17 +58,39 @@ struct ipu_psys_buffer {
 #define IPU_BUFFER_FLAG_NO_FLUSH	(1 << 3)
 #define IPU_BUFFER_FLAG_DMA_HANDLE	(1 << 4)
 #define IPU_BUFFER_FLAG_USERPTR	(1 << 5)
+/*
+ * Buffer is never accessed by the CPU: skip all cache maintenance. Set on
+ * GETBUF for the lifetime of the buffer, or on a command buffer for that
+ * command only.
+ */
+#define IPU_BUFFER_FLAG_DEVICE_ONLY	(1 << 6)
 
 #define	IPU_PSYS_CMD_PRIORITY_HIGH	0
 #define	IPU_PSYS_CMD_PRIORITY_MED	1
 #define	IPU_PSYS_CMD_PRIORITY_LOW	2
 #define	IPU_PSYS_CMD_PRIORITY_NUM	3
+/*
+ * ORed into the priority of a command to have its sched_class and
+ * deadline_us honoured. Without it both are ignored.
+ */
+#define	IPU_PSYS_CMD_FLAG_SCHED		(1U << 31)
+
+/*
+ * Scheduling class of the process group, taken from its start command.
+ * AUTO derives the class from the priority: HIGH is realtime, MED is
+ * interactive and LOW is batch. Unknown classes are treated as AUTO.
+ */
+#define	IPU_PSYS_SCHED_CLASS_AUTO		0
+#define	IPU_PSYS_SCHED_CLASS_REALTIME		1
+#define	IPU_PSYS_SCHED_CLASS_INTERACTIVE	2
+#define	IPU_PSYS_SCHED_CLASS_BATCH		3
 
 /**
  * struct ipu_psys_command - processing command
  * @issue_id:		unique id for the command set by user
  * @user_token:		token of the command
- * @priority:		priority of the command
+ * @priority:		priority of the command, optionally with
+ *			IPU_PSYS_CMD_FLAG_SCHED
  * @pg_manifest:	userspace pointer to program group manifest
  * @buffers:		userspace pointers to array of psys dma buf structs
  * @pg:			process group DMA-BUF handle
@@ -80,6 +102,10 @@ struct ipu_psys_buffer {
  * @terminal_enable_bitmap:     enable bits for each individual terminals
  * @routing_enable_bitmap:      enable bits for each individual routing
  * @rbm:                        enable bits for routing
+ * @sched_class:	IPU_PSYS_SCHED_CLASS_* of the process group, used
+ *			with IPU_PSYS_CMD_FLAG_SCHED only
+ * @deadline_us:	completion deadline in us from queueing, 0 for none,
+ *			used with IPU_PSYS_CMD_FLAG_SCHED only
  *
  * Specifies a processing command with input and output buffers.
  */
@@ -98,7 +124,62 @@ struct ipu_psys_command {
 	uint32_t terminal_enable_bitmap[4];
 	uint32_t routing_enable_bitmap[4];
 	uint32_t rbm[5];
-	uint32_t reserved[2];
+	uint32_t sched_class;
+	uint32_t deadline_us;
+} __attribute__ ((packed));
+
+/**
+ * struct ipu_psys_command_batch - batch of processing commands
+ * @cmds:	userspace pointer to array of commands
+ * @ncmds:	number of commands in cmds array
+ * @nqueued:	number of commands queued (returned)
+ *
+ * Queues the commands in array order in one call. Buffers of every
+ * command are resolved before any of them is queued, so on a validation
+ * error the call fails and no command of the batch is queued. If
+ * queueing a command fails after that, the commands before it stay
+ * queued and the rest are dropped. The call then succeeds with @nqueued
+ * less than @ncmds, or fails if the first command could not be queued.
+ */
+struct ipu_psys_command_batch {
+	struct ipu_psys_command __user *cmds;
+	uint32_t ncmds;
+	uint32_t nqueued;
+	uint32_t reserved[4];
+} __attribute__ ((packed));
+
+/**
+ * struct ipu_psys_event_ring_setup - shared completion ring
+ * @eventfd:	eventfd signalled for each posted event, -1 for none
+ * @entries:	number of events in the ring, a power of two
+ * @mmap_size:	size to mmap() at offset 0 of the device (returned)
+ *
+ * Command completions of the file handle are written to a ring shared
+ * with user space instead of being queued for IPU_IOC_DQEVENT. When the
+ * ring is full the event is queued for IPU_IOC_DQEVENT as before.
+ */
+struct ipu_psys_event_ring_setup {
+	int32_t eventfd;
+	uint32_t entries;
+	uint32_t mmap_size;
+	uint32_t reserved[5];
+} __attribute__ ((packed));
+
+/**
+ * struct ipu_psys_event_ring - mapped completion ring
+ * @head:	next event to consume, advanced by user space
+ * @tail:	next event to fill, advanced by the kernel
+ * @mask:	number of events - 1
+ * @overflow:	events that did not fit and went to IPU_IOC_DQEVENT
+ * @events:	the events, slot is index & @mask
+ */
+struct ipu_psys_event_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t mask;
+	uint32_t overflow;
+	uint32_t reserved[12];
+	struct ipu_psys_event events[];
 } __attribute__ ((packed));
 
 struct ipu_psys_manifest {
@@ -117,5 +198,7 @@ struct ipu_psys_manifest {
 #define IPU_IOC_DQEVENT _IOWR('A', 7, struct ipu_psys_event)
 #define IPU_IOC_CMD_CANCEL _IOWR('A', 8, struct ipu_psys_command)
 #define IPU_IOC_GET_MANIFEST _IOWR('A', 9, struct ipu_psys_manifest)
+#define IPU_IOC_QCMD_BATCH _IOWR('A', 10, struct ipu_psys_command_batch)
+#define IPU_IOC_EVENT_RING _IOWR('A', 11, struct ipu_psys_event_ring_setup)
 
 #endif /* _UAPI_IPU_PSYS_H */